@@ -0,0 +1,35 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include "bucket.h"
+
+// the bucket starts full, so a short burst is allowed right away
+void bucket_init(bucket_t* bucket, uint64_t rate, uint64_t now) {
+    bucket->tokens = rate*1000;
+    bucket->last = now;
+}
+
+// refill the bucket and tell whether anything can be taken
+bool_t bucket_ready(bucket_t* bucket, uint64_t rate, uint64_t now) {
+    if(rate == 0)
+        return 1;
+    if(now > bucket->last) {
+        bucket->tokens += (now-bucket->last)*rate;
+        if(bucket->tokens > (int64_t)(rate*1000))
+            bucket->tokens = rate*1000;
+        bucket->last = now;
+    }
+    return bucket->tokens > 0;
+}
+
+// take the tokens after bucket_ready, the cost may exceed the tokens so that nothing is too large to ever pass
+void bucket_take(bucket_t* bucket, uint64_t rate, uint64_t cost) {
+    if(rate != 0)
+        bucket->tokens -= cost*1000;
+}
+
+// milliseconds until bucket_ready succeeds again
+uint64_t bucket_wait(const bucket_t* bucket, uint64_t rate) {
+    if(rate == 0 || bucket->tokens > 0)
+        return 0;
+    return -bucket->tokens/rate+1;
+}
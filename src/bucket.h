@@ -0,0 +1,22 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __BUCKET_H__
+#define __BUCKET_H__
+
+#include "types.h"
+
+// token bucket holding at most one second worth of tokens, rates are in units per second and a rate of zero
+// means there is no limit, the tokens are kept in thousandths of a unit so refilling every millisecond loses nothing
+typedef struct {
+    int64_t tokens; // negative after something larger than the remaining tokens was taken
+    uint64_t last;  // time of the last refill in milliseconds
+} bucket_t;
+
+void bucket_init(bucket_t* bucket, uint64_t rate, uint64_t now);
+
+bool_t bucket_ready(bucket_t* bucket, uint64_t rate, uint64_t now);
+
+void bucket_take(bucket_t* bucket, uint64_t rate, uint64_t cost);
+
+uint64_t bucket_wait(const bucket_t* bucket, uint64_t rate);
+
+#endif
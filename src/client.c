@@ -11,6 +11,8 @@
 #include <poll.h>
 #include <ctype.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "client.h"
 #include "termio.h"
@@ -29,6 +31,74 @@
 #define MAX_IMG_WIDTH 1024
 #define MAX_IMG_HEIGHT 1024
 
+// tell the server which messages we want, that we answer heartbeats and understand envelopes, without a group we want everything
+// epoch and last_seq identify the last message we received, both are zero if we were never connected
+static void client_hello(int sock, const config_t* conf, bool_t use_group, uint64_t epoch, uint64_t last_seq) {
+    char hello[TMP_BUFFER_LEN];
+    if(use_group)
+        snprintf(hello, TMP_BUFFER_LEN, "HELLO\nproto=%d\nmax_frame=%lu\ngroup=%s\nresume=%lu:%lu\nheartbeat=1\n", ENVELOPE_VERSION, conf->max_frame, conf->group, epoch, last_seq);
+    else
+        snprintf(hello, TMP_BUFFER_LEN, "HELLO\nproto=%d\nmax_frame=%lu\nresume=%lu:%lu\nheartbeat=1\n", ENVELOPE_VERSION, conf->max_frame, epoch, last_seq);
+    net_sendctrl(sock, hello, strlen(hello), NET_VERSION);
+}
+
+// receive the id the server gave us, it is the first thing the server sends
+static error_t client_recv_id(int sock, id_t* id) {
+    uint8_t buffer[sizeof(id_t)];
+    if(recv(sock, buffer, sizeof(id_t), MSG_WAITALL) != sizeof(id_t))
+        return ERROR;
+    *id = 0;
+    for(uint32_t i = 0; i < sizeof(id_t); i++)
+        *id |= (id_t)buffer[i] << (8*i);
+    return OK;
+}
+
+// send a line the user entered as a message
+static void client_send_line(int sock, const config_t* conf, id_t id, bool_t use_enc, char* line, len_t len, uint8_t version) {
+    msgbuf_t msg;
+    msg.cid = id;
+    msg.name = conf->name;
+    msg.group = conf->group;
+    msg.data_len = len;
+    msg.data = line;
+    msg.flag = (use_enc ? FLAG_MSG_ENC : 0);
+    if(use_enc) {
+        hash_sha512(msg.key, (const uint8_t*)conf->passwd, strlen(conf->passwd));
+        hash_sha512(msg.ind, (const uint8_t*)conf->passwd, strlen(conf->passwd)-1);
+    }
+    net_sendmsg(sock, &msg, version);
+}
+
+// start to connect to the server again after the connection was lost, the connection is established while
+// the main loop keeps running, returns the socket or -1 if it failed right away
+static int client_start_connect(const struct sockaddr* addr, socklen_t addr_len) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == -1)
+        return -1;
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    if(connect(sock, addr, addr_len) == -1 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// the socket of client_start_connect became writable, if it is connected it blocks again and the hello is sent
+static error_t client_finish_connect(int sock, const config_t* conf, bool_t use_group, uint64_t epoch, uint64_t last_seq) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+        return ERROR;
+    fcntl(sock, F_SETFL, 0);
+    struct timeval tv;
+    tv.tv_sec = TIMEOUT_SEC;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+    client_hello(sock, conf, use_group, epoch, last_seq);
+    return OK;
+}
+
 error_t client_main(const config_t conf) {
     bool_t use_dis = conf.flag & FLAG_CONF_AUTO_DIS;
     bool_t use_udp = use_dis;
@@ -165,16 +235,29 @@ error_t client_main(const config_t conf) {
 
     id_t id = 0;
     id_t last_cid = ~0;
-    int len;
+    // sequence numbers of the server, after reconnecting only the messages we missed are sent again
+    uint64_t epoch = 0;     // zero if the server does not support it
+    uint64_t last_seq = 0;
+    uint64_t next_seq = 0;  // sequence number of the message that is received next, zero if it is unknown
+    bool_t resuming = 0;    // everything is ignored until the server tells us where the resumed stream starts
+    // every connection starts with version 1 of the protocol, the server tells us once it sends envelopes
+    uint8_t send_version = NET_VERSION;
+    uint8_t recv_version = NET_VERSION;
+    struct timeval last_connect;
+    gettimeofday(&last_connect, NULL);
+    // connection to the server that is being established after the connection was lost, -1 if there is none
+    int connecting = -1;
+    bool_t hello_sent = 0;  // connecting is established and waits for the id the server gives us
+    // lines entered while the connection is lost, separated by newlines, they are sent once we are connected again
+    char* unsent = NULL;
+    len_t unsent_len = 0;
+    len_t num_unsent = 0;
 
     if(!end) {
-        len = recv(sock, buffer, sizeof(id_t), MSG_WAITALL);
+        // the hello is sent first, so the server knows about it before it sends the history
+        client_hello(sock, &conf, use_group, 0, 0);
         // get the id
-        if(len == sizeof(id_t)) {
-            id = 0;
-            for(uint32_t i = 0; i < sizeof(id_t); i++)
-                id |= (id_t)(uint8_t)buffer[i] << (8*i);
-        } else {
+        if(client_recv_id(sock, &id) == ERROR) {
             perror("didn't recv client id");
             return ERROR;
         }
@@ -192,7 +275,7 @@ error_t client_main(const config_t conf) {
                 hash_sha512(msg.key, (const uint8_t*)conf.passwd, strlen(conf.passwd));
                 hash_sha512(msg.ind, (const uint8_t*)conf.passwd, strlen(conf.passwd)-1);
             }
-            net_sendmsg(sock, &msg);
+            net_sendmsg(sock, &msg, send_version);
         }
     }
 
@@ -223,13 +306,73 @@ error_t client_main(const config_t conf) {
 
         term_reset_promt();
 
+        if(sock == -1 && connecting == -1) /* try to reconnect once per second */ {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            if(now.tv_sec != last_connect.tv_sec) {
+                last_connect = now;
+                connecting = client_start_connect(server_addr, server_addr_len);
+                hello_sent = 0;
+                listenfd[1].fd = connecting;
+                listenfd[1].events = POLLOUT;
+                listenfd[1].revents = 0;
+            }
+        } else if(connecting != -1) /* polled like the connection, so the ui keeps running while it takes */ {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            bool_t failed = (now.tv_sec-last_connect.tv_sec) > TIMEOUT_SEC;
+            if(!hello_sent && listenfd[1].revents != 0) {
+                failed = client_finish_connect(connecting, &conf, use_group, epoch, last_seq) == ERROR;
+                hello_sent = 1;
+                listenfd[1].events = POLLIN;
+            } else if(hello_sent && listenfd[1].revents != 0) {
+                failed = !(listenfd[1].revents & POLLIN) || client_recv_id(connecting, &id) == ERROR;
+                if(!failed) {
+                    sock = connecting;
+                    connecting = -1;
+                }
+            }
+            listenfd[1].revents = 0;
+            if(failed) {
+                close(connecting);
+                connecting = -1;
+                listenfd[1].fd = -1;
+            } else if(sock != -1) {
+                resuming = 1;
+                next_seq = 0;
+                send_version = NET_VERSION;
+                recv_version = NET_VERSION;
+                for(len_t start = 0; start < unsent_len;) {
+                    len_t end_line = start;
+                    while(unsent[end_line] != '\n')
+                        end_line++;
+                    client_send_line(sock, &conf, id, use_enc, unsent+start, end_line-start, send_version);
+                    start = end_line+1;
+                }
+                free(unsent);
+                unsent = NULL;
+                unsent_len = 0;
+                num_unsent = 0;
+            }
+        }
+
         // get mesages
-        if(listenfd[1].revents & POLLIN) {
+        if(sock != -1 && listenfd[1].revents & POLLIN) {
             msgbuf_t msg;
             if(use_enc)
                 hash_sha512(msg.key, (const uint8_t*)conf.passwd, strlen(conf.passwd));
-            error_t ret = net_recvmsg(sock, &msg);
-            if(ret == OK) {
+            error_t ret = net_recvmsg(sock, &msg, conf.max_frame, recv_version);
+            if(ret == OK && msg.seq != 0) /* the envelope holds the sequence number */
+                next_seq = msg.seq;
+            if(ret == OK && (resuming || (next_seq != 0 && next_seq <= last_seq))) /* we already have this message */ {
+                free(msg.name);
+                free(msg.group);
+                free(msg.data);
+                next_seq = 0;
+            } else if(ret == OK) {
+                if(next_seq != 0)
+                    last_seq = next_seq;
+                next_seq = 0;
                 if(!use_group || (msg.group != NULL && strcmp(msg.group, conf.group) == 0)) {
                     if(msg.flag & FLAG_MSG_TYP) /* typing info */ {
                         if(msg.cid != id && strcmp(status, "...") != 0) {
@@ -274,9 +417,49 @@ error_t client_main(const config_t conf) {
                 }
                 free(msg.name);
                 free(msg.group);
+            } else if(ret == TOO_LARGE) {
+                snprintf(status, STATUS_BUFFER_LEN, "skipped a message that was too large...");
+                gettimeofday(&last_status, NULL);
+                max_status_time_usec = 2000000;
+            } else if(ret == CTRL_DATA) {
+                if(msg.cid == SEQ_ID && msg.data_len == sizeof(uint64_t)) /* sequence number of the next message */ {
+                    next_seq = 0;
+                    for(uint32_t i = 0; i < sizeof(uint64_t); i++)
+                        next_seq |= (uint64_t)(uint8_t)msg.data[i] << (8*i);
+                } else if(msg.cid == CTRL_ID && msg.data_len > 0 && msg.data[msg.data_len-1] == 0) {
+                    uint64_t new_epoch;
+                    uint64_t resume;
+                    if(sscanf(msg.data, "WELCOME\nepoch=%lu\nresume=%lu\n", &new_epoch, &resume) == 2) /* the resumed stream starts here */ {
+                        if(new_epoch != epoch) /* the server restarted, its sequence numbers start again */
+                            last_seq = 0;
+                        if(resuming) {
+                            snprintf(status, STATUS_BUFFER_LEN, resume == 0 ? "reconnected, showing the whole history..." : "reconnected...");
+                            gettimeofday(&last_status, NULL);
+                            max_status_time_usec = 2000000;
+                        }
+                        epoch = new_epoch;
+                        resuming = 0;
+                    } else if(strcmp(msg.data, "PING\n") == 0) /* the server wants to know that we are still here */ {
+                        static const char pong[] = "PONG\n";
+                        net_sendctrl(sock, pong, strlen(pong), send_version);
+                    } else if(strcmp(msg.data, "PROTO\nversion=2\n") == 0 && recv_version == NET_VERSION) /* everything after this is an envelope */ {
+                        static const char proto[] = "PROTO\nversion=2\n";
+                        recv_version = ENVELOPE_VERSION;
+                        net_sendctrl(sock, proto, strlen(proto), send_version);
+                        send_version = ENVELOPE_VERSION;
+                    }
+                }
+                free(msg.data);
             } else if(ret == CONNECTION_CLOSED) {
-                // disconnected
-                end = 1;
+                if(epoch == 0) /* the server can not resume, so there is nothing to reconnect to */
+                    end = 1;
+                else {
+                    close(sock);
+                    sock = -1;
+                    listenfd[1].fd = -1;
+                    snprintf(status, STATUS_BUFFER_LEN, "connection lost, reconnecting...");
+                    max_status_time_usec = 0;
+                }
             }
         }
         // print input
@@ -314,6 +497,10 @@ error_t client_main(const config_t conf) {
                         buff_len++;
                     } else if(tmp_in[i] == 3 /* <C-c> */ || tmp_in[i] == 4 /* <C-D> */) {
                         end = 1;
+                    } else if(tmp_in[i] == 1 /* <C-a> */ && sock == -1) /* the path stays, so it can be sent once we are connected again */ {
+                        snprintf(status, STATUS_BUFFER_LEN, "connection lost, the image was not sent...");
+                        gettimeofday(&last_status, NULL);
+                        max_status_time_usec = 2000000;
                     } else if(tmp_in[i] == 1 /* <C-a> */) {
                         img_data_t img;
                         int n;
@@ -349,7 +536,7 @@ error_t client_main(const config_t conf) {
                                 hash_sha512(msg.ind, (const uint8_t*)conf.passwd, strlen(conf.passwd)-1);
                             }
 
-                            net_sendmsg(sock, &msg);
+                            net_sendmsg(sock, &msg, send_version);
                             stbi_image_free(img.data);
                             free(msg.data);
 
@@ -371,20 +558,18 @@ error_t client_main(const config_t conf) {
                             }
                         }
                     } else if(tmp_in[i] == '\n') /* enter => send */ {
-                        if(buff_len > 0) {
-                            msgbuf_t msg;
-                            msg.cid = id;
-                            msg.name = conf.name;
-                            msg.group = conf.group;
-                            msg.data_len = buff_len;
-                            msg.data = buffer;
-                            msg.flag = (use_enc ? FLAG_MSG_ENC : 0);
-                            if(use_enc) {
-                                hash_sha512(msg.key, (const uint8_t*)conf.passwd, strlen(conf.passwd));
-                                hash_sha512(msg.ind, (const uint8_t*)conf.passwd, strlen(conf.passwd)-1);
-                            }
-
-                            net_sendmsg(sock, &msg);
+                        if(buff_len > 0 && sock == -1) /* keep it until we are connected again */ {
+                            unsent = (char*)realloc(unsent, unsent_len+buff_len+1);
+                            memcpy(unsent+unsent_len, buffer, buff_len);
+                            unsent[unsent_len+buff_len] = '\n';
+                            unsent_len += buff_len+1;
+                            num_unsent++;
+                            snprintf(status, STATUS_BUFFER_LEN, "connection lost, %lu unsent, reconnecting...", num_unsent);
+                            max_status_time_usec = 0;
+                            buff_len = 0;
+                            cursor_pos = 0;
+                        } else if(buff_len > 0) {
+                            client_send_line(sock, &conf, id, use_enc, buffer, buff_len, send_version);
 
                             buff_len = 0;
                             cursor_pos = 0;
@@ -416,7 +601,7 @@ error_t client_main(const config_t conf) {
                             cursor_pos += num_byte;
                             buff_len += num_byte;
                             // send typing info
-                            if(use_typing) {
+                            if(use_typing && sock != -1) {
                                 msgbuf_t msg;
                                 msg.cid = id;
                                 msg.name = conf.name;
@@ -428,7 +613,7 @@ error_t client_main(const config_t conf) {
                                     hash_sha512(msg.key, (const uint8_t*)conf.passwd, strlen(conf.passwd));
                                     hash_sha512(msg.ind, (const uint8_t*)conf.passwd, strlen(conf.passwd)-1);
                                 }
-                                net_sendmsg(sock, &msg);
+                                net_sendmsg(sock, &msg, send_version);
                             }
                         }
                     }
@@ -438,9 +623,11 @@ error_t client_main(const config_t conf) {
     }
     term_reset_promt();
     term_end(use_alternet);
+    if(num_unsent != 0)
+        fprintf(stderr, "%lu messages were not sent, the connection was lost\n", num_unsent);
 
     // send exit info
-    if(use_enter_exit) {
+    if(use_enter_exit && sock != -1) {
         msgbuf_t msg;
         msg.cid = id;
         msg.name = conf.name;
@@ -452,14 +639,18 @@ error_t client_main(const config_t conf) {
             hash_sha512(msg.key, (const uint8_t*)conf.passwd, strlen(conf.passwd));
             hash_sha512(msg.ind, (const uint8_t*)conf.passwd, strlen(conf.passwd)-1);
         }
-        net_sendmsg(sock, &msg);
+        net_sendmsg(sock, &msg, send_version);
     }
 
     if(use_udp)
         close(udp_sock);
-    close(sock);
+    if(sock != -1)
+        close(sock);
+    if(connecting != -1)
+        close(connecting);
 
     free(buffer);
+    free(unsent);
 
     return OK;
 }
@@ -0,0 +1,61 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+void dedup_init(dedup_table_t* table) {
+    memset(table, 0, sizeof(dedup_table_t));
+}
+
+void dedup_free(dedup_table_t* table) {
+    free(table->origins);
+    memset(table, 0, sizeof(dedup_table_t));
+}
+
+// there are only a few origins, one per server that was ever started, so they are searched linearly
+static dedup_origin_t* dedup_find(dedup_table_t* table, uint64_t origin) {
+    for(len_t i = 0; i < table->count; i++)
+        if(table->origins[i].origin == origin)
+            return &table->origins[i];
+    if(table->count == table->cap) {
+        table->cap = table->cap == 0 ? 8 : 2*table->cap;
+        table->origins = (dedup_origin_t*)realloc(table->origins, sizeof(dedup_origin_t)*table->cap);
+    }
+    dedup_origin_t* entry = &table->origins[table->count++];
+    memset(entry, 0, sizeof(dedup_origin_t));
+    entry->origin = origin;
+    return entry;
+}
+
+// mark the message as seen, returns 0 if it was already seen before (sequence numbers start at one)
+bool_t dedup_check(dedup_table_t* table, uint64_t origin, uint64_t seq) {
+    dedup_origin_t* entry = dedup_find(table, origin);
+    if(seq > entry->last) /* shift the window so that bit zero is the new sequence number */ {
+        uint64_t shift = seq-entry->last;
+        if(shift >= DEDUP_WINDOW) {
+            memset(entry->window, 0, sizeof(entry->window));
+        } else {
+            len_t words = shift/64;
+            len_t bits = shift%64;
+            for(len_t i = DEDUP_WINDOW/64; i-- > 0;) {
+                uint64_t value = 0;
+                if(i >= words) {
+                    value = entry->window[i-words] << bits;
+                    if(bits != 0 && i > words)
+                        value |= entry->window[i-words-1] >> (64-bits);
+                }
+                entry->window[i] = value;
+            }
+        }
+        entry->last = seq;
+        entry->window[0] |= 1;
+        return 1;
+    }
+    uint64_t age = entry->last-seq;
+    if(age >= DEDUP_WINDOW || (entry->window[age/64] & ((uint64_t)1 << (age%64))))
+        return 0;
+    entry->window[age/64] |= (uint64_t)1 << (age%64);
+    return 1;
+}
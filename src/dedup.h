@@ -0,0 +1,31 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include "types.h"
+
+// number of sequence numbers before the highest one that are remembered, older ones count as seen
+#define DEDUP_WINDOW 1024
+
+// messages seen from a single origin, bit i of the window is set if the sequence number last-i was seen
+typedef struct {
+    uint64_t origin;
+    uint64_t last;
+    uint64_t window[DEDUP_WINDOW/64];
+} dedup_origin_t;
+
+// remembers which (origin, sequence number) pairs were already seen, messages of a single origin
+// may arrive over multiple paths and slightly out of order
+typedef struct {
+    dedup_origin_t* origins;
+    len_t count;
+    len_t cap;
+} dedup_table_t;
+
+void dedup_init(dedup_table_t* table);
+
+void dedup_free(dedup_table_t* table);
+
+bool_t dedup_check(dedup_table_t* table, uint64_t origin, uint64_t seq);
+
+#endif
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include "envelope.h"
+
+#define VARINT_MAX_LEN 10
+
+// write the value with 7 bits per byte, the highest bit is set if more bytes follow, returns the number of bytes
+static len_t envelope_put(char* out, uint64_t value) {
+    len_t len = 0;
+    while(value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+// read a value written by envelope_put, returns ERROR if it does not end before len
+static error_t envelope_get(const char* data, len_t len, len_t* pos, uint64_t* value) {
+    *value = 0;
+    for(len_t i = 0; i < VARINT_MAX_LEN && *pos < len; i++) {
+        uint8_t byte = data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << (7*i);
+        if(!(byte & 0x80))
+            return OK;
+    }
+    return ERROR;
+}
+
+// write the head of the envelope to out, the payload follows it, returns the length of the head
+len_t envelope_head(char* out, const envelope_t* env) {
+    char fields[ENVELOPE_MAX_HEAD];
+    len_t len = 0;
+    fields[len++] = env->type;
+    fields[len++] = env->flags;
+    len += envelope_put(fields+len, env->group);
+    len += envelope_put(fields+len, env->seq);
+    len += envelope_put(fields+len, env->id);
+    len_t head_len = envelope_put(out, len+env->payload_len);
+    for(len_t i = 0; i < len; i++)
+        out[head_len+i] = fields[i];
+    return head_len+len;
+}
+
+// size of the envelope starting at data including its length, zero if the length is not yet complete
+// a length that does not fit returns the largest size, so it is rejected like any other envelope that is too large
+len_t envelope_size(const char* data, len_t len) {
+    len_t pos = 0;
+    uint64_t size;
+    if(envelope_get(data, len, &pos, &size) == ERROR)
+        return pos < VARINT_MAX_LEN ? 0 : ~(len_t)0;
+    return size > ~(len_t)0-pos ? ~(len_t)0 : pos+size;
+}
+
+// split the head of the envelope into its fields, only the head has to be in data, the payload points to where it
+// starts and payload_len is its whole length, returns ERROR if the head is malformed or not yet complete
+error_t envelope_parse_head(const char* data, len_t len, envelope_t* env) {
+    len_t pos = 0;
+    uint64_t size;
+    uint64_t group;
+    uint64_t id;
+    if(envelope_get(data, len, &pos, &size) == ERROR || len-pos < 2 || size > ~(len_t)0-pos)
+        return ERROR;
+    len_t end = pos+size;
+    env->type = data[pos++];
+    env->flags = data[pos++];
+    if(envelope_get(data, len, &pos, &group) == ERROR || envelope_get(data, len, &pos, &env->seq) == ERROR
+        || envelope_get(data, len, &pos, &id) == ERROR || group > (uint32_t)~0 || id > (id_t)~0 || pos > end)
+        return ERROR;
+    env->group = group;
+    env->id = id;
+    env->payload = data+pos;
+    env->payload_len = end-pos;
+    return OK;
+}
+
+// split the complete envelope into its fields, the payload points into data
+error_t envelope_parse(const char* data, len_t len, envelope_t* env) {
+    if(envelope_parse_head(data, len, env) == ERROR || env->payload+env->payload_len != data+len)
+        return ERROR;
+    return OK;
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __ENVELOPE_H__
+#define __ENVELOPE_H__
+
+#include "types.h"
+
+// version 2 of the protocol, a client asks for it with "proto=2" in its HELLO, the server answers with the control
+// message "PROTO\nversion=2\n" and the client sends the same message once it received it, every message that follows
+// in that direction is an envelope <len><type:1><flags:1><group><seq><id><payload>, where len counts everything after
+// itself and all numbers but type and flags are varints, so the receiver knows everything without parsing the payload
+#define ENVELOPE_VERSION 2
+#define ENVELOPE_MAX_HEAD 32    // length, type, flags, group, sequence number and id with their largest values
+
+// type of the envelope
+#define ENVELOPE_MSG 0  // message of a client, the payload is the body of a version 1 message
+#define ENVELOPE_CTRL 1 // control message, handled by the server or client and never forwarded
+
+// flags of the envelope
+#define ENVELOPE_EPHEMERAL 1    // only the latest one of the sender matters (e.g. typing info)
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t group;     // id of the group on the server plus one, zero if there is none
+    uint64_t seq;       // sequence number of the server, zero if there is none
+    id_t id;            // id of the sender
+    const char* payload;
+    len_t payload_len;
+} envelope_t;
+
+len_t envelope_head(char* out, const envelope_t* env);
+
+len_t envelope_size(const char* data, len_t len);
+
+error_t envelope_parse_head(const char* data, len_t len, envelope_t* env);
+
+error_t envelope_parse(const char* data, len_t len, envelope_t* env);
+
+#endif
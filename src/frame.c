@@ -0,0 +1,78 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "group.h"
+
+// write the SEQ_ID message holding seq to out
+void frame_stamp(char* out, uint64_t seq) {
+    for(len_t i = 0; i < sizeof(id_t); i++)
+        out[i] = (SEQ_ID >> (8*i)) & 0xff;
+    for(len_t i = 0; i < sizeof(len_t); i++)
+        out[sizeof(id_t)+i] = (sizeof(uint64_t) >> (8*i)) & 0xff;
+    for(len_t i = 0; i < sizeof(uint64_t); i++)
+        out[sizeof(id_t)+sizeof(len_t)+i] = (seq >> (8*i)) & 0xff;
+}
+
+// create a new frame with room for len bytes, the caller owns the only reference
+// the data has to be filled in before the frame is shared
+frame_t* frame_alloc(len_t len, uint64_t seq) {
+    frame_t* frame = (frame_t*)malloc(sizeof(frame_t)+len);
+    atomic_init(&frame->ref, 1);
+    frame->seq = seq;
+    frame->group = GROUP_ALL;
+    frame->flags = 0;
+    frame->time = 0;
+    frame->relay = 0;
+    atomic_init(&frame->written, 0);
+    frame->head_len = 0;
+    frame->len = len;
+    frame_stamp(frame->stamp, seq);
+    return frame;
+}
+
+// create a new frame holding a copy of the data
+frame_t* frame_create(const char* data, len_t len, uint64_t seq) {
+    frame_t* frame = frame_alloc(len, seq);
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+// compute the envelope of the message in the frame, once its sequence number, group and flags are final
+// frames that are not sealed (ids, pieces of the history) are written as they are to every client
+// the length is taken from the header, the frame may only hold the start of the message
+void frame_seal(frame_t* frame) {
+    envelope_t env;
+    env.id = 0;
+    for(len_t i = 0; i < sizeof(id_t); i++)
+        env.id |= (id_t)(uint8_t)frame->data[i] << (8*i);
+    env.payload_len = 0;
+    for(len_t i = 0; i < sizeof(len_t); i++)
+        env.payload_len |= (len_t)(uint8_t)frame->data[sizeof(id_t)+i] << (8*i);
+    env.type = env.id == CTRL_ID ? ENVELOPE_CTRL : ENVELOPE_MSG;
+    if(env.type == ENVELOPE_CTRL)
+        env.id = 0;
+    env.flags = (frame->flags & FRAME_EPHEMERAL) ? ENVELOPE_EPHEMERAL : 0;
+    env.group = frame->group == GROUP_ALL ? 0 : frame->group+1;
+    env.seq = frame->seq;
+    frame->head_len = envelope_head(frame->head, &env);
+}
+
+frame_t* frame_ref(frame_t* frame) {
+    atomic_fetch_add_explicit(&frame->ref, 1, memory_order_relaxed);
+    return frame;
+}
+
+// drop a reference without freeing the frame, returns true if it was the last one
+// the caller then owns the frame and has to free it
+bool_t frame_release(frame_t* frame) {
+    return atomic_fetch_sub_explicit(&frame->ref, 1, memory_order_acq_rel) == 1;
+}
+
+// the frame is freed when the last reference is dropped
+void frame_unref(frame_t* frame) {
+    if(frame_release(frame))
+        free(frame);
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "envelope.h"
+
+// the frame can be dropped without the client missing anything important (e.g. typing info)
+#define FRAME_EPHEMERAL 1
+// the frame is tagged with its origin and only sent to the other servers of the federation
+#define FRAME_PEER 2
+// the frame was received from a peer by another worker, the first worker handles every message of the peers
+#define FRAME_FROM_PEER 4
+// the frame holds the header and the start of a message that is relayed while it is received,
+// the rest follows in frames with FRAME_PART and nothing else may be written to a client in between
+#define FRAME_FIRST 8
+#define FRAME_PART 16
+// the last piece of a relayed message
+#define FRAME_LAST 32
+// the relayed message can not be completed, its frames are removed from the queues of its recipients
+#define FRAME_CANCEL 64
+
+// immutable message shared by every outbound queue it is added to
+typedef struct {
+    atomic_uint ref;
+    uint64_t seq;
+    uint32_t group; // only members of this group receive the frame
+    uint8_t flags;
+    uint64_t time;  // time the message was received at in nanoseconds, zero if it was not received from a client
+    uint64_t relay; // sequence number of the relayed message the frame belongs to, zero for other frames
+    atomic_bool written;    // the frame was written to at least one client
+    char stamp[SEQ_MSG_LEN];    // the sequence number, written before the frame to clients that asked for it
+    // replaces the header of the message for clients using envelopes, zero if the frame is written as it is
+    uint8_t head_len;
+    char head[ENVELOPE_MAX_HEAD];
+    len_t len;
+    char data[];    // <id><len><message>
+} frame_t;
+
+void frame_stamp(char* out, uint64_t seq);
+
+frame_t* frame_alloc(len_t len, uint64_t seq);
+
+frame_t* frame_create(const char* data, len_t len, uint64_t seq);
+
+void frame_seal(frame_t* frame);
+
+frame_t* frame_ref(frame_t* frame);
+
+bool_t frame_release(frame_t* frame);
+
+void frame_unref(frame_t* frame);
+
+#endif
@@ -0,0 +1,75 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "group.h"
+#include "hash.h"
+
+#define START_GROUP_TABLE_CAP 64
+
+void group_init(group_table_t* table) {
+    memset(table, 0, sizeof(group_table_t));
+}
+
+void group_free(group_table_t* table) {
+    for(len_t i = 0; i < table->count; i++) {
+        free(table->groups[i]->name);
+        free(table->groups[i]);
+    }
+    free(table->groups);
+    free(table->table);
+    memset(table, 0, sizeof(group_table_t));
+}
+
+// insert the group into the hash table, there has to be a free slot
+static void group_insert(group_t** slots, len_t cap, group_t* group) {
+    len_t i = group->hash & (cap-1);
+    while(slots[i] != NULL)
+        i = (i+1) & (cap-1);
+    slots[i] = group;
+}
+
+// return the id of the group with the given name, GROUP_NONE if it does not exist
+uint32_t group_find(const group_table_t* table, const char* name, len_t len) {
+    if(table->table_cap == 0)
+        return GROUP_NONE;
+    hash32_t hash = hash_fnv_1a32((const uint8_t*)name, len);
+    len_t i = hash & (table->table_cap-1);
+    while(table->table[i] != NULL) {
+        group_t* group = table->table[i];
+        if(group->hash == hash && strlen(group->name) == len && memcmp(group->name, name, len) == 0)
+            return group->id;
+        i = (i+1) & (table->table_cap-1);
+    }
+    return GROUP_NONE;
+}
+
+// return the id of the group with the given name, the group is created if it does not exist
+uint32_t group_intern(group_table_t* table, const char* name, len_t len) {
+    uint32_t id = group_find(table, name, len);
+    if(id != GROUP_NONE)
+        return id;
+    hash32_t hash = hash_fnv_1a32((const uint8_t*)name, len);
+    // keep the load factor below one half
+    if(2*(table->count+1) > table->table_cap) {
+        len_t new_cap = table->table_cap == 0 ? START_GROUP_TABLE_CAP : 2*table->table_cap;
+        group_t** slots = (group_t**)calloc(new_cap, sizeof(group_t*));
+        for(len_t i = 0; i < table->count; i++)
+            group_insert(slots, new_cap, table->groups[i]);
+        free(table->table);
+        table->table = slots;
+        table->table_cap = new_cap;
+        table->groups = (group_t**)realloc(table->groups, sizeof(group_t*)*new_cap);
+    }
+    group_t* group = (group_t*)malloc(sizeof(group_t));
+    group->name = (char*)malloc(len+1);
+    memcpy(group->name, name, len);
+    group->name[len] = 0;
+    group->hash = hash;
+    group->id = table->count;
+    group->members = 0;
+    table->groups[table->count++] = group;
+    group_insert(table->table, table->table_cap, group);
+    return group->id;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __GROUP_H__
+#define __GROUP_H__
+
+#include "types.h"
+
+// group of messages that are not bound to a group, they are sent to every client
+#define GROUP_ALL ((uint32_t)~0)
+// a group that does not exist
+#define GROUP_NONE ((uint32_t)~1)
+
+typedef struct {
+    char* name;
+    hash32_t hash;
+    uint32_t id;
+    len_t members;  // clients of all workers that declared the group, kept by the server
+} group_t;
+
+// interns group names, every name is mapped to a small id
+typedef struct {
+    group_t** table;    // open addressing using the hash of the name
+    len_t table_cap;
+    group_t** groups;   // indexed by the id of the group
+    len_t count;
+} group_table_t;
+
+void group_init(group_table_t* table);
+
+void group_free(group_table_t* table);
+
+uint32_t group_find(const group_table_t* table, const char* name, len_t len);
+
+uint32_t group_intern(group_table_t* table, const char* name, len_t len);
+
+#endif
@@ -0,0 +1,208 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+
+#define HANDOFF_MAGIC "CHATHOT1"
+#define HANDOFF_MAGIC_LEN 8
+#define HANDOFF_HEAD_LEN (HANDOFF_MAGIC_LEN+2*sizeof(uint64_t)) // magic, length of the state and number of file descriptors
+#define HANDOFF_MAX_FDS 250 // file descriptors sent with a single message, the kernel allows at most 253
+#define START_HANDOFF_CAP 4096
+
+void handoff_init(handoff_buf_t* buf) {
+    memset(buf, 0, sizeof(handoff_buf_t));
+}
+
+void handoff_free(handoff_buf_t* buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(handoff_buf_t));
+}
+
+// make room for len more bytes and return the position they are written to
+static char* handoff_grow(handoff_buf_t* buf, len_t len) {
+    if(buf->len+len > buf->cap) {
+        while(buf->len+len > buf->cap)
+            buf->cap = buf->cap == 0 ? START_HANDOFF_CAP : 2*buf->cap;
+        buf->data = (char*)realloc(buf->data, buf->cap);
+    }
+    char* pos = buf->data+buf->len;
+    buf->len += len;
+    return pos;
+}
+
+void handoff_put_int(handoff_buf_t* buf, uint64_t value, len_t size) {
+    char* data = handoff_grow(buf, size);
+    for(len_t i = 0; i < size; i++)
+        data[i] = (value >> (8*i)) & 0xff;
+}
+
+// write the length followed by the data, if data is NULL the space is only reserved and the caller fills it in
+char* handoff_put_data(handoff_buf_t* buf, const char* data, len_t len) {
+    handoff_put_int(buf, len, sizeof(uint64_t));
+    char* space = handoff_grow(buf, len);
+    if(data != NULL && len != 0)
+        memcpy(space, data, len);
+    return space;
+}
+
+uint64_t handoff_get_int(handoff_buf_t* buf, len_t size) {
+    if(buf->failed || buf->len-buf->pos < size) {
+        buf->failed = 1;
+        return 0;
+    }
+    uint64_t value = 0;
+    for(len_t i = 0; i < size; i++)
+        value |= (uint64_t)(uint8_t)buf->data[buf->pos+i] << (8*i);
+    buf->pos += size;
+    return value;
+}
+
+// read data written by handoff_put_data, the returned data points into the buffer
+const char* handoff_get_data(handoff_buf_t* buf, len_t* len) {
+    *len = handoff_get_int(buf, sizeof(uint64_t));
+    if(buf->failed || buf->len-buf->pos < *len) {
+        buf->failed = 1;
+        *len = 0;
+        return NULL;
+    }
+    const char* data = buf->data+buf->pos;
+    buf->pos += *len;
+    return data;
+}
+
+static error_t handoff_send_all(int sock, const char* data, len_t len) {
+    while(len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if(sent == -1 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+            return ERROR;
+        data += sent;
+        len -= sent;
+    }
+    return OK;
+}
+
+static error_t handoff_recv_all(int sock, char* data, len_t len) {
+    while(len > 0) {
+        ssize_t received = recv(sock, data, len, MSG_WAITALL);
+        if(received == -1 && errno == EINTR)
+            continue;
+        if(received <= 0)
+            return ERROR;
+        data += received;
+        len -= received;
+    }
+    return OK;
+}
+
+// send the state and then the file descriptors, a few hundred with every message
+// the files stay open while they are in flight, so the sender may close them right after
+error_t handoff_send(int sock, const handoff_buf_t* buf, const int* fds, len_t num_fds) {
+    char head[HANDOFF_HEAD_LEN];
+    memcpy(head, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN);
+    for(len_t i = 0; i < sizeof(uint64_t); i++) {
+        head[HANDOFF_MAGIC_LEN+i] = ((uint64_t)buf->len >> (8*i)) & 0xff;
+        head[HANDOFF_MAGIC_LEN+sizeof(uint64_t)+i] = ((uint64_t)num_fds >> (8*i)) & 0xff;
+    }
+    if(handoff_send_all(sock, head, HANDOFF_HEAD_LEN) == ERROR || handoff_send_all(sock, buf->data, buf->len) == ERROR)
+        return ERROR;
+    for(len_t i = 0; i < num_fds; i += HANDOFF_MAX_FDS) {
+        len_t count = num_fds-i < HANDOFF_MAX_FDS ? num_fds-i : HANDOFF_MAX_FDS;
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int)*HANDOFF_MAX_FDS)];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int)*count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*count);
+        memcpy(CMSG_DATA(cmsg), fds+i, sizeof(int)*count);
+        ssize_t sent;
+        do {
+            sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while(sent == -1 && errno == EINTR);
+        if(sent != 1)
+            return ERROR;
+    }
+    return OK;
+}
+
+// receive what handoff_send sent, the caller owns the file descriptors and has to free fds
+error_t handoff_recv(int sock, handoff_buf_t* buf, int** fds, len_t* num_fds) {
+    char head[HANDOFF_HEAD_LEN];
+    if(handoff_recv_all(sock, head, HANDOFF_HEAD_LEN) == ERROR || memcmp(head, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN) != 0)
+        return ERROR;
+    uint64_t len = 0;
+    uint64_t count = 0;
+    for(len_t i = 0; i < sizeof(uint64_t); i++) {
+        len |= (uint64_t)(uint8_t)head[HANDOFF_MAGIC_LEN+i] << (8*i);
+        count |= (uint64_t)(uint8_t)head[HANDOFF_MAGIC_LEN+sizeof(uint64_t)+i] << (8*i);
+    }
+    handoff_init(buf);
+    buf->data = (char*)malloc(len == 0 ? 1 : len);
+    buf->len = len;
+    buf->cap = len;
+    *fds = (int*)malloc(sizeof(int)*(count == 0 ? 1 : count));
+    *num_fds = 0;
+    if(buf->data == NULL || *fds == NULL || handoff_recv_all(sock, buf->data, len) == ERROR)
+        goto failed;
+    while(*num_fds < count) {
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int)*HANDOFF_MAX_FDS)];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t received;
+        do {
+            received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while(received == -1 && errno == EINTR);
+        if(received != 1)
+            goto failed;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            len_t received_fds = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+            for(len_t i = 0; i < received_fds; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg)+sizeof(int)*i, sizeof(int));
+                if(*num_fds < count)
+                    (*fds)[(*num_fds)++] = fd;
+                else
+                    close(fd);
+            }
+        }
+        if(msg.msg_flags & MSG_CTRUNC) /* some of them were lost */
+            goto failed;
+    }
+    return OK;
+failed:
+    for(len_t i = 0; i < *num_fds; i++)
+        close((*fds)[i]);
+    free(*fds);
+    *fds = NULL;
+    *num_fds = 0;
+    handoff_free(buf);
+    return ERROR;
+}
@@ -0,0 +1,33 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "types.h"
+
+// state a running server hands to its successor, integers are written in little endian
+// and the file descriptors are sent separately, the state refers to them by their index
+typedef struct {
+    char* data;
+    len_t len;
+    len_t cap;
+    len_t pos;      // position of the next read
+    bool_t failed;  // a read went past the end, everything read after that is zero
+} handoff_buf_t;
+
+void handoff_init(handoff_buf_t* buf);
+
+void handoff_free(handoff_buf_t* buf);
+
+void handoff_put_int(handoff_buf_t* buf, uint64_t value, len_t size);
+
+char* handoff_put_data(handoff_buf_t* buf, const char* data, len_t len);
+
+uint64_t handoff_get_int(handoff_buf_t* buf, len_t size);
+
+const char* handoff_get_data(handoff_buf_t* buf, len_t* len);
+
+error_t handoff_send(int sock, const handoff_buf_t* buf, const int* fds, len_t num_fds);
+
+error_t handoff_recv(int sock, handoff_buf_t* buf, int** fds, len_t* num_fds);
+
+#endif
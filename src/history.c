@@ -0,0 +1,192 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+#include "frame.h"
+
+#define START_HISTORY_ENTRIES 64
+#define START_HISTORY_SIZE 4096
+
+void history_init(history_t* hist, len_t max_size, len_t max_count) {
+    memset(hist, 0, sizeof(history_t));
+    hist->max_size = max_size;
+    hist->max_count = max_count;
+}
+
+void history_free(history_t* hist) {
+    free(hist->data);
+    free(hist->entries);
+    memset(hist, 0, sizeof(history_t));
+}
+
+// remove the oldest message, only the index has to be updated
+static void history_evict(history_t* hist) {
+    history_entry_t* entry = &hist->entries[hist->first];
+    hist->start = (hist->start+entry->len) % hist->size;
+    hist->len -= entry->len;
+    hist->first = (hist->first+1) % hist->cap;
+    hist->count--;
+    hist->evicted = entry->seq;
+}
+
+// copy len bytes starting at offset out of the circular buffer
+static void history_copy(const history_t* hist, len_t offset, len_t len, char* out) {
+    len_t first_part = hist->size-offset;
+    if(first_part >= len)
+        memcpy(out, hist->data+offset, len);
+    else {
+        memcpy(out, hist->data+offset, first_part);
+        memcpy(out+first_part, hist->data, len-first_part);
+    }
+}
+
+// make the buffer large enough for need bytes, the stored messages are moved to its start
+static void history_grow(history_t* hist, len_t need) {
+    len_t new_size = hist->size == 0 ? START_HISTORY_SIZE : 2*hist->size;
+    if(new_size < need)
+        new_size = need;
+    if(new_size > hist->max_size)
+        new_size = hist->max_size;
+    char* data = (char*)malloc(new_size);
+    if(hist->len != 0)
+        history_copy(hist, hist->start, hist->len, data);
+    for(len_t i = 0; i < hist->count; i++) {
+        history_entry_t* entry = &hist->entries[(hist->first+i) % hist->cap];
+        entry->offset = (entry->offset+hist->size-hist->start) % hist->size;
+    }
+    free(hist->data);
+    hist->data = data;
+    hist->size = new_size;
+    hist->start = 0;
+}
+
+// add the message at the end of the history, the oldest messages are removed if it would exceed its budget
+void history_add(history_t* hist, const char* msg, len_t len, uint64_t seq) {
+    if(len > hist->max_size)
+        return;
+    while(hist->len+len > hist->max_size || (hist->max_count != 0 && hist->count >= hist->max_count))
+        history_evict(hist);
+    if(hist->len+len > hist->size)
+        history_grow(hist, hist->len+len);
+    if(hist->count == hist->cap) {
+        len_t new_cap = hist->cap == 0 ? START_HISTORY_ENTRIES : 2*hist->cap;
+        history_entry_t* entries = (history_entry_t*)malloc(sizeof(history_entry_t)*new_cap);
+        for(len_t i = 0; i < hist->count; i++)
+            entries[i] = hist->entries[(hist->first+i) % hist->cap];
+        free(hist->entries);
+        hist->entries = entries;
+        hist->first = 0;
+        hist->cap = new_cap;
+    }
+    history_entry_t* entry = &hist->entries[(hist->first+hist->count) % hist->cap];
+    entry->offset = (hist->start+hist->len) % hist->size;
+    entry->len = len;
+    entry->seq = seq;
+    hist->count++;
+    // the message might wrap around the end of the buffer
+    len_t first_part = hist->size-entry->offset;
+    if(first_part >= len)
+        memcpy(hist->data+entry->offset, msg, len);
+    else {
+        memcpy(hist->data+entry->offset, msg, first_part);
+        memcpy(hist->data, msg+first_part, len-first_part);
+    }
+    hist->len += len;
+}
+
+// remove the oldest message to stay within a budget shared with other histories,
+// a history that becomes empty gives its buffers back
+void history_drop(history_t* hist) {
+    history_evict(hist);
+    if(hist->count == 0) {
+        free(hist->data);
+        free(hist->entries);
+        hist->data = NULL;
+        hist->entries = NULL;
+        hist->size = 0;
+        hist->start = 0;
+        hist->first = 0;
+        hist->cap = 0;
+    }
+}
+
+// index of the oldest stored message with a sequence number of at least seq
+static len_t history_find(const history_t* hist, uint64_t seq) {
+    len_t low = 0;
+    len_t high = hist->count;
+    while(low < high) {
+        len_t mid = low+(high-low)/2;
+        if(hist->entries[(hist->first+mid) % hist->cap].seq < seq)
+            low = mid+1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// sequence number of the oldest stored message with a sequence number of at least seq, UINT64_MAX if there is none
+uint64_t history_next(const history_t* hist, uint64_t seq) {
+    len_t index = history_find(hist, seq);
+    return index < hist->count ? hist->entries[(hist->first+index) % hist->cap].seq : UINT64_MAX;
+}
+
+// write the envelope of the stored message to out, group is the one written into it
+static len_t history_envelope(const history_t* hist, const history_entry_t* entry, uint32_t group, char* out) {
+    char id[sizeof(id_t)];
+    history_copy(hist, entry->offset, sizeof(id_t), id);
+    envelope_t env;
+    env.type = ENVELOPE_MSG;
+    env.flags = 0;
+    env.group = group;
+    env.seq = entry->seq;
+    env.id = 0;
+    for(len_t i = 0; i < sizeof(id_t); i++)
+        env.id |= (id_t)(uint8_t)id[i] << (8*i);
+    env.payload_len = entry->len-sizeof(id_t)-sizeof(len_t);
+    return envelope_head(out, &env);
+}
+
+// copy the messages with sequence numbers from from_seq up to to_seq in order into out, but not more then max bytes,
+// max has to be at least the length of the longest message and its stamp or envelope
+// the messages are stored next to each other, so in raw format this needs at most two copies, stamped every message
+// is preceded by the SEQ_ID message holding its sequence number and enveloped its header is replaced by an envelope
+// with the given group, returns the number of bytes copied
+// next_seq is set to the sequence number the next call should start at
+len_t history_read(const history_t* hist, uint64_t from_seq, uint64_t to_seq, char* out, len_t max, uint64_t* next_seq,
+                   uint8_t format, uint32_t group) {
+    len_t first = history_find(hist, from_seq);
+    len_t offset = 0;
+    len_t len = 0;
+    *next_seq = to_seq+1;
+    for(len_t i = first; i < hist->count; i++) {
+        const history_entry_t* entry = &hist->entries[(hist->first+i) % hist->cap];
+        if(entry->seq > to_seq)
+            break;
+        char head[ENVELOPE_MAX_HEAD];
+        len_t head_len = 0;
+        len_t skip = 0;
+        if(format == HISTORY_STAMPED) {
+            frame_stamp(head, entry->seq);
+            head_len = SEQ_MSG_LEN;
+        } else if(format == HISTORY_ENVELOPED) {
+            head_len = history_envelope(hist, entry, group, head);
+            skip = sizeof(id_t)+sizeof(len_t);
+        }
+        len_t entry_len = head_len+entry->len-skip;
+        if(len+entry_len > max) /* continue with this message next time */ {
+            *next_seq = entry->seq;
+            break;
+        }
+        if(format != HISTORY_RAW) {
+            memcpy(out+len, head, head_len);
+            history_copy(hist, (entry->offset+skip) % hist->size, entry->len-skip, out+len+head_len);
+        } else if(i == first)
+            offset = entry->offset;
+        len += entry_len;
+    }
+    if(len != 0 && format == HISTORY_RAW)
+        history_copy(hist, offset, len, out);
+    return len;
+}
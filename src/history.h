@@ -0,0 +1,49 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include "types.h"
+
+// how history_read writes the messages
+#define HISTORY_RAW 0       // as they were stored
+#define HISTORY_STAMPED 1   // every message is preceded by its stamp
+#define HISTORY_ENVELOPED 2 // the header of every message is replaced by its envelope
+
+// position of a single message inside the history
+typedef struct {
+    len_t offset;
+    len_t len;
+    uint64_t seq;
+} history_entry_t;
+
+// the messages are stored in a circular buffer, the oldest ones are evicted first
+// the buffer grows with the messages until it reaches the budget, so a quiet partition stays small
+typedef struct {
+    char* data;
+    len_t size;     // size of the buffer
+    len_t max_size; // budget in bytes
+    len_t max_count;    // budget in messages, zero if only the bytes are limited
+    len_t start;    // offset of the oldest message
+    len_t len;      // number of bytes used
+    uint64_t evicted;   // sequence number of the newest message that was evicted
+    // circular index of the stored messages
+    history_entry_t* entries;
+    len_t first;
+    len_t count;
+    len_t cap;
+} history_t;
+
+void history_init(history_t* hist, len_t max_size, len_t max_count);
+
+void history_free(history_t* hist);
+
+void history_add(history_t* hist, const char* msg, len_t len, uint64_t seq);
+
+void history_drop(history_t* hist);
+
+uint64_t history_next(const history_t* hist, uint64_t seq);
+
+len_t history_read(const history_t* hist, uint64_t from_seq, uint64_t to_seq, char* out, len_t max, uint64_t* next_seq,
+                   uint8_t format, uint32_t group);
+
+#endif
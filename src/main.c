@@ -15,6 +15,18 @@
 #define DEF_HOST "127.0.0.1"
 #define DEF_GROUP "default"
 #define DEF_NAME getlogin()
+#define DEF_THREADS 1
+#define MAX_THREADS 256
+#define DEF_QUEUE_HIGH 4194304
+#define DEF_QUEUE_LOW 1048576
+#define DEF_QUEUE_AGE 30000
+#define DEF_HISTORY_BYTES 262144
+#define DEF_HISTORY_TOTAL 67108864
+#define DEF_MAX_GROUPS 4096
+#define DEF_MAX_FRAME 16777216
+#define DEF_HEARTBEAT 30000
+#define DEF_IDLE_TIMEOUT 90000
+#define MAX_NODE 255
 
 // used to restore the terminal
 struct termios oldterm;
@@ -43,7 +55,32 @@ int main(int argc, char** argv) {
         .group = DEF_GROUP,
         .host = DEF_HOST,
         .passwd = NULL,
-        .port = DEF_PORT
+        .port = DEF_PORT,
+        .threads = DEF_THREADS,
+        .history_log = NULL,
+        .history_bytes = DEF_HISTORY_BYTES,
+        .history_entries = 0,
+        .history_total = DEF_HISTORY_TOTAL,
+        .max_groups = DEF_MAX_GROUPS,
+        .slow_policy = SLOW_POLICY_DROP,
+        .queue_high = DEF_QUEUE_HIGH,
+        .queue_low = DEF_QUEUE_LOW,
+        .queue_age = DEF_QUEUE_AGE,
+        .metrics_socket = NULL,
+        .metrics_file = NULL,
+        .hot_restart = NULL,
+        .max_frame = DEF_MAX_FRAME,
+        .rate_frames = 0,
+        .rate_bytes = 0,
+        .rate_large = 0,
+        .rate_policy = RATE_POLICY_QUEUE,
+        .heartbeat = DEF_HEARTBEAT,
+        .idle_timeout = DEF_IDLE_TIMEOUT,
+        .flush_delay = 0,
+        .node = 0,
+        .peers = NULL,
+        .num_peers = 0,
+        .peer_secret = NULL
     };
 
     // evaluate parameters
@@ -65,6 +102,169 @@ int main(int argc, char** argv) {
                 i++;
             } else
                 fprintf(stderr, "no port specified, option is ignored\n");
+        } else if(strcmp("-T", argv[i]) == 0 || strcasecmp("--threads", argv[i]) == 0) /* number of server workers */ {
+            if(i+1 < argc) {
+                unsigned int nthreads = atoi(argv[i+1]);
+                if(nthreads == 0 || nthreads > MAX_THREADS)
+                    fprintf(stderr, "illegal number of threads, option is ignored\n");
+                else
+                    conf.threads = nthreads;
+                i++;
+            } else
+                fprintf(stderr, "no number of threads specified, option is ignored\n");
+        } else if(strcmp("-l", argv[i]) == 0 || strcasecmp("--history-log", argv[i]) == 0) /* persistent history */ {
+            if(i+1 < argc) {
+                conf.history_log = argv[i+1];
+                i++;
+            } else
+                fprintf(stderr, "no history log directory specified, option is ignored\n");
+        } else if(strcasecmp("--slow-policy", argv[i]) == 0) /* what to do with slow clients */ {
+            if(i+1 < argc) {
+                if(strcasecmp("drop", argv[i+1]) == 0)
+                    conf.slow_policy = SLOW_POLICY_DROP;
+                else if(strcasecmp("skip", argv[i+1]) == 0)
+                    conf.slow_policy = SLOW_POLICY_SKIP;
+                else if(strcasecmp("disconnect", argv[i+1]) == 0)
+                    conf.slow_policy = SLOW_POLICY_DISCONNECT;
+                else
+                    fprintf(stderr, "unknown slow client policy, option is ignored\n");
+                i++;
+            } else
+                fprintf(stderr, "no slow client policy specified, option is ignored\n");
+        } else if(strcasecmp("--queue-high", argv[i]) == 0 || strcasecmp("--queue-low", argv[i]) == 0 || strcasecmp("--queue-age", argv[i]) == 0) /* slow client limits */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value <= 0)
+                    fprintf(stderr, "illegal queue limit, option is ignored\n");
+                else if(strcasecmp("--queue-high", argv[i]) == 0)
+                    conf.queue_high = value;
+                else if(strcasecmp("--queue-low", argv[i]) == 0)
+                    conf.queue_low = value;
+                else
+                    conf.queue_age = value;
+                i++;
+            } else
+                fprintf(stderr, "no queue limit specified, option is ignored\n");
+        } else if(strcasecmp("--history-bytes", argv[i]) == 0 || strcasecmp("--history-entries", argv[i]) == 0) /* budget of the history of a group */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value < 0 || (value == 0 && strcasecmp("--history-bytes", argv[i]) == 0))
+                    fprintf(stderr, "illegal history limit, option is ignored\n");
+                else if(strcasecmp("--history-bytes", argv[i]) == 0)
+                    conf.history_bytes = value;
+                else
+                    conf.history_entries = value;
+                i++;
+            } else
+                fprintf(stderr, "no history limit specified, option is ignored\n");
+        } else if(strcasecmp("--history-total", argv[i]) == 0 || strcasecmp("--max-groups", argv[i]) == 0) /* budget shared by all groups */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value <= 0)
+                    fprintf(stderr, "illegal group limit, option is ignored\n");
+                else if(strcasecmp("--history-total", argv[i]) == 0)
+                    conf.history_total = value;
+                else
+                    conf.max_groups = value;
+                i++;
+            } else
+                fprintf(stderr, "no group limit specified, option is ignored\n");
+        } else if(strcasecmp("--rate-frames", argv[i]) == 0 || strcasecmp("--rate-bytes", argv[i]) == 0 || strcasecmp("--rate-large", argv[i]) == 0) /* rate limits of the clients */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value < 0)
+                    fprintf(stderr, "illegal rate limit, option is ignored\n");
+                else if(strcasecmp("--rate-frames", argv[i]) == 0)
+                    conf.rate_frames = value;
+                else if(strcasecmp("--rate-bytes", argv[i]) == 0)
+                    conf.rate_bytes = value;
+                else
+                    conf.rate_large = value;
+                i++;
+            } else
+                fprintf(stderr, "no rate limit specified, option is ignored\n");
+        } else if(strcasecmp("--rate-policy", argv[i]) == 0) /* what to do with clients over their limit */ {
+            if(i+1 < argc) {
+                if(strcasecmp("queue", argv[i+1]) == 0)
+                    conf.rate_policy = RATE_POLICY_QUEUE;
+                else if(strcasecmp("reject", argv[i+1]) == 0)
+                    conf.rate_policy = RATE_POLICY_REJECT;
+                else
+                    fprintf(stderr, "unknown rate limit policy, option is ignored\n");
+                i++;
+            } else
+                fprintf(stderr, "no rate limit policy specified, option is ignored\n");
+        } else if(strcasecmp("--heartbeat", argv[i]) == 0 || strcasecmp("--idle-timeout", argv[i]) == 0 || strcasecmp("--flush-delay", argv[i]) == 0) /* timers of the server */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value < 0)
+                    fprintf(stderr, "illegal time, option is ignored\n");
+                else if(strcasecmp("--heartbeat", argv[i]) == 0)
+                    conf.heartbeat = value;
+                else if(strcasecmp("--idle-timeout", argv[i]) == 0)
+                    conf.idle_timeout = value;
+                else
+                    conf.flush_delay = value;
+                i++;
+            } else
+                fprintf(stderr, "no time specified, option is ignored\n");
+        } else if(strcasecmp("--node", argv[i]) == 0) /* number of the server in a federation */ {
+            if(i+1 < argc) {
+                int node = atoi(argv[i+1]);
+                if(node < 0 || node > MAX_NODE)
+                    fprintf(stderr, "illegal node number, option is ignored\n");
+                else
+                    conf.node = node;
+                i++;
+            } else
+                fprintf(stderr, "no node number specified, option is ignored\n");
+        } else if(strcasecmp("--peer", argv[i]) == 0) /* other server of the federation */ {
+            if(i+1 < argc) {
+                if(strfndchr(argv[i+1], ':') == -1)
+                    fprintf(stderr, "peer must be given as HOST:PORT, option is ignored\n");
+                else {
+                    conf.peers = (char**)realloc(conf.peers, sizeof(char*)*(conf.num_peers+1));
+                    conf.peers[conf.num_peers++] = argv[i+1];
+                }
+                i++;
+            } else
+                fprintf(stderr, "no peer specified, option is ignored\n");
+        } else if(strcasecmp("--peer-secret", argv[i]) == 0) /* shared by the servers of the federation */ {
+            if(i+1 < argc) {
+                if(argv[i+1][0] == 0 || strfndchr(argv[i+1], '\n') != -1)
+                    fprintf(stderr, "peer secret can't be empty or contain a newline, option is ignored\n");
+                else
+                    conf.peer_secret = argv[i+1];
+                i++;
+            } else
+                fprintf(stderr, "no peer secret specified, option is ignored\n");
+        } else if(strcasecmp("--metrics-socket", argv[i]) == 0 || strcasecmp("--metrics-file", argv[i]) == 0) /* export metrics */ {
+            if(i+1 < argc) {
+                if(strcasecmp("--metrics-socket", argv[i]) == 0)
+                    conf.metrics_socket = argv[i+1];
+                else
+                    conf.metrics_file = argv[i+1];
+                i++;
+            } else
+                fprintf(stderr, "no metrics path specified, option is ignored\n");
+        } else if(strcasecmp("--hot-restart", argv[i]) == 0) /* hand the connections to the next server */ {
+            if(i+1 < argc) {
+                conf.hot_restart = argv[i+1];
+                i++;
+            } else
+                fprintf(stderr, "no hot restart path specified, option is ignored\n");
+        } else if(strcasecmp("--max-frame", argv[i]) == 0) /* largest accepted message */ {
+            if(i+1 < argc) {
+                long long value = atoll(argv[i+1]);
+                if(value <= 0)
+                    fprintf(stderr, "illegal frame size, option is ignored\n");
+                else
+                    conf.max_frame = value;
+                i++;
+            } else
+                fprintf(stderr, "no frame size specified, option is ignored\n");
+        } else if(strcasecmp("--io-uring", argv[i]) == 0) /* use io_uring for the server */ {
+            conf.flag |= FLAG_CONF_IO_URING;
         } else if(strcmp("-a", argv[i]) == 0 || strcasecmp("--alternet", argv[i]) == 0) /* use alternet screen buffer */ {
             conf.flag |= FLAG_CONF_USE_ALTERNET;
         } else if(strcmp("-s", argv[i]) == 0 || strcasecmp("--server", argv[i]) == 0) /* is this a server */ {
@@ -117,6 +317,33 @@ int main(int argc, char** argv) {
                 "  -p, --port PORT        select the servers port (def: '24242')\n"
                 "  -s, --server           make this a server\n"
                 "  -H, --auto-discovery   use automatic discovery\n"
+                "  --max-frame BYTES      largest accepted message (def: 16777216)\n"
+                "\n"
+                "Options for servers:\n"
+                "  -T, --threads N        number of worker threads (def: 1)\n"
+                "  -l, --history-log DIR  keep the history in DIR across restarts\n"
+                "  --history-bytes BYTES  history kept for every group (def: 262144)\n"
+                "  --history-entries N    messages kept for every group (def: unlimited)\n"
+                "  --history-total BYTES  history kept for all groups (def: 67108864)\n"
+                "  --max-groups N         groups clients may create (def: 4096)\n"
+                "  --slow-policy POLICY   drop, skip or disconnect slow clients (def: 'drop')\n"
+                "  --queue-high BYTES     queue size at which a client is slow (def: 4194304)\n"
+                "  --queue-low BYTES      queue size at which it caught up (def: 1048576)\n"
+                "  --queue-age MS         maximum age of a queued message (def: 30000)\n"
+                "  --rate-frames N        messages per second of a client (def: unlimited)\n"
+                "  --rate-bytes BYTES     bytes per second of a client (def: unlimited)\n"
+                "  --rate-large BYTES     same for messages over 64 KiB (def: unlimited)\n"
+                "  --rate-policy POLICY   queue or reject messages over the limit (def: 'queue')\n"
+                "  --io-uring             use io_uring instead of epoll if supported\n"
+                "  --heartbeat MS         heartbeat after MS of silence, 0 for none (def: 30000)\n"
+                "  --idle-timeout MS      close silent connections, 0 for never (def: 90000)\n"
+                "  --flush-delay MS       gather messages for MS before writing (def: 0)\n"
+                "  --node N               number of this server in a federation (def: 0)\n"
+                "  --peer HOST:PORT       forward messages to and from another server\n"
+                "  --peer-secret SECRET   secret shared by all servers, needed with --peer\n"
+                "  --metrics-socket PATH  serve metrics on the unix socket PATH\n"
+                "  --metrics-file PATH    write metrics to PATH every second\n"
+                "  --hot-restart PATH     take over from the server on PATH, then listen on it\n"
                 "\n"
                 "Options for clients:\n"
                 "  -n, --name NAME        set the name (def: username)\n"
@@ -138,6 +365,15 @@ int main(int argc, char** argv) {
             fprintf(stderr, "unknown option '%s', option is ignored\n", argv[i]);
         }
     }
+    if(conf.num_peers != 0 && conf.peer_secret == NULL) /* any client could pretend to be a peer */ {
+        fprintf(stderr, "peers need a peer secret, peers are ignored\n");
+        conf.num_peers = 0;
+    }
+    if(conf.queue_low >= conf.queue_high) /* a client would be slow and caught up at once */ {
+        fprintf(stderr, "queue low must be below queue high, queue limits are ignored\n");
+        conf.queue_high = DEF_QUEUE_HIGH;
+        conf.queue_low = DEF_QUEUE_LOW;
+    }
 
     // configure input to be less processed
     struct termios newterm;
@@ -158,5 +394,6 @@ int main(int argc, char** argv) {
         server_main(conf);
     else
         client_main(conf);
+    free(conf.peers);
     return ret;
 }
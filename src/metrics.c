@@ -0,0 +1,108 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+// monotonic time in nanoseconds
+uint64_t metrics_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+// index of the bucket the value is counted in, small values get a bucket each
+static len_t metrics_bucket(uint64_t value) {
+    if(value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+    len_t exp = 63-__builtin_clzll(value);
+    return ((exp-HISTOGRAM_SUB_BITS+1) << HISTOGRAM_SUB_BITS)+((value >> (exp-HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS)-1));
+}
+
+// largest value that is counted in the bucket
+static uint64_t metrics_bucket_max(len_t bucket) {
+    if(bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+    len_t exp = (bucket >> HISTOGRAM_SUB_BITS)+HISTOGRAM_SUB_BITS-1;
+    uint64_t sub = (1 << HISTOGRAM_SUB_BITS)+(bucket & ((1 << HISTOGRAM_SUB_BITS)-1));
+    return ((sub+1) << (exp-HISTOGRAM_SUB_BITS))-1;
+}
+
+void metrics_record(histogram_t* hist, uint64_t value) {
+    metrics_add(&hist->counts[metrics_bucket(value)], 1);
+    metrics_add(&hist->count, 1);
+    metrics_add(&hist->sum, value);
+}
+
+// add the current values of the histogram to the snapshot
+void metrics_merge(histogram_snapshot_t* snap, const histogram_t* hist) {
+    for(len_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        snap->counts[i] += metrics_get(&hist->counts[i]);
+    snap->count += metrics_get(&hist->count);
+    snap->sum += metrics_get(&hist->sum);
+}
+
+// remove the values of an older snapshot, histograms are reset this way because only their owner may write them
+void metrics_subtract(histogram_snapshot_t* snap, const histogram_snapshot_t* base) {
+    for(len_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        snap->counts[i] -= base->counts[i];
+    snap->count -= base->count;
+    snap->sum -= base->sum;
+}
+
+// upper bound of the value below which the given fraction of the recorded values lies
+uint64_t metrics_quantile(const histogram_snapshot_t* snap, double quantile) {
+    uint64_t total = 0;
+    for(len_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += snap->counts[i];
+    if(total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(quantile*total+0.5);
+    if(rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for(len_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snap->counts[i];
+        if(seen >= rank)
+            return metrics_bucket_max(i);
+    }
+    return metrics_bucket_max(HISTOGRAM_BUCKETS-1);
+}
+
+// print the comment lines describing a metric in the prometheus text format
+void metrics_header(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s %s\n", name, type);
+}
+
+// replace the file with the text, readers never see a partially written file
+error_t metrics_dump(const char* path, const char* text, len_t len) {
+    len_t path_len = strlen(path);
+    char* tmp_path = (char*)malloc(path_len+5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path+path_len, ".tmp", 5);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        free(tmp_path);
+        return ERROR;
+    }
+    len_t written = 0;
+    while(written < len) {
+        ssize_t ret = write(fd, text+written, len-written);
+        if(ret <= 0)
+            break;
+        written += ret;
+    }
+    close(fd);
+    if(written < len || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return ERROR;
+    }
+    free(tmp_path);
+    return OK;
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "types.h"
+
+// value that is only written by the thread owning it, but can be read by any thread,
+// so updating it needs no locked instruction
+typedef atomic_uint_fast64_t metric_t;
+
+// reasons for a client to be disconnected
+#define CLOSE_ERROR 0   // reading or writing failed
+#define CLOSE_PEER 1    // the client closed the connection
+#define CLOSE_SLOW 2    // the client could not keep up
+#define CLOSE_OVERSIZE 3    // the client announced a message larger than the maximum frame size
+#define CLOSE_IDLE 4    // nothing was received from the client for the idle timeout, or a message it relays arrived too slowly
+#define CLOSE_RELAY 5   // a relayed message the client was receiving was cancelled
+#define CLOSE_GROUPS 6  // the client declared a new group while there already are as many as allowed
+#define NUM_CLOSE 7
+
+// metrics of a single worker
+typedef struct {
+    metric_t bytes_in;
+    metric_t bytes_out;
+    metric_t frames_in;
+    metric_t frames_out;
+    metric_t writes;    // write calls, or submitted writes with io_uring
+    metric_t frames_coalesced;  // ephemeral messages replaced by a newer one of the same sender before they were sent
+    metric_t frames_oversize;   // messages not sent because they are larger than the client accepts
+    metric_t frames_delayed;    // messages that had to wait for the rate limit of their sender
+    metric_t frames_rejected;   // messages dropped because of the rate limit of their sender
+    metric_t frames_duplicate;  // messages of peers that already arrived over another link
+    metric_t frames_relayed;    // large messages relayed while they were received
+    metric_t frames_cancelled;  // relayed messages that could not be completed
+    metric_t accepts;
+    metric_t disconnects[NUM_CLOSE];
+    metric_t loops;
+    // nanoseconds spent in each phase of the event loop
+    metric_t wait_ns;
+    metric_t events_ns;
+    metric_t replay_ns;
+    metric_t close_ns;
+    // gauges, sampled by the worker from time to time
+    metric_t clients;
+    metric_t peers;     // connected servers of the federation
+    metric_t queued_bytes;
+    metric_t queued_frames;
+} metrics_t;
+
+// log-linear histogram, every power of two is split into 2^HISTOGRAM_SUB_BITS buckets of equal width,
+// so every recorded value is known to within about 6 percent
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64-HISTOGRAM_SUB_BITS+1) << HISTOGRAM_SUB_BITS)
+
+// histogram written only by the thread owning it, like any other metric
+typedef struct {
+    metric_t counts[HISTOGRAM_BUCKETS];
+    metric_t count;
+    metric_t sum;
+} histogram_t;
+
+// plain copy of histograms, used to merge them and to compute quantiles
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} histogram_snapshot_t;
+
+static inline void metrics_add(metric_t* metric, uint64_t value) {
+    atomic_store_explicit(metric, atomic_load_explicit(metric, memory_order_relaxed)+value, memory_order_relaxed);
+}
+
+static inline void metrics_set(metric_t* metric, uint64_t value) {
+    atomic_store_explicit(metric, value, memory_order_relaxed);
+}
+
+static inline uint64_t metrics_get(const metric_t* metric) {
+    return atomic_load_explicit((metric_t*)metric, memory_order_relaxed);
+}
+
+uint64_t metrics_time_ns();
+
+void metrics_record(histogram_t* hist, uint64_t value);
+
+void metrics_merge(histogram_snapshot_t* snap, const histogram_t* hist);
+
+void metrics_subtract(histogram_snapshot_t* snap, const histogram_snapshot_t* base);
+
+uint64_t metrics_quantile(const histogram_snapshot_t* snap, double quantile);
+
+void metrics_header(FILE* out, const char* name, const char* type, const char* help);
+
+error_t metrics_dump(const char* path, const char* text, len_t len);
+
+#endif
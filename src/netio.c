@@ -9,7 +9,44 @@
 #include "cipher.h"
 #include "hash.h"
 
-error_t net_sendmsg(int sock, const msgbuf_t* msg) {
+#define SKIP_BUFFER_LEN 4096
+#define NET_HEAD_ROOM (ENVELOPE_MAX_HEAD-sizeof(id_t)-sizeof(len_t)) // bytes reserved before a message for a longer envelope
+
+// send the message at buffer, its body follows the version 1 header, so NET_HEAD_ROOM bytes have to be
+// reserved before buffer, in version 2 the envelope replaces the header and ends where it ended
+static error_t net_send(int sock, uint8_t* buffer, len_t body_len, id_t cid, uint8_t flags, uint8_t version) {
+    uint8_t* start = buffer;
+    if(version == ENVELOPE_VERSION) {
+        envelope_t env;
+        env.type = cid == CTRL_ID ? ENVELOPE_CTRL : ENVELOPE_MSG;
+        env.flags = flags;
+        env.group = 0;  // the server knows our group and our id
+        env.seq = 0;
+        env.id = 0;
+        env.payload_len = body_len;
+        char head[ENVELOPE_MAX_HEAD];
+        len_t head_len = envelope_head(head, &env);
+        start = buffer+sizeof(id_t)+sizeof(len_t)-head_len;
+        memcpy(start, head, head_len);
+    } else {
+        for(len_t i = 0; i < sizeof(id_t); i++) /* add the id at the start */
+            buffer[i] = (cid >> (i*8)) & 0xff;
+        for(len_t i = 0; i < sizeof(len_t); i++) /* add the length of the message at the start after the id */
+            buffer[sizeof(id_t)+i] = (body_len >> (i*8)) & 0xff;
+    }
+    len_t len = buffer+sizeof(id_t)+sizeof(len_t)+body_len-start;
+    len_t len_send = 0;
+    while(len_send < len) {
+        len_t tmp_len = send(sock, start+len_send, len-len_send, 0);
+        if(tmp_len == -1)
+            return ERROR;
+        else
+            len_send += tmp_len;
+    }
+    return OK;
+}
+
+error_t net_sendmsg(int sock, const msgbuf_t* msg, uint8_t version) {
     len_t namelen = strlen(msg->name);
     len_t grouplen;
     if(msg->group == NULL)
@@ -34,7 +71,8 @@ error_t net_sendmsg(int sock, const msgbuf_t* msg) {
     if(msg->data != NULL)
         totallen += msg->data_len;    // <id><len>[~<ind>:KEY]<name>[@<group>][|TYP]\0[<data>]
 
-    uint8_t* buffer = (uint8_t*)malloc(sizeof(id_t)+sizeof(len_t)+2*totallen+sizeof(data256_t)); // +2*sizeof(data256_t) to be sure everything fits even after encryption
+    uint8_t* alloc = (uint8_t*)malloc(NET_HEAD_ROOM+sizeof(id_t)+sizeof(len_t)+2*totallen+sizeof(data256_t)); // +2*sizeof(data256_t) to be sure everything fits even after encryption
+    uint8_t* buffer = alloc+NET_HEAD_ROOM;
     len_t buflen = 0;
     len_t enc_start;
     if(msg->flag & FLAG_MSG_ENC) /* add indicator and encryption string */ {
@@ -73,28 +111,162 @@ error_t net_sendmsg(int sock, const msgbuf_t* msg) {
     if(msg->flag & FLAG_MSG_ENC) /* encrypt the data after the indicator */ {
         buflen = cipher_encryptdata(buffer+sizeof(id_t)+sizeof(len_t)+enc_start, buffer+sizeof(id_t)+sizeof(len_t)+enc_start, buflen-enc_start, msg->ind, msg->key)+enc_start;
     }
-    for(len_t i = 0; i < sizeof(id_t); i++) /* add the id of the client at the start */
-        buffer[i] = (msg->cid >> (i*8)) & 0xff;
-    for(len_t i = 0; i < sizeof(len_t); i++) /* add the length of the message at the start after the id */
-        buffer[sizeof(id_t)+i] = (buflen >> (i*8)) & 0xff;
+    // the server can see the class even if the message is encrypted, with envelopes it is a flag
+    id_t cid = (msg->flag & FLAG_MSG_TYP) && version != ENVELOPE_VERSION ? EPHEMERAL_ID : msg->cid;
+    uint8_t flags = (msg->flag & FLAG_MSG_TYP) ? ENVELOPE_EPHEMERAL : 0;
+    error_t ret = net_send(sock, buffer, buflen, cid, flags, version);
+    free(alloc);
+    return ret;
+}
 
-    /* send the message */
-    len_t len_send = 0;
-    while(len_send < buflen+sizeof(len_t)) {
-        len_t tmp_len = send(sock, buffer+len_send, sizeof(id_t)+sizeof(len_t)+buflen-len_send, 0);
-        if(tmp_len == -1) {
-            free(buffer);
+// read and drop len bytes of a message that is not kept
+static error_t net_skip(int sock, len_t len) {
+    uint8_t buffer[SKIP_BUFFER_LEN];
+    while(len > 0) {
+        len_t tmp_len = recv(sock, buffer, len < SKIP_BUFFER_LEN ? len : SKIP_BUFFER_LEN, MSG_WAITALL);
+        if(tmp_len == 0)
+            return CONNECTION_CLOSED;
+        else if(tmp_len == -1)
             return ERROR;
-        } else
-            len_send += tmp_len;
+        len -= tmp_len;
     }
+    return TOO_LARGE;
+}
 
-    free(buffer);
+// fill msg with the header and data of the body of a message, the body is not freed
+static error_t net_parse(msgbuf_t* msg, char* body, len_t buflen) {
+    msg->flag = 0;
+    char* msgre = body;
+    if(*msgre == '~') /* the message is encrypted */ {
+        msgre++;
+        buflen = cipher_decryptdata((uint8_t*)msgre, (uint8_t*)msgre, buflen-1, msg->ind, msg->key);
+        if(strncmp(msgre, ":ENCRYPTED", 10) != 0) /* couldn't decrypt the data */
+            return ENC_DATA;
+        msgre += 10;
+        buflen -= 10;
+        msg->flag |= FLAG_MSG_ENC;
+    }
+    /* extract the header information */
+    len_t headlen = strlen(msgre);
+    if(headlen >= buflen)
+        return ERROR;
+    len_t atpos = strfndchr(msgre, '@');
+    len_t pipepos = strfndchr(msgre, '|');
+    len_t datalen = buflen-headlen-1;
+
+    len_t namelen;
+    if(atpos != -1)
+        namelen = atpos;
+    else if(pipepos != -1)
+        namelen = pipepos;
+    else
+        namelen = headlen;
+
+    len_t grouplen;
+    if(atpos == -1)
+        grouplen = 0;
+    else if(pipepos != -1)
+        grouplen = pipepos-atpos-1;
+    else
+        grouplen = headlen-atpos-1;
+
+    /* fill the message buffer */
+    msg->name = (char*)malloc(namelen+1);
+    memcpy(msg->name, msgre, namelen);
+    msg->name[namelen] = 0;
+    if(grouplen != 0) {
+        msg->group = (char*)malloc(grouplen+1);
+        memcpy(msg->group, msgre+atpos+1, grouplen);
+        msg->group[grouplen] = 0;
+    } else
+        msg->group = NULL;
+
+    if(pipepos != -1 && strcmp(msgre+pipepos+1, "TYP") == 0) /* the message only contains typing information */
+        msg->flag |= FLAG_MSG_TYP;
+    else if(pipepos != -1 && strcmp(msgre+pipepos+1, "ENT") == 0) /* the message only contains enter information */
+        msg->flag |= FLAG_MSG_ENT;
+    else if(pipepos != -1 && strcmp(msgre+pipepos+1, "EXT") == 0) /* the message only contains exit information */
+        msg->flag |= FLAG_MSG_EXT;
+    else if(pipepos != -1 && strcmp(msgre+pipepos+1, "IMG") == 0) /* the message is a image */
+        msg->flag |= FLAG_MSG_IMG;
+
+    if(datalen == 0) {
+        msg->data_len = 0;
+        msg->data = NULL;
+    } else {
+        msg->data_len = datalen;
+        msg->data = (char*)malloc(datalen);
+        memcpy(msg->data, msgre+headlen+1, datalen);
+    }
     return OK;
 }
 
+// receive an envelope of version 2, its head is peeked at so the length is known without reading it byte by byte,
+// only a length that is split between two segments is completed one byte at a time
+static error_t net_recvenvelope(int sock, msgbuf_t* msg, len_t max_len) {
+    char head[ENVELOPE_MAX_HEAD];
+    len_t head_len = recv(sock, head, ENVELOPE_MAX_HEAD, MSG_PEEK | MSG_DONTWAIT);
+    if(head_len == 0)
+        return CONNECTION_CLOSED;
+    else if(head_len == -1)
+        return NO_DATA;
+    len_t size = envelope_size(head, head_len);
+    len_t consumed = 0; // bytes of the head that were already read from the socket
+    if(size == 0) /* the rest of the length did not arrive yet */ {
+        if(recv(sock, head, head_len, MSG_WAITALL) != head_len)
+            return ERROR;
+        consumed = head_len;
+        while(size == 0 && consumed < ENVELOPE_MAX_HEAD) {
+            len_t tmp_len = recv(sock, head+consumed, 1, MSG_WAITALL);
+            if(tmp_len == 0)
+                return CONNECTION_CLOSED;
+            else if(tmp_len == -1)
+                return ERROR;
+            consumed++;
+            size = envelope_size(head, consumed);
+        }
+    }
+    if(size == 0 || size > max_len+ENVELOPE_MAX_HEAD) {
+        if(size == 0 || size == ~(len_t)0) /* the length is malformed, nothing after it can be trusted */
+            return ERROR;
+        return net_skip(sock, size-consumed);
+    }
+    char* buffer = (char*)malloc(size);
+    memcpy(buffer, head, consumed);
+    len_t tmp_len = size == consumed ? 0 : recv(sock, buffer+consumed, size-consumed, MSG_WAITALL);
+    if(tmp_len != size-consumed) {
+        free(buffer);
+        return tmp_len == 0 ? CONNECTION_CLOSED : ERROR;
+    }
+    envelope_t env;
+    if(envelope_parse(buffer, size, &env) == ERROR) {
+        free(buffer);
+        return ERROR;
+    }
+    msg->seq = env.seq;
+    if(env.type == ENVELOPE_CTRL) /* the data is handed over unparsed */ {
+        memmove(buffer, env.payload, env.payload_len);
+        msg->cid = CTRL_ID;
+        msg->flag = 0;
+        msg->name = NULL;
+        msg->group = NULL;
+        msg->data = buffer;
+        msg->data_len = env.payload_len;
+        return CTRL_DATA;
+    }
+    msg->cid = env.id;
+    error_t ret = net_parse(msg, (char*)env.payload, env.payload_len);
+    free(buffer);
+    return ret;
+}
+
 // no field in msg will be freed by this function!
-error_t net_recvmsg(int sock, msgbuf_t* msg) {
+// messages longer than max_len are skipped without allocating anything and TOO_LARGE is returned
+// control messages and sequence numbers of the server are returned unparsed in data with CTRL_DATA
+error_t net_recvmsg(int sock, msgbuf_t* msg, len_t max_len, uint8_t version) {
+    if(version == ENVELOPE_VERSION)
+        return net_recvenvelope(sock, msg, max_len);
+    msg->seq = 0;
     uint8_t bufferhead[sizeof(id_t)+sizeof(len_t)];
     len_t len = recv(sock, bufferhead, sizeof(id_t)+sizeof(len_t), MSG_DONTWAIT); /* recv the id and length of the message */
     if(len >= 1) {
@@ -107,77 +279,22 @@ error_t net_recvmsg(int sock, msgbuf_t* msg) {
             len_t buflen = 0;
             for(len_t i = 0; i < sizeof(len_t); i++)
                 buflen |= (len_t)bufferhead[sizeof(id_t)+i] << (i*8);
+            if(buflen > max_len)
+                return net_skip(sock, buflen);
             uint8_t* buffer = (uint8_t*)malloc(buflen);
             tmp_len = recv(sock, buffer, buflen, MSG_WAITALL); /* recv the actual message */
-            if(tmp_len == buflen) {
+            if(tmp_len == buflen && (msg->cid == CTRL_ID || msg->cid == SEQ_ID)) /* the data is handed over unparsed */ {
                 msg->flag = 0;
-                char* msgre = (char*)buffer;
-                if(*msgre == '~') /* the message is encrypted */ {
-                    msgre++;
-                    buflen = cipher_decryptdata((uint8_t*)msgre, (uint8_t*)msgre, buflen-1, msg->ind, msg->key);
-                    if(strncmp(msgre, ":ENCRYPTED", 10) != 0) /* couldn't decrypt the data */ {
-                        free(buffer);
-                        return ENC_DATA;
-                    }
-                    msgre += 10;
-                    buflen -= 10;
-                    msg->flag |= FLAG_MSG_ENC;
-                }
-                /* extract the header information */
-                len_t headlen = strlen(msgre);
-                if(headlen >= buflen) {
-                    free(buffer);
-                    return ERROR;
-                }
-                len_t atpos = strfndchr(msgre, '@');
-                len_t pipepos = strfndchr(msgre, '|');
-                len_t datalen = buflen-headlen-1;
-
-                len_t namelen;
-                if(atpos != -1)
-                    namelen = atpos;
-                else if(pipepos != -1)
-                    namelen = pipepos;
-                else
-                    namelen = headlen;
-
-                len_t grouplen;
-                if(atpos == -1)
-                    grouplen = 0;
-                else if(pipepos != -1)
-                    grouplen = pipepos-atpos-1;
-                else
-                    grouplen = headlen-atpos-1;
-
-                /* fill the message buffer */
-                msg->name = (char*)malloc(namelen+1);
-                memcpy(msg->name, msgre, namelen);
-                msg->name[namelen] = 0;
-                if(grouplen != 0) {
-                    msg->group = (char*)malloc(grouplen+1);
-                    memcpy(msg->group, msgre+atpos+1, grouplen);
-                    msg->group[grouplen] = 0;
-                } else
-                    msg->group = NULL;
-
-                if(pipepos != -1 && strcmp(msgre+pipepos+1, "TYP") == 0) /* the message only contains typing information */
-                    msg->flag |= FLAG_MSG_TYP;
-                else if(pipepos != -1 && strcmp(msgre+pipepos+1, "ENT") == 0) /* the message only contains enter information */
-                    msg->flag |= FLAG_MSG_ENT;
-                else if(pipepos != -1 && strcmp(msgre+pipepos+1, "EXT") == 0) /* the message only contains exit information */
-                    msg->flag |= FLAG_MSG_EXT;
-                else if(pipepos != -1 && strcmp(msgre+pipepos+1, "IMG") == 0) /* the message is a image */
-                    msg->flag |= FLAG_MSG_IMG;
-
-                if(datalen == 0) {
-                    msg->data_len = 0;
-                    msg->data = NULL;
-                } else {
-                    msg->data_len = datalen;
-                    msg->data = (char*)malloc(datalen);
-                    memcpy(msg->data, msgre+headlen+1, datalen);
-                }
+                msg->name = NULL;
+                msg->group = NULL;
+                msg->data = (char*)buffer;
+                msg->data_len = buflen;
+                return CTRL_DATA;
+            } else if(tmp_len == buflen) {
+                error_t ret = net_parse(msg, (char*)buffer, buflen);
                 free(buffer);
+                if(ret != OK)
+                    return ret;
             } else {
                 free(buffer);
                 if(tmp_len == 0) {
@@ -196,3 +313,15 @@ error_t net_recvmsg(int sock, msgbuf_t* msg) {
         return NO_DATA;
     return OK;
 }
+
+// send a control message to the server, the data is terminated by a zero so clients
+// connected to servers that don't know about control messages ignore it
+error_t net_sendctrl(int sock, const char* data, len_t len, uint8_t version) {
+    uint8_t* alloc = (uint8_t*)malloc(NET_HEAD_ROOM+sizeof(id_t)+sizeof(len_t)+len+1);
+    uint8_t* buffer = alloc+NET_HEAD_ROOM;
+    memcpy(buffer+sizeof(id_t)+sizeof(len_t), data, len);
+    buffer[sizeof(id_t)+sizeof(len_t)+len] = 0;
+    error_t ret = net_send(sock, buffer, len+1, CTRL_ID, 0, version);
+    free(alloc);
+    return ret;
+}
@@ -3,9 +3,15 @@
 #define __NETIO_H__
 
 #include "types.h"
+#include "envelope.h"
 
-error_t net_sendmsg(int sock, const msgbuf_t* buffer);
+// version of the protocol every connection starts with, ENVELOPE_VERSION once both sides agreed on it
+#define NET_VERSION 1
 
-error_t net_recvmsg(int sock, msgbuf_t* buffer);
+error_t net_sendmsg(int sock, const msgbuf_t* buffer, uint8_t version);
+
+error_t net_recvmsg(int sock, msgbuf_t* buffer, len_t max_len, uint8_t version);
+
+error_t net_sendctrl(int sock, const char* data, len_t len, uint8_t version);
 
 #endif
@@ -0,0 +1,295 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "queue.h"
+
+#define START_QUEUE_CAP 16
+
+// bytes written before the data of the entry, its stamp or its envelope
+static const char* queue_entry_prefix(const queue_entry_t* entry, len_t* len) {
+    if(entry->enveloped) {
+        *len = entry->frame->head_len;
+        return entry->frame->head;
+    }
+    *len = entry->stamped ? SEQ_MSG_LEN : 0;
+    return entry->frame->stamp;
+}
+
+// data of the entry that is written after the prefix, the envelope replaces the header of the message
+static const char* queue_entry_data(const queue_entry_t* entry, len_t* len) {
+    len_t skip = entry->enveloped ? sizeof(id_t)+sizeof(len_t) : 0;
+    *len = entry->frame->len-skip;
+    return entry->frame->data+skip;
+}
+
+// bytes the entry takes up in the stream
+static len_t queue_entry_len(const queue_entry_t* entry) {
+    len_t prefix_len;
+    len_t data_len;
+    queue_entry_prefix(entry, &prefix_len);
+    queue_entry_data(entry, &data_len);
+    return prefix_len+data_len;
+}
+
+void queue_init(queue_t* queue) {
+    memset(queue, 0, sizeof(queue_t));
+}
+
+// drop the references to all frames that are still queued
+void queue_free(queue_t* queue) {
+    for(len_t i = 0; i < queue->count; i++)
+        frame_unref(queue->entries[(queue->first+i) % queue->cap].frame);
+    free(queue->entries);
+    memset(queue, 0, sizeof(queue_t));
+}
+
+// append the frame to the end of the queue, the queue takes over the callers reference
+void queue_push(queue_t* queue, frame_t* frame, uint64_t time) {
+    if(queue->count == queue->cap) {
+        len_t new_cap = queue->cap == 0 ? START_QUEUE_CAP : 2*queue->cap;
+        queue_entry_t* entries = (queue_entry_t*)malloc(sizeof(queue_entry_t)*new_cap);
+        for(len_t i = 0; i < queue->count; i++)
+            entries[i] = queue->entries[(queue->first+i) % queue->cap];
+        free(queue->entries);
+        queue->entries = entries;
+        queue->first = 0;
+        queue->cap = new_cap;
+    }
+    queue_entry_t* entry = &queue->entries[(queue->first+queue->count) % queue->cap];
+    entry->frame = frame;
+    entry->time = time;
+    entry->enveloped = queue->enveloped && frame->head_len != 0;
+    entry->stamped = queue->stamped && frame->seq != 0 && !entry->enveloped;
+    queue->count++;
+    queue->bytes += queue_entry_len(entry);
+    if(frame->flags & FRAME_EPHEMERAL)
+        queue->ephemeral++;
+}
+
+// fill iov with the unwritten part of the frames at the start of the queue, up to QUEUE_MAX_IOV iovecs
+// the frames stay in the queue until queue_consume is called, returns the number of used iovecs
+len_t queue_prepare(queue_t* queue, struct iovec* iov) {
+    len_t num_iov = 0;
+    len_t num_frames = 0;
+    while(num_frames < queue->count) {
+        const queue_entry_t* entry = &queue->entries[(queue->first+num_frames) % queue->cap];
+        len_t prefix_len;
+        len_t data_len;
+        const char* prefix = queue_entry_prefix(entry, &prefix_len);
+        const char* data = queue_entry_data(entry, &data_len);
+        if(num_iov+(prefix_len != 0 ? 2 : 1) > QUEUE_MAX_IOV)
+            break;
+        len_t skip = num_frames == 0 ? queue->offset : 0;
+        if(skip < prefix_len) {
+            iov[num_iov].iov_base = (void*)(prefix+skip);
+            iov[num_iov].iov_len = prefix_len-skip;
+            num_iov++;
+            skip = 0;
+        } else
+            skip -= prefix_len;
+        iov[num_iov].iov_base = (void*)(data+skip);
+        iov[num_iov].iov_len = data_len-skip;
+        num_iov++;
+        num_frames++;
+    }
+    queue->pinned = num_frames;
+    return num_iov;
+}
+
+// len bytes of the prepared frames have been written, release every frame that was written completely
+void queue_consume(queue_t* queue, len_t len, queue_written_t written, void* arg) {
+    queue->pinned = 0;
+    queue->bytes -= len;
+    while(queue->count > 0) {
+        frame_t* frame = queue->entries[queue->first].frame;
+        len_t frame_len = queue_entry_len(&queue->entries[queue->first]);
+        if(queue->offset+len < frame_len) {
+            queue->offset += len;
+            break;
+        }
+        len -= frame_len-queue->offset;
+        queue->offset = 0;
+        queue->first = (queue->first+1) % queue->cap;
+        queue->count--;
+        if(frame->flags & FRAME_EPHEMERAL)
+            queue->ephemeral--;
+        if(written != NULL && frame->time != 0) {
+            uint64_t time = frame->time;
+            bool_t first = !atomic_exchange_explicit(&frame->written, 1, memory_order_relaxed);
+            bool_t last = frame_release(frame);
+            if(last)
+                free(frame);
+            written(arg, time, first, last);
+        } else
+            frame_unref(frame);
+    }
+}
+
+// write as much of the queue as the socket accepts without blocking, multiple frames are
+// gathered into a single sendmsg call, returns ERROR only if the connection failed
+// the number of sendmsg calls is added to calls
+error_t queue_flush(queue_t* queue, int sock, queue_written_t written, void* arg, len_t* calls) {
+    while(queue->count > 0) {
+        struct iovec iov[QUEUE_MAX_IOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = queue_prepare(queue, iov);
+        ssize_t len = sendmsg(sock, &msg, MSG_DONTWAIT);
+        (*calls)++;
+        if(len == -1) {
+            queue->pinned = 0;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return OK;
+            else
+                return ERROR;
+        }
+        queue_consume(queue, len, written, arg);
+    }
+    return OK;
+}
+
+// time at which the oldest frame that is still queued was added
+uint64_t queue_oldest(const queue_t* queue) {
+    return queue->entries[queue->first].time;
+}
+
+// copy the bytes that still have to be written into out, which has room for queue->bytes bytes
+void queue_copy(const queue_t* queue, char* out) {
+    len_t pos = 0;
+    for(len_t i = 0; i < queue->count; i++) {
+        const queue_entry_t* entry = &queue->entries[(queue->first+i) % queue->cap];
+        len_t prefix_len;
+        len_t data_len;
+        const char* prefix = queue_entry_prefix(entry, &prefix_len);
+        const char* data = queue_entry_data(entry, &data_len);
+        len_t skip = i == 0 ? queue->offset : 0;
+        if(skip < prefix_len) {
+            memcpy(out+pos, prefix+skip, prefix_len-skip);
+            pos += prefix_len-skip;
+            skip = 0;
+        } else
+            skip -= prefix_len;
+        memcpy(out+pos, data+skip, data_len-skip);
+        pos += data_len-skip;
+    }
+}
+
+// remove every frame for which keep returns false, frames that are partially written or pinned are always kept
+static len_t queue_filter(queue_t* queue, bool_t (*keep)(const queue_t* queue, len_t i, const void* arg), const void* arg) {
+    len_t kept = 0;
+    len_t dropped = 0;
+    for(len_t i = 0; i < queue->count; i++) {
+        queue_entry_t entry = queue->entries[(queue->first+i) % queue->cap];
+        if((i == 0 && queue->offset != 0) || i < queue->pinned || keep(queue, i, arg)) {
+            queue->entries[(queue->first+kept) % queue->cap] = entry;
+            kept++;
+        } else {
+            queue->bytes -= queue_entry_len(&entry);
+            if(entry.frame->flags & FRAME_EPHEMERAL)
+                queue->ephemeral--;
+            frame_unref(entry.frame);
+            dropped++;
+        }
+    }
+    queue->count = kept;
+    return dropped;
+}
+
+static bool_t queue_keep_persistent(const queue_t* queue, len_t i, const void* arg) {
+    return !(queue->entries[(queue->first+i) % queue->cap].frame->flags & FRAME_EPHEMERAL);
+}
+
+// only the latest message is kept, but frames without a sequence number (control messages, the id of the client)
+// and the pieces of a relayed message are never dropped, the client needs them to follow the stream
+static bool_t queue_keep_latest(const queue_t* queue, len_t i, const void* arg) {
+    const frame_t* frame = queue->entries[(queue->first+i) % queue->cap].frame;
+    return i == queue->count-1 || frame->seq == 0 || (frame->flags & (FRAME_FIRST | FRAME_PART));
+}
+
+// keep everything but the ephemeral frames of the same sender and group as the given frame
+static bool_t queue_keep_other(const queue_t* queue, len_t i, const void* arg) {
+    const frame_t* frame = queue->entries[(queue->first+i) % queue->cap].frame;
+    const frame_t* newer = (const frame_t*)arg;
+    return !(frame->flags & FRAME_EPHEMERAL) || frame->group != newer->group || frame->len < sizeof(id_t)
+        || memcmp(frame->data, newer->data, sizeof(id_t)) != 0;
+}
+
+// append the ephemeral frame, older ephemeral frames of the same sender that are still queued are dropped,
+// since only the latest one matters, returns the number of dropped frames
+len_t queue_push_latest(queue_t* queue, frame_t* frame, uint64_t time) {
+    len_t dropped = queue->ephemeral == 0 ? 0 : queue_filter(queue, queue_keep_other, frame);
+    queue_push(queue, frame, time);
+    return dropped;
+}
+
+// stamp the frames that are already queued as well, nothing of them may have been written yet
+void queue_stamp_all(queue_t* queue) {
+    queue->stamped = 1;
+    for(len_t i = 0; i < queue->count; i++) {
+        queue_entry_t* entry = &queue->entries[(queue->first+i) % queue->cap];
+        if(!entry->stamped && !entry->enveloped && entry->frame->seq != 0) {
+            entry->stamped = 1;
+            queue->bytes += SEQ_MSG_LEN;
+        }
+    }
+}
+
+// write the frames that are already queued with their envelope as well, nothing of them may have been written yet
+void queue_envelope_all(queue_t* queue) {
+    queue->enveloped = 1;
+    for(len_t i = 0; i < queue->count; i++) {
+        queue_entry_t* entry = &queue->entries[(queue->first+i) % queue->cap];
+        if(!entry->enveloped && entry->frame->head_len != 0) {
+            queue->bytes -= queue_entry_len(entry);
+            entry->enveloped = 1;
+            entry->stamped = 0;
+            queue->bytes += queue_entry_len(entry);
+        }
+    }
+}
+
+// remove the first frame, nothing of it may have been written yet, the caller takes over the reference
+// and the time it was queued at is stored in time
+frame_t* queue_pop(queue_t* queue, uint64_t* time) {
+    queue_entry_t* entry = &queue->entries[queue->first];
+    frame_t* frame = entry->frame;
+    *time = entry->time;
+    queue->bytes -= queue_entry_len(entry);
+    if(frame->flags & FRAME_EPHEMERAL)
+        queue->ephemeral--;
+    queue->first = (queue->first+1) % queue->cap;
+    queue->count--;
+    return frame;
+}
+
+// drop all ephemeral frames that are still queued, returns the number of dropped frames
+len_t queue_drop_ephemeral(queue_t* queue) {
+    return queue_filter(queue, queue_keep_persistent, NULL);
+}
+
+// drop everything but the latest frame, returns the number of dropped frames
+len_t queue_skip(queue_t* queue) {
+    return queue_filter(queue, queue_keep_latest, NULL);
+}
+
+static bool_t queue_keep_unrelated(const queue_t* queue, len_t i, const void* arg) {
+    return queue->entries[(queue->first+i) % queue->cap].frame->relay != *(const uint64_t*)arg;
+}
+
+// drop the frames of the relayed message, returns 0 if its start is not queued anymore or is being written,
+// then the recipient already received a part of it
+bool_t queue_drop_relay(queue_t* queue, uint64_t relay) {
+    bool_t unwritten = 0;
+    for(len_t i = 0; i < queue->count; i++) {
+        const frame_t* frame = queue->entries[(queue->first+i) % queue->cap].frame;
+        if(frame->relay == relay && (frame->flags & FRAME_FIRST))
+            unwritten = !((i == 0 && queue->offset != 0) || i < queue->pinned);
+    }
+    queue_filter(queue, queue_keep_unrelated, &relay);
+    return unwritten;
+}
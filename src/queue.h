@@ -0,0 +1,67 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <sys/uio.h>
+
+#include "types.h"
+#include "frame.h"
+
+#define QUEUE_MAX_IOV 64 // maximum number of iovecs written by a single call
+
+typedef struct {
+    frame_t* frame;
+    uint64_t time;      // time the frame was queued at in milliseconds
+    bool_t stamped;     // the stamp of the frame is written before it
+    bool_t enveloped;   // the envelope of the frame is written instead of the header of its message
+} queue_entry_t;
+
+// called for every frame received from a client after it was written completely, time is the time of the frame,
+// first is set if it was not written to any other client before and last if nobody else still holds the frame
+typedef void (*queue_written_t)(void* arg, uint64_t time, bool_t first, bool_t last);
+
+// outbound queue of a connection, holds a reference to every frame that is not yet written
+typedef struct {
+    queue_entry_t* entries; // ring buffer
+    len_t first;
+    len_t count;
+    len_t cap;
+    len_t offset;       // bytes of the first frame that are already written
+    len_t bytes;        // bytes that still have to be written
+    len_t pinned;       // frames at the start that are being written and must not be dropped
+    len_t ephemeral;    // number of queued ephemeral frames
+    bool_t stamped;     // frames with a sequence number that are pushed are preceded by their stamp
+    bool_t enveloped;   // sealed frames that are pushed are written with their envelope, they need no stamp
+} queue_t;
+
+void queue_init(queue_t* queue);
+
+void queue_free(queue_t* queue);
+
+void queue_push(queue_t* queue, frame_t* frame, uint64_t time);
+
+len_t queue_push_latest(queue_t* queue, frame_t* frame, uint64_t time);
+
+void queue_stamp_all(queue_t* queue);
+
+void queue_envelope_all(queue_t* queue);
+
+frame_t* queue_pop(queue_t* queue, uint64_t* time);
+
+len_t queue_prepare(queue_t* queue, struct iovec* iov);
+
+void queue_consume(queue_t* queue, len_t len, queue_written_t written, void* arg);
+
+error_t queue_flush(queue_t* queue, int sock, queue_written_t written, void* arg, len_t* calls);
+
+uint64_t queue_oldest(const queue_t* queue);
+
+void queue_copy(const queue_t* queue, char* out);
+
+len_t queue_drop_ephemeral(queue_t* queue);
+
+len_t queue_skip(queue_t* queue);
+
+bool_t queue_drop_relay(queue_t* queue, uint64_t relay);
+
+#endif
@@ -1,5 +1,6 @@
 // Copyright (c) 2019 Roland Bernard
 
+#define _GNU_SOURCE // accept4
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,17 +8,2937 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
 
 #include "server.h"
+#include "frame.h"
+#include "queue.h"
+#include "history.h"
+#include "store.h"
+#include "group.h"
+#include "slot.h"
+#include "uring.h"
+#include "metrics.h"
+#include "bucket.h"
+#include "dedup.h"
+#include "wheel.h"
+#include "handoff.h"
 
 #define TIMEOUT_SEC 2
-#define MAX_HISTORY_SIZE 262144
 #define MAX_HISTORY_SAVE 1024
 #define SERVER_CLOCK 1000
 #define START_BUFFER_LEN 1024
+#define MAX_IDLE_BUFFER_LEN 65536 // an inbound buffer that grew larger than this for a big message is shrunk again
+#define MAX_EVENTS 64
+#define START_SLOTS 256 // connections per worker the slot table is allocated for at the start
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 256   // number of receive buffers shared by the clients of a worker, a power of two
+#define URING_BUFFER_SIZE 16384
+#define REPLAY_CHUNK 16384 // maximum size of a single piece of the history sent to a joining client, at least MAX_HISTORY_SAVE
+#define HELLO_WAIT 10 // milliseconds the history of a new client waits for its HELLO, clients send it right after connecting
+#define RATE_LARGE_FRAME 65536 // messages larger than this are limited by the rate for large messages
+#define RELAY_MIN 65536 // messages larger than this are relayed in pieces while they are received
+#define RELAY_PIECE 16384 // size of the pieces of a relayed message, unless less than that is left
+#define RELAY_STALL 2000  // milliseconds a relayed message may fall behind the minimum rate before it is cancelled
+#define RELAY_MIN_RATE 65536 // bytes per second a client has to send of a relayed message on average
+#define SLOW_HARD_LIMIT 4 // a slow client is disconnected if its queue grows past this multiple of the high watermark
+#define PEER_HEAD_LEN (2*sizeof(uint64_t)+1+2) // origin, sequence number, flags and length of the group name
+#define MAX_GROUP_NAME 65535 // longer group names are cut when a message is sent to a peer
+// largest number of bytes a single message takes in an outbound queue besides its body, the header of a message
+// to a peer with its tag and the group name or the stamp, the header and an envelope for a client
+#define MAX_FRAME_OVERHEAD (SEQ_MSG_LEN+ENVELOPE_MAX_HEAD+2*(sizeof(id_t)+sizeof(len_t))+PEER_HEAD_LEN+MAX_GROUP_NAME)
+
+// kind of a file descriptor registered with epoll
+#define CONN_STDIN 0
+#define CONN_LISTEN 1
+#define CONN_UDP 2
+#define CONN_CLIENT 3
+#define CONN_WAKE 4
+#define CONN_EPOLL 5    // the epoll instance itself, polled by io_uring
+#define CONN_METRICS 6  // unix socket the metrics are served on
+#define CONN_METRICS_OUT 7  // connection to the metrics socket the metrics are written to
+#define CONN_CONNECTING 8   // connection to a peer that is not yet established
+#define CONN_HANDOFF 9  // unix socket a successor connects to for a hot restart
+
+// with io_uring the data of an operation is the address of its connection, the lowest bits hold the kind of operation
+#define OP_EVENT 0  // accept, poll or receive depending on the kind of connection
+#define OP_SEND 1
+#define OP_MASK 7
+
+// the data of a timer is the address of its connection or peer link, the lowest bits hold the kind of timer
+#define TIMER_KEEPALIVE 0   // send a heartbeat or close the connection if nothing was received for too long
+#define TIMER_THROTTLE 1    // the buckets of a throttled client allow the next message
+#define TIMER_DIAL 2        // dial a peer again
+#define TIMER_FLUSH 3       // write the outbound queues of the worker that received frames
+#define TIMER_SAMPLE 4      // sample the gauges of the worker
+#define TIMER_HELLO 5       // a new client did not send its HELLO in time, its history is sent anyway
+#define TIMER_MASK 7
+
+// flags of a connection that is handed to a successor
+#define HANDOFF_PEER 1
+#define HANDOFF_HEARTBEAT 2
+#define HANDOFF_STAMPED 4
+#define HANDOFF_REPLAYING 8
+#define HANDOFF_LINK 16     // the connection was dialed, the address of the link follows
+#define HANDOFF_ENVELOPE_IN 32  // the client sends envelopes
+#define HANDOFF_ENVELOPE_OUT 64 // the client receives envelopes
+#define HANDOFF_RELAY_DROP 128  // the rest of the message the client is sending is dropped instead of relayed
+
+// latencies of the relay path that are recorded in histograms
+#define LATENCY_BODY 0          // from the complete header to the complete message
+#define LATENCY_FIRST_SEND 1    // from the complete message to the first write to a recipient
+#define LATENCY_LAST_FLUSH 2    // from the complete message to the last write to a recipient
+#define LATENCY_REPLAY 3        // from the accept to the end of the history replay
+#define NUM_LATENCY 4
+
+typedef struct conn_s {
+    uint8_t kind;
+    int fd;
+    id_t id;
+    slot_handle_t handle;   // handle inside the slot table of the worker, also passed to epoll
+    uint64_t joined_seq; // messages up to this sequence number were part of the history sent at the start
+    uint32_t group;     // group declared by the client, GROUP_ALL if it wants every message
+    len_t max_frame;    // largest message the client accepts, larger ones are not sent to it
+    len_t group_index;  // position inside the member list of the group
+    // the connection links us to another server of the federation, it only exchanges messages tagged with PEER_ID
+    bool_t peer;
+    len_t skip;     // bytes at the start of the inbound stream that are not messages (the id a peer gives us)
+    bool_t envelope_in; // the client switched to version 2 of the protocol, its messages are envelopes
+    // a large message of the client is relayed while it is received, the rest is relayed in pieces as it arrives
+    len_t relay_left;   // bytes of the message that are still to be received
+    bool_t relay_drop;  // the message was rejected, the rest is dropped instead
+    uint64_t relay_seq; // sequence number of the relayed message, its pieces are tagged with it
+    len_t relay_len;    // length of the whole message as it is received
+    uint64_t relay_start;   // time the message started, it is cancelled if it arrives too slowly
+    struct peer_link_s* link;   // the link the connection was dialed for, NULL if it was accepted
+    bool_t closing; // the connection will be closed at the end of the loop iteration
+    bool_t slow;    // the outbound queue passed the high watermark and did not yet drain to the low one
+    uint8_t close_reason;
+    uint64_t join_ns;   // time of the accept in nanoseconds
+    // the history is sent in chunks before any live message, live messages wait in the outbound queue until then
+    bool_t replaying;
+    bool_t replay_blocked;  // the socket did not accept the last chunk, wait until it is writable again
+    bool_t hello_wait;      // only the id is sent until the client declared its group or the hello timer expired
+    wheel_timer_t hello_timer;
+    len_t replay_index;     // position inside the replay list
+    uint64_t replay_seq;    // sequence number of the next message of the history to send
+    queue_t replay;
+    // inbound buffer, holds the message that is not yet received completely
+    char* in;
+    len_t in_len;
+    len_t in_cap;
+    uint64_t head_ns;   // time the header of the incomplete message was received, 0 if it is not yet complete
+    // token buckets limiting the messages of the client, while it is throttled the rest stays in the inbound buffer
+    bucket_t rate_frames;
+    bucket_t rate_bytes;
+    bucket_t rate_large;
+    bool_t throttled;
+    wheel_timer_t throttle_timer;   // expires once the buckets allow the next message
+    // a connection that answers heartbeats is closed once nothing was received from it for the idle timeout
+    bool_t heartbeat;
+    uint64_t last_recv;     // time anything was last received from the connection
+    uint64_t last_ping;     // time the last heartbeat was sent
+    wheel_timer_t keepalive;
+    queue_t out;    // outbound queue
+    // relayed messages whose start the client received, their pieces follow as they arrive
+    uint64_t* relays;
+    len_t num_relays;
+    len_t relays_cap;
+    // the relayed message that is written to the client, everything else is held back until its last piece, 0 if none
+    uint64_t streaming;
+    queue_t held;
+    bool_t pending;     // queued frames are written at the end of the loop iteration, or once the flush delay passed
+    len_t pending_index;    // position inside the pending list
+    // state of the io_uring operations, the connection is only freed once none of them is active
+    len_t inflight;
+    bool_t receiving;   // the receive is active, it is canceled while the client is throttled
+    bool_t detached;    // the connection was removed, but the kernel might still use its buffers
+    queue_t* sending;   // queue that is being written, NULL if no write is active
+    struct msghdr msg;
+    struct iovec* iov;
+} conn_t;
+
+// clients of a single worker that are members of a group
+typedef struct {
+    conn_t** conns;
+    len_t count;
+    len_t cap;
+} member_list_t;
+
+// clients of a single worker that received the start of a relayed message, its pieces only go to them
+typedef struct {
+    uint64_t relay;
+    conn_t** conns;
+    len_t count;
+    len_t cap;
+} recipient_list_t;
+
+// outgoing connection to another server given with --peer, it is dialed again whenever it is lost
+typedef struct peer_link_s {
+    struct sockaddr_in addr;
+    struct conn_s* conn;    // NULL while there is no connection
+    uint64_t next_dial;     // earliest time of the next attempt
+    wheel_timer_t dial_timer;
+} peer_link_t;
+
+struct server_s;
+
+// every worker runs its own event loop and only handles its own clients
+typedef struct {
+    struct server_s* server;
+    len_t index;
+    pthread_t thread;
+    uint64_t now;   // time at the start of the loop iteration in milliseconds
+    int epfd;
+    int sock;   // listening socket, with more then one worker the port is shared using SO_REUSEPORT
+    int evfd;   // eventfd used to wake the worker when messages are posted to its inbox
+    conn_t listen_conn;
+    conn_t wake_conn;
+    uring_t* ring;  // NULL if the worker only uses epoll
+    conn_t epoll_conn;
+    bool_t accept_paused;   // accepting failed because of missing resources, try again after a client left
+    // a successor takes over, the io_uring operations are canceled and not started again
+    bool_t quiescing;
+    len_t quiesce_wait; // accept and poll of the epoll instance that did not yet complete for the last time
+    metrics_t metrics;
+    wheel_timer_t sample_timer;     // only scheduled if the metrics are exported
+    histogram_t latency[NUM_LATENCY];
+    uint64_t recv_ns;   // time in nanoseconds of the receive that is being handled
+    // table of all connections, the handles of closed connections are never valid again
+    slot_table_t slots;
+    // member lists indexed by the group id, clients that did not declare a group receive everything
+    member_list_t* members;
+    len_t num_members;
+    member_list_t wildcard;
+    // connections to other servers, both accepted and dialed ones
+    member_list_t peers;
+    // recipients of the relayed messages whose last piece did not arrive yet
+    recipient_list_t* relays;
+    len_t num_relays;
+    len_t relays_cap;
+    // clients that are still receiving the history
+    conn_t** replays;
+    len_t num_replays;
+    len_t replays_cap;
+    bool_t replay_ready;    // at least one of them can continue without waiting for epoll
+    // timeouts, heartbeats and everything else that happens at a given time, the worker sleeps until the next one
+    wheel_t timers;
+    // clients with new frames in their outbound queue, written together at the end of the loop iteration
+    // or with a flush delay once the flush timer expires
+    conn_t** pending;
+    len_t num_pending;
+    len_t pending_cap;
+    wheel_timer_t flush_timer;
+    // clients that will be disconnected at the end of the loop iteration
+    conn_t** dead;
+    len_t num_dead;
+    len_t dead_cap;
+    // frames received by other workers, that still have to be forwarded to our clients
+    pthread_mutex_t inbox_lock;
+    frame_t** inbox;
+    len_t inbox_len;
+    len_t inbox_cap;
+    // second buffer the inbox is swapped with while it is drained
+    frame_t** drain;
+    len_t drain_cap;
+} worker_t;
+
+// state shared by all workers
+typedef struct server_s {
+    config_t conf;
+    worker_t* workers;
+    len_t num_workers;
+    atomic_bool end;
+    // variables to keep track of some stats
+    atomic_uint_fast64_t cid;
+    atomic_uint_fast64_t num_clients;
+    atomic_uint_fast64_t num_messg;
+    atomic_uint_fast64_t slow_trips;
+    atomic_uint_fast64_t slow_dropped;
+    atomic_uint_fast64_t slow_disconnects;
+    // the history, its log and sequence numbers are protected by the history lock
+    // every group has its own history with its own budget, so a busy group does not evict the messages of a quiet one
+    pthread_mutex_t history_lock;
+    history_t history;      // messages without a group
+    history_t* partitions;  // indexed by the group id
+    len_t num_partitions;
+    len_t history_len;      // bytes of all histories, limited by the total budget
+    bool_t use_store;
+    store_t store;
+    // checkpoints of the log are saved by their own thread, a slow disk should not stall the workers
+    pthread_t store_thread;
+    pthread_cond_t store_cond;  // signaled under the history lock when a checkpoint is due or the thread should stop
+    bool_t store_end;
+    uint64_t seq;
+    // group names are interned once, after that only the group id is used
+    pthread_mutex_t group_lock;
+    group_table_t groups;
+    // the latency histograms can not be cleared by another thread, they are reset by remembering their values
+    // the baseline is only used by the first worker, which serves the metrics
+    histogram_snapshot_t latency_base[NUM_LATENCY];
+    // messages of our own clients are sent to the peers with our origin and the next peer sequence number,
+    // the origin changes with every start so a restarted server does not look like a duplicate,
+    // it is also the epoch resuming clients compare sequence numbers in
+    uint64_t origin;
+    uint64_t peer_seq;  // protected by the history lock
+    // messages received from peers, only the first worker handles them so the messages of an origin stay in order
+    dedup_table_t seen;
+    peer_link_t* links; // dialed by the first worker
+    len_t num_links;
+    int handoff_fd;     // connection to the successor that takes over, -1 unless the server is handing off
+} server_t;
+
+// set by SIGUSR1, the latency histograms are reset once the first worker notices it
+static atomic_bool server_reset_requested;
+
+// monotonic time in milliseconds
+static uint64_t server_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+// read the length of the message from the message header
+static len_t server_read_len(const char* msg) {
+    len_t len = 0;
+    for(uint32_t i = 0; i < sizeof(len_t); i++)
+        len |= (len_t)(uint8_t)msg[sizeof(id_t)+i] << (8*i);
+    return len;
+}
+
+// read a little endian integer of the given size
+static uint64_t server_read_int(const char* data, len_t size) {
+    uint64_t value = 0;
+    for(len_t i = 0; i < size; i++)
+        value |= (uint64_t)(uint8_t)data[i] << (8*i);
+    return value;
+}
+
+// write a little endian integer of the given size
+static void server_write_int(char* data, uint64_t value, len_t size) {
+    for(len_t i = 0; i < size; i++)
+        data[i] = (value >> (8*i)) & 0xff;
+}
+
+// start receiving into the provided buffers of io_uring
+static void server_start_recv(worker_t* worker, conn_t* conn) {
+    uring_recv(worker->ring, conn->fd, (uintptr_t)conn | OP_EVENT);
+    conn->receiving = 1;
+    conn->inflight++;
+}
+
+// add the connection to the slot table of the worker and register it with its epoll instance,
+// with io_uring the listening socket and the clients are handled by the ring instead
+static error_t server_watch(worker_t* worker, conn_t* conn, uint32_t events) {
+    conn->handle = slot_insert(&worker->slots, conn);
+    if(worker->ring != NULL && (conn->kind == CONN_LISTEN || conn->kind == CONN_CLIENT)) {
+        if(conn->kind == CONN_LISTEN)
+            uring_accept(worker->ring, conn->fd, (uintptr_t)conn | OP_EVENT);
+        else
+            server_start_recv(worker, conn);
+        return OK;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = conn->handle;
+    if(epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        slot_remove(&worker->slots, conn->handle);
+        return ERROR;
+    }
+    return OK;
+}
+
+// create a listening tcp socket, reuse_port allows multiple workers to bind the same port
+static int server_listen(const config_t* conf, bool_t reuse_port) {
+    // create  socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == -1) {
+        perror("socket couldn't be created");
+        return -1;
+    }
+    // set timeout
+    struct timeval tv;
+    tv.tv_sec = TIMEOUT_SEC;
+    tv.tv_usec = 0;
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) == -1) {
+        perror("setsockopt error");
+        close(sock);
+        return -1;
+    }
+    int enable = 1;
+    if (setsockopt(sock ,SOL_SOCKET, SO_REUSEADDR, &enable ,sizeof(enable)) == -1) {
+        perror("setsockopt error");
+        close(sock);
+        return -1;
+    }
+    if (reuse_port && setsockopt(sock ,SOL_SOCKET, SO_REUSEPORT, &enable ,sizeof(enable)) == -1) {
+        perror("setsockopt error");
+        close(sock);
+        return -1;
+    }
+    // bind socket
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    if(conf->flag & FLAG_CONF_DEF_HOST)
+        addr.sin_addr.s_addr = INADDR_ANY;
+    else
+        addr.sin_addr.s_addr = inet_addr(conf->host);
+    addr.sin_port = htons(conf->port);
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("couldn't bind socket");
+        close(sock);
+        return -1;
+    }
+    // configure sockert to listen
+    if(listen(sock, 64) == -1) {
+        perror("couldn't bind socket");
+        close(sock);
+        return -1;
+    }
+    // configure socket to be nonblocking
+    int flags = fcntl(sock, F_GETFL);
+    if(flags == -1) {
+        perror("couldn't get fd flags");
+        close(sock);
+        return -1;
+    }
+    flags |= O_NONBLOCK;
+    if(fcntl(sock, F_SETFL, flags) == -1) {
+        perror("couldn't set fd flags");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// create a listening unix socket at the path, an old socket at the path is replaced
+static int server_listen_unix(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "unix socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(sock == -1) {
+        perror("unix socket couldn't be created");
+        return -1;
+    }
+    unlink(path);
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+        perror("couldn't bind unix socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// return the member list of the group, it is created if needed
+static member_list_t* server_group_members(worker_t* worker, uint32_t group) {
+    if(group == GROUP_ALL)
+        return &worker->wildcard;
+    if(group >= worker->num_members) {
+        len_t new_num = worker->num_members == 0 ? 16 : worker->num_members;
+        while(new_num <= group)
+            new_num *= 2;
+        worker->members = (member_list_t*)realloc(worker->members, sizeof(member_list_t)*new_num);
+        memset(worker->members+worker->num_members, 0, sizeof(member_list_t)*(new_num-worker->num_members));
+        worker->num_members = new_num;
+    }
+    return &worker->members[group];
+}
+
+// return the history of the group, it is created if needed, needs the history lock
+static history_t* server_partition(server_t* server, uint32_t group) {
+    if(group == GROUP_ALL)
+        return &server->history;
+    if(group >= server->num_partitions) {
+        len_t new_num = server->num_partitions == 0 ? 16 : server->num_partitions;
+        while(new_num <= group)
+            new_num *= 2;
+        server->partitions = (history_t*)realloc(server->partitions, sizeof(history_t)*new_num);
+        for(len_t i = server->num_partitions; i < new_num; i++)
+            history_init(&server->partitions[i], server->conf.history_bytes, server->conf.history_entries);
+        server->num_partitions = new_num;
+    }
+    return &server->partitions[group];
+}
+
+// history that loses its oldest message once all of them exceed the total budget, the messages of groups
+// without members go first, starting with the oldest, otherwise the largest history is shortened
+// needs the history lock
+static history_t* server_history_victim(server_t* server) {
+    history_t* largest = &server->history;
+    history_t* idle = NULL;
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&server->group_lock);
+    for(len_t i = 0; i < server->num_partitions && i < server->groups.count; i++) {
+        history_t* hist = &server->partitions[i];
+        if(hist->count == 0)
+            continue;
+        if(server->groups.groups[i]->members == 0) {
+            uint64_t seq = history_next(hist, 0);
+            if(seq < oldest) {
+                oldest = seq;
+                idle = hist;
+            }
+        } else if(hist->len > largest->len)
+            largest = hist;
+    }
+    pthread_mutex_unlock(&server->group_lock);
+    return idle != NULL ? idle : largest;
+}
+
+// add the message to the history of its group, keeping all histories within the total budget,
+// needs the history lock
+static void server_history_add(server_t* server, uint32_t group, const char* msg, len_t len, uint64_t seq) {
+    history_t* hist = server_partition(server, group);
+    server->history_len -= hist->len;
+    history_add(hist, msg, len, seq);
+    server->history_len += hist->len;
+    while(server->history_len > server->conf.history_total) {
+        history_t* victim = server_history_victim(server);
+        server->history_len -= victim->len;
+        history_drop(victim);
+        server->history_len += victim->len;
+    }
+}
+
+// id of the group with the given name, new groups are only created while there are fewer than the maximum,
+// returns GROUP_NONE otherwise
+static uint32_t server_find_group(server_t* server, const char* name, len_t len) {
+    pthread_mutex_lock(&server->group_lock);
+    uint32_t group = group_find(&server->groups, name, len);
+    if(group == GROUP_NONE && server->groups.count < server->conf.max_groups)
+        group = group_intern(&server->groups, name, len);
+    pthread_mutex_unlock(&server->group_lock);
+    return group;
+}
+
+// the i-th history the client receives, the history of messages without a group comes first, followed by
+// the one of its group or of every group if it did not declare one, returns NULL after the last one
+static history_t* server_client_partition(server_t* server, const conn_t* conn, len_t i) {
+    if(i == 0)
+        return &server->history;
+    if(conn->group == GROUP_ALL)
+        return i <= server->num_partitions ? &server->partitions[i-1] : NULL;
+    return i == 1 && conn->group < server->num_partitions ? &server->partitions[conn->group] : NULL;
+}
+
+// group written into the envelopes of the messages of the history
+static uint32_t server_envelope_group(const server_t* server, const history_t* hist) {
+    return hist == &server->history ? 0 : hist-server->partitions+1;
+}
+
+// sequence number of the oldest message of any history that is not older than since, the log has to keep
+// everything after it, the older ones are in the snapshot
+static uint64_t server_oldest(const server_t* server, uint64_t since) {
+    uint64_t oldest = history_next(&server->history, since);
+    for(len_t i = 0; i < server->num_partitions; i++) {
+        uint64_t seq = history_next(&server->partitions[i], since);
+        if(seq < oldest)
+            oldest = seq;
+    }
+    return oldest;
+}
+
+// copy the messages of the history that are older than the cut of the new snapshot into it
+static void server_snapshot_history(store_checkpoint_t* checkpoint, const history_t* hist, const char* name) {
+    len_t name_len = strlen(name);
+    if(name_len > MAX_GROUP_NAME)
+        name_len = MAX_GROUP_NAME;
+    for(len_t i = 0; i < hist->count; i++) {
+        const history_entry_t* entry = &hist->entries[(hist->first+i) % hist->cap];
+        if(entry->seq >= checkpoint->snapshot_seq)
+            break;
+        uint64_t next_seq;
+        char* out = store_snapshot_add(checkpoint, entry->len, entry->seq, name, name_len);
+        history_read(hist, entry->seq, entry->seq, out, entry->len, &next_seq, HISTORY_RAW, 0);
+    }
+}
+
+// take a checkpoint of the log while the history is locked, the messages of quiet groups that would hold it
+// back too far are copied into a new snapshot
+static void server_take_checkpoint(server_t* server, store_checkpoint_t* checkpoint) {
+    len_t live_bytes = server->history.len;
+    for(len_t i = 0; i < server->num_partitions; i++)
+        live_bytes += server->partitions[i].len;
+    store_checkpoint_take(&server->store, server_oldest(server, server->store.snapshot_seq), live_bytes, checkpoint);
+    if(!checkpoint->new_snapshot)
+        return;
+    server_snapshot_history(checkpoint, &server->history, "");
+    pthread_mutex_lock(&server->group_lock);
+    for(len_t i = 0; i < server->num_partitions && i < server->groups.count; i++)
+        server_snapshot_history(checkpoint, &server->partitions[i], server->groups.groups[i]->name);
+    pthread_mutex_unlock(&server->group_lock);
+}
+
+// save a last checkpoint and close the log
+static void server_close_store(server_t* server) {
+    store_checkpoint_t checkpoint;
+    server_take_checkpoint(server, &checkpoint);
+    store_checkpoint_save(&server->store, &checkpoint);
+    store_close(&server->store);
+}
+
+// add a message replayed from the log to the history of its group
+static void server_load_message(void* arg, const char* msg, len_t len, uint64_t seq, const char* name, len_t name_len) {
+    server_t* server = (server_t*)arg;
+    uint32_t group = GROUP_ALL;
+    if(name_len != 0) {
+        pthread_mutex_lock(&server->group_lock);
+        group = group_intern(&server->groups, name, name_len);
+        pthread_mutex_unlock(&server->group_lock);
+    }
+    server_history_add(server, group, msg, len, seq);
+}
+
+static void server_free_history(server_t* server) {
+    history_free(&server->history);
+    for(len_t i = 0; i < server->num_partitions; i++)
+        history_free(&server->partitions[i]);
+    free(server->partitions);
+    server->partitions = NULL;
+    server->num_partitions = 0;
+    server->history_len = 0;
+}
+
+// add the connection to the member list, a connection is only in a single list at a time
+static void server_list_add(member_list_t* list, conn_t* conn) {
+    if(list->count == list->cap) {
+        list->cap = list->cap == 0 ? 16 : 2*list->cap;
+        list->conns = (conn_t**)realloc(list->conns, sizeof(conn_t*)*list->cap);
+    }
+    conn->group_index = list->count;
+    list->conns[list->count++] = conn;
+}
+
+// remove the connection from the member list
+static void server_list_remove(member_list_t* list, conn_t* conn) {
+    list->count--;
+    list->conns[conn->group_index] = list->conns[list->count];
+    list->conns[conn->group_index]->group_index = conn->group_index;
+}
+
+// the recipients of the relayed message, NULL if none of the clients of the worker received its start
+static recipient_list_t* server_find_recipients(worker_t* worker, uint64_t relay) {
+    for(len_t i = 0; i < worker->num_relays; i++)
+        if(worker->relays[i].relay == relay)
+            return &worker->relays[i];
+    return NULL;
+}
+
+static void server_add_recipient(worker_t* worker, conn_t* conn, uint64_t relay) {
+    recipient_list_t* list = server_find_recipients(worker, relay);
+    if(list == NULL) {
+        if(worker->num_relays == worker->relays_cap) {
+            worker->relays_cap = worker->relays_cap == 0 ? 4 : 2*worker->relays_cap;
+            worker->relays = (recipient_list_t*)realloc(worker->relays, sizeof(recipient_list_t)*worker->relays_cap);
+        }
+        list = &worker->relays[worker->num_relays++];
+        memset(list, 0, sizeof(recipient_list_t));
+        list->relay = relay;
+    }
+    if(list->count == list->cap) {
+        list->cap = list->cap == 0 ? 16 : 2*list->cap;
+        list->conns = (conn_t**)realloc(list->conns, sizeof(conn_t*)*list->cap);
+    }
+    list->conns[list->count++] = conn;
+}
+
+// the client is gone before the last piece of the relayed message arrived
+static void server_remove_recipient(worker_t* worker, conn_t* conn, uint64_t relay) {
+    recipient_list_t* list = server_find_recipients(worker, relay);
+    if(list == NULL)
+        return;
+    for(len_t i = 0; i < list->count; i++)
+        if(list->conns[i] == conn) {
+            list->conns[i] = list->conns[--list->count];
+            return;
+        }
+}
+
+// the last piece of the relayed message or its cancellation was forwarded
+static void server_end_recipients(worker_t* worker, recipient_list_t* list) {
+    free(list->conns);
+    *list = worker->relays[--worker->num_relays];
+}
+
+// add the client to the member list of the group
+static void server_join_group(worker_t* worker, conn_t* conn, uint32_t group) {
+    conn->group = group;
+    server_list_add(server_group_members(worker, group), conn);
+    if(group != GROUP_ALL) {
+        pthread_mutex_lock(&worker->server->group_lock);
+        worker->server->groups.groups[group]->members++;
+        pthread_mutex_unlock(&worker->server->group_lock);
+    }
+}
+
+// remove the client from the member list of its group
+static void server_leave_group(worker_t* worker, conn_t* conn) {
+    server_list_remove(server_group_members(worker, conn->group), conn);
+    if(conn->group != GROUP_ALL) {
+        pthread_mutex_lock(&worker->server->group_lock);
+        worker->server->groups.groups[conn->group]->members--;
+        pthread_mutex_unlock(&worker->server->group_lock);
+    }
+}
+
+// add the client to the list of clients that are receiving the history
+static void server_start_replay(worker_t* worker, conn_t* conn) {
+    if(worker->num_replays == worker->replays_cap) {
+        worker->replays_cap = worker->replays_cap == 0 ? 16 : 2*worker->replays_cap;
+        worker->replays = (conn_t**)realloc(worker->replays, sizeof(conn_t*)*worker->replays_cap);
+    }
+    conn->replaying = 1;
+    conn->replay_index = worker->num_replays;
+    worker->replays[worker->num_replays++] = conn;
+}
+
+// remove the client from the list of clients that are receiving the history
+static void server_stop_replay(worker_t* worker, conn_t* conn) {
+    conn->replaying = 0;
+    worker->num_replays--;
+    worker->replays[conn->replay_index] = worker->replays[worker->num_replays];
+    worker->replays[conn->replay_index]->replay_index = conn->replay_index;
+}
+
+// stop handling the messages of the client until its buckets allow the next one
+static void server_throttle(worker_t* worker, conn_t* conn, bucket_t* bytes, uint64_t byte_rate) {
+    const config_t* conf = &worker->server->conf;
+    conn->throttled = 1;
+    uint64_t wait = bucket_wait(&conn->rate_frames, conf->rate_frames);
+    if(bucket_wait(bytes, byte_rate) > wait)
+        wait = bucket_wait(bytes, byte_rate);
+    wheel_schedule(&worker->timers, &conn->throttle_timer, worker->now+wait);
+    if(conn->receiving) /* with epoll the socket is simply not read, io_uring would keep receiving */
+        uring_cancel_op(worker->ring, (uintptr_t)conn | OP_EVENT);
+}
+
+// the client is in the middle of a message that is relayed, the recipients wait for the rest of it
+static bool_t server_is_relaying(const conn_t* conn) {
+    return conn->relay_left != 0 && !conn->relay_drop;
+}
+
+// time at which the relayed message of the client falls behind the minimum rate, a short stall
+// at any point is allowed, but a client trickling its message would hold back its recipients for too long
+static uint64_t server_relay_deadline(const conn_t* conn) {
+    return conn->relay_start+RELAY_STALL+(uint64_t)(conn->relay_len-conn->relay_left)*1000/RELAY_MIN_RATE;
+}
+
+// schedule the keepalive timer for the next heartbeat or the idle timeout, whichever comes first,
+// a client that is too slow in the middle of a relayed message is not waited for that long
+static void server_keepalive(worker_t* worker, conn_t* conn) {
+    const config_t* conf = &worker->server->conf;
+    uint64_t expires = UINT64_MAX;
+    if(conn->heartbeat && conf->idle_timeout != 0)
+        expires = conn->last_recv+conf->idle_timeout;
+    if(conn->heartbeat && conf->heartbeat != 0) /* a heartbeat is only sent if nothing was received since the last one */ {
+        uint64_t quiet = conn->last_ping > conn->last_recv ? conn->last_ping : conn->last_recv;
+        if(quiet+conf->heartbeat < expires)
+            expires = quiet+conf->heartbeat;
+    }
+    if(server_is_relaying(conn) && server_relay_deadline(conn) < expires)
+        expires = server_relay_deadline(conn);
+    if(expires != UINT64_MAX)
+        wheel_schedule(&worker->timers, &conn->keepalive, expires);
+}
+
+// take the tokens for a message of the client, if the buckets are empty the message is rejected
+// or the client throttled depending on the policy, returns 0 if the message must not be handled now
+static bool_t server_admit(worker_t* worker, conn_t* conn, len_t len) {
+    const config_t* conf = &worker->server->conf;
+    if(conn->peer) /* the clients of the peer were already limited by it */
+        return 1;
+    bool_t large = len > RATE_LARGE_FRAME;
+    bucket_t* bytes = large ? &conn->rate_large : &conn->rate_bytes;
+    uint64_t byte_rate = large ? conf->rate_large : conf->rate_bytes;
+    if(bucket_ready(&conn->rate_frames, conf->rate_frames, worker->now) && bucket_ready(bytes, byte_rate, worker->now)) {
+        bucket_take(&conn->rate_frames, conf->rate_frames, 1);
+        bucket_take(bytes, byte_rate, len);
+        return 1;
+    }
+    if(conf->rate_policy == RATE_POLICY_QUEUE) {
+        metrics_add(&worker->metrics.frames_delayed, 1);
+        server_throttle(worker, conn, bytes, byte_rate);
+    }
+    return 0;
+}
+
+// close the connection and free the client
+static void server_free_client(worker_t* worker, conn_t* conn) {
+    slot_remove(&worker->slots, conn->handle);
+    close(conn->fd); // closing the fd also removes it from the epoll instance
+    free(conn->in);
+    free(conn->iov);
+    queue_free(&conn->out);
+    queue_free(&conn->replay);
+    queue_free(&conn->held);
+    free(conn->relays);
+    free(conn);
+    if(worker->accept_paused && !worker->quiescing) /* a file descriptor is available again */ {
+        worker->accept_paused = 0;
+        uring_accept(worker->ring, worker->sock, (uintptr_t)&worker->listen_conn | OP_EVENT);
+    }
+}
+
+// remove the client from the lists, it is freed once io_uring no longer uses it
+static void server_disconnect(worker_t* worker, conn_t* conn) {
+    if(conn->peer) {
+        server_list_remove(&worker->peers, conn);
+        if(conn->link != NULL) /* dial again after a moment */ {
+            conn->link->conn = NULL;
+            conn->link->next_dial = worker->now+SERVER_CLOCK;
+            wheel_schedule(&worker->timers, &conn->link->dial_timer, conn->link->next_dial);
+        }
+    } else {
+        server_leave_group(worker, conn);
+        atomic_fetch_sub(&worker->server->num_clients, 1);
+    }
+    for(len_t i = 0; i < conn->num_relays; i++)
+        server_remove_recipient(worker, conn, conn->relays[i]);
+    if(conn->replaying)
+        server_stop_replay(worker, conn);
+    if(conn->pending) /* only possible with a flush delay */ {
+        worker->num_pending--;
+        worker->pending[conn->pending_index] = worker->pending[worker->num_pending];
+        worker->pending[conn->pending_index]->pending_index = conn->pending_index;
+    }
+    wheel_cancel(&worker->timers, &conn->throttle_timer);
+    wheel_cancel(&worker->timers, &conn->keepalive);
+    wheel_cancel(&worker->timers, &conn->hello_timer);
+    metrics_add(&worker->metrics.disconnects[conn->close_reason], 1);
+    if(conn->inflight != 0) {
+        uring_cancel(worker->ring, conn->fd);
+        conn->detached = 1;
+    } else
+        server_free_client(worker, conn);
+}
+
+// apply the slow consumer policy if the outbound queue passed the high watermark, either in bytes
+// or in the age of the oldest frame, the frames held back behind a relayed message count as well,
+// returns ERROR if the client has to be disconnected
+static error_t server_check_queue(worker_t* worker, conn_t* conn) {
+    server_t* server = worker->server;
+    const config_t* conf = &server->conf;
+    queue_t* queue = &conn->out;
+    if(conn->slow) {
+        if(queue->bytes+conn->held.bytes <= conf->queue_low) /* the client caught up */
+            conn->slow = 0;
+    } else if(queue->bytes+conn->held.bytes > conf->queue_high || (queue->count > 0 && worker->now-queue_oldest(queue) > conf->queue_age)) {
+        conn->slow = 1;
+        atomic_fetch_add(&server->slow_trips, 1);
+        if(conf->slow_policy == SLOW_POLICY_DISCONNECT) {
+            atomic_fetch_add(&server->slow_disconnects, 1);
+            conn->close_reason = CLOSE_SLOW;
+            return ERROR;
+        } else if(conf->slow_policy == SLOW_POLICY_DROP)
+            atomic_fetch_add(&server->slow_dropped, queue_drop_ephemeral(queue)+queue_drop_ephemeral(&conn->held));
+    }
+    if(conn->slow) {
+        if(conf->slow_policy == SLOW_POLICY_SKIP && queue->bytes+conn->held.bytes > conf->queue_high)
+            atomic_fetch_add(&server->slow_dropped, queue_skip(queue)+queue_skip(&conn->held));
+        // memory must not grow without bound, no matter what the policy is,
+        // but a message of the largest accepted size always fits on top of the high watermark
+        len_t hard_limit = SLOW_HARD_LIMIT*conf->queue_high;
+        if(hard_limit < conf->queue_high+conf->max_frame+MAX_FRAME_OVERHEAD)
+            hard_limit = conf->queue_high+conf->max_frame+MAX_FRAME_OVERHEAD;
+        if(queue->bytes+conn->held.bytes > hard_limit) {
+            atomic_fetch_add(&server->slow_disconnects, 1);
+            conn->close_reason = CLOSE_SLOW;
+            return ERROR;
+        }
+    }
+    return OK;
+}
+
+// a frame was written completely to a client, record its latency if it is the first or the last write
+static void server_frame_written(void* arg, uint64_t time, bool_t first, bool_t last) {
+    worker_t* worker = (worker_t*)arg;
+    if(first || last) {
+        uint64_t now = metrics_time_ns();
+        if(first)
+            metrics_record(&worker->latency[LATENCY_FIRST_SEND], now-time);
+        if(last)
+            metrics_record(&worker->latency[LATENCY_LAST_FLUSH], now-time);
+    }
+}
+
+// drop a reference that is not held by a queue, if it is the last one all writes are done now
+static void server_unref(worker_t* worker, frame_t* frame) {
+    if(frame_release(frame)) {
+        if(frame->time != 0 && atomic_load(&frame->written))
+            metrics_record(&worker->latency[LATENCY_LAST_FLUSH], metrics_time_ns()-frame->time);
+        free(frame);
+    }
+}
+
+// submit a write of the queue to io_uring, only a single write per client is active at a time
+static void server_submit_send(worker_t* worker, conn_t* conn, queue_t* queue, bool_t wait_writable) {
+    if(conn->iov == NULL)
+        conn->iov = (struct iovec*)malloc(sizeof(struct iovec)*QUEUE_MAX_IOV);
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = queue_prepare(queue, conn->iov);
+    conn->sending = queue;
+    conn->inflight++;
+    metrics_add(&worker->metrics.writes, 1);
+    uring_sendmsg(worker->ring, conn->fd, &conn->msg, wait_writable, (uintptr_t)conn | OP_SEND);
+}
+
+// write the queue to the client, with io_uring the write is only submitted and completes in a later loop iteration
+static error_t server_write(worker_t* worker, conn_t* conn, queue_t* queue) {
+    if(worker->ring == NULL) {
+        len_t bytes = queue->bytes;
+        len_t count = queue->count;
+        len_t calls = 0;
+        error_t ret = queue_flush(queue, conn->fd, server_frame_written, worker, &calls);
+        metrics_add(&worker->metrics.writes, calls);
+        metrics_add(&worker->metrics.bytes_out, bytes-queue->bytes);
+        metrics_add(&worker->metrics.frames_out, count-queue->count);
+        return ret;
+    }
+    if(conn->sending == NULL && queue->count != 0)
+        server_submit_send(worker, conn, queue, 0);
+    return OK;
+}
+
+// write the outbound queue of the client, called when the socket is writable again
+static error_t server_flush(worker_t* worker, conn_t* conn) {
+    if(server_write(worker, conn, &conn->out) == ERROR)
+        return ERROR;
+    if(conn->slow && conn->out.bytes+conn->held.bytes <= worker->server->conf.queue_low)
+        conn->slow = 0;
+    return OK;
+}
+
+// copy the next part of the history of the client into out, but not more then max bytes, the histories it receives
+// are merged by always reading the one with the oldest next message up to the next message of any other, needs the history lock
+static len_t server_read_history(server_t* server, conn_t* conn, char* out, len_t max) {
+    len_t len = 0;
+    while(conn->replay_seq <= conn->joined_seq) {
+        history_t* next = NULL;
+        uint64_t next_seq = UINT64_MAX;
+        uint64_t other_seq = UINT64_MAX;
+        history_t* hist;
+        for(len_t i = 0; (hist = server_client_partition(server, conn, i)) != NULL; i++) {
+            uint64_t seq = history_next(hist, conn->replay_seq);
+            if(seq < next_seq) {
+                other_seq = next_seq;
+                next_seq = seq;
+                next = hist;
+            } else if(seq < other_seq)
+                other_seq = seq;
+        }
+        if(next == NULL || next_seq > conn->joined_seq) /* nothing is left */ {
+            conn->replay_seq = conn->joined_seq+1;
+            break;
+        }
+        uint64_t to_seq = other_seq <= conn->joined_seq ? other_seq-1 : conn->joined_seq;
+        uint8_t format = conn->out.enveloped ? HISTORY_ENVELOPED : conn->out.stamped ? HISTORY_STAMPED : HISTORY_RAW;
+        len += history_read(next, next_seq, to_seq, out+len, max-len, &conn->replay_seq, format, server_envelope_group(server, next));
+        if(conn->replay_seq <= to_seq) /* the chunk is full */
+            break;
+    }
+    return len;
+}
+
+// write the next chunk of the history to a joining client, when the whole history has been written
+// the live messages that were queued in the meantime follow, returns ERROR if the client has to be disconnected
+static error_t server_replay(worker_t* worker, conn_t* conn) {
+    server_t* server = worker->server;
+    if(conn->replay.count == 0) {
+        if(conn->replay_seq > conn->joined_seq) {
+            metrics_record(&worker->latency[LATENCY_REPLAY], metrics_time_ns()-conn->join_ns);
+            server_stop_replay(worker, conn);
+            return server_flush(worker, conn);
+        }
+        if(conn->hello_wait)
+            return OK;
+        // messages that were evicted in the meantime are simply skipped
+        frame_t* frame = frame_alloc(REPLAY_CHUNK, 0);
+        pthread_mutex_lock(&server->history_lock);
+        frame->len = server_read_history(server, conn, frame->data, REPLAY_CHUNK);
+        pthread_mutex_unlock(&server->history_lock);
+        if(frame->len == 0) {
+            frame_unref(frame);
+            return OK;
+        }
+        queue_push(&conn->replay, frame, worker->now);
+    }
+    if(server_write(worker, conn, &conn->replay) == ERROR)
+        return ERROR;
+    conn->replay_blocked = conn->replay.count != 0;
+    return OK;
+}
+
+// write the outbound queue of the client at the end of the loop iteration, so every frame
+// the client receives in this iteration is written with a single call, a flush delay also gathers
+// the frames of the following iterations
+static void server_write_later(worker_t* worker, conn_t* conn) {
+    if(worker->num_pending == worker->pending_cap) {
+        worker->pending_cap = worker->pending_cap == 0 ? 16 : 2*worker->pending_cap;
+        worker->pending = (conn_t**)realloc(worker->pending, sizeof(conn_t*)*worker->pending_cap);
+    }
+    conn->pending = 1;
+    conn->pending_index = worker->num_pending;
+    worker->pending[worker->num_pending++] = conn;
+    uint64_t delay = worker->server->conf.flush_delay;
+    if(delay != 0 && !wheel_active(&worker->flush_timer))
+        wheel_schedule(&worker->timers, &worker->flush_timer, worker->now+delay);
+}
+
+// the client received the start of the relayed message, so its pieces have to follow
+static bool_t server_has_relay(const conn_t* conn, uint64_t relay) {
+    for(len_t i = 0; i < conn->num_relays; i++)
+        if(conn->relays[i] == relay)
+            return 1;
+    return 0;
+}
+
+static void server_add_relay(conn_t* conn, uint64_t relay) {
+    if(conn->num_relays == conn->relays_cap) {
+        conn->relays_cap = conn->relays_cap == 0 ? 4 : 2*conn->relays_cap;
+        conn->relays = (uint64_t*)realloc(conn->relays, sizeof(uint64_t)*conn->relays_cap);
+    }
+    conn->relays[conn->num_relays++] = relay;
+}
+
+static void server_remove_relay(conn_t* conn, uint64_t relay) {
+    for(len_t i = 0; i < conn->num_relays; i++)
+        if(conn->relays[i] == relay) {
+            conn->relays[i] = conn->relays[--conn->num_relays];
+            return;
+        }
+}
+
+// queue the frame for writing unless it has to wait for the relayed message that is written to the client,
+// only the pieces of that message may be written before its last one
+static void server_queue_frame(conn_t* conn, frame_t* frame, uint64_t time) {
+    if((conn->streaming == 0 && conn->held.count == 0) || ((frame->flags & FRAME_PART) && frame->relay == conn->streaming)) {
+        queue_push(&conn->out, frame, time);
+        if(frame->flags & FRAME_FIRST)
+            conn->streaming = frame->relay;
+        else if(frame->flags & FRAME_LAST) {
+            server_remove_relay(conn, frame->relay);
+            conn->streaming = 0;
+        }
+    } else
+        queue_push(&conn->held, frame, time);
+}
+
+// the relayed message that was written to the client is complete or gone, the frames held back follow
+// until the start of the next relayed message, whose pieces might already be held back as well
+static void server_release_held(conn_t* conn) {
+    while(conn->streaming == 0 && conn->held.count != 0) {
+        queue_t held = conn->held;
+        queue_init(&conn->held);
+        while(held.count != 0) {
+            uint64_t time;
+            frame_t* frame = queue_pop(&held, &time);
+            server_queue_frame(conn, frame, time);
+        }
+        queue_free(&held);
+    }
+}
+
+// the relayed message can not be completed, it is removed from the queues of the client, but if a part of it
+// was already written the client would take whatever follows for the rest of it, returns ERROR if it has to be closed
+static error_t server_cancel_relay(conn_t* conn, uint64_t relay) {
+    server_remove_relay(conn, relay);
+    queue_drop_relay(&conn->held, relay);
+    if(conn->streaming == relay) {
+        if(!queue_drop_relay(&conn->out, relay)) {
+            conn->close_reason = CLOSE_RELAY;
+            return ERROR;
+        }
+        conn->streaming = 0;
+        server_release_held(conn);
+    }
+    return OK;
+}
+
+// add a reference to the frame to the outbound queue of the client, it is written at the end of the loop iteration
+// and the rest once epoll reports the socket to be writable again, while the client receives a relayed message
+// everything but its pieces is held back
+static error_t server_send(worker_t* worker, conn_t* conn, frame_t* frame) {
+    if(conn->slow && (frame->flags & FRAME_EPHEMERAL) && worker->server->conf.slow_policy == SLOW_POLICY_DROP) {
+        atomic_fetch_add(&worker->server->slow_dropped, 1);
+        return OK;
+    }
+    // the frame holding the start of a relayed message is shorter than the message
+    if(!(frame->flags & (FRAME_PART | FRAME_CANCEL)) && (frame->flags & FRAME_FIRST ? server_read_len(frame->data) : frame->len-sizeof(id_t)-sizeof(len_t)) > conn->max_frame) {
+        metrics_add(&worker->metrics.frames_oversize, 1);
+        return OK;
+    }
+    bool_t was_empty = conn->out.count == 0;
+    if(frame->flags & FRAME_CANCEL) {
+        if(server_cancel_relay(conn, frame->relay) == ERROR)
+            return ERROR;
+    } else if(frame->flags & FRAME_EPHEMERAL) {
+        queue_t* queue = conn->streaming == 0 ? &conn->out : &conn->held;
+        metrics_add(&worker->metrics.frames_coalesced, queue_push_latest(queue, frame_ref(frame), worker->now));
+    } else {
+        if(frame->flags & FRAME_FIRST) {
+            server_add_relay(conn, frame->relay);
+            server_add_recipient(worker, conn, frame->relay);
+        }
+        server_queue_frame(conn, frame_ref(frame), worker->now);
+        if(conn->streaming == 0)
+            server_release_held(conn);
+    }
+    if(was_empty && conn->out.count != 0 && !conn->replaying && !conn->pending) /* otherwise we are already waiting for the socket to become writable */
+        server_write_later(worker, conn);
+    return server_check_queue(worker, conn);
+}
+
+// mark the client to be disconnected at the end of the current loop iteration
+static void server_close_later(worker_t* worker, conn_t* conn) {
+    if(!conn->closing) {
+        conn->closing = 1;
+        if(worker->num_dead == worker->dead_cap) {
+            worker->dead_cap = worker->dead_cap == 0 ? 16 : 2*worker->dead_cap;
+            worker->dead = (conn_t**)realloc(worker->dead, sizeof(conn_t*)*worker->dead_cap);
+        }
+        worker->dead[worker->num_dead++] = conn;
+    }
+}
+
+// write a single chunk of the history to every joining client, so that many clients joining at once
+// do not delay the live messages of everyone else
+static void server_replay_all(worker_t* worker) {
+    worker->replay_ready = 0;
+    len_t i = 0;
+    while(i < worker->num_replays) {
+        conn_t* conn = worker->replays[i];
+        if(!conn->closing && !conn->replay_blocked && server_replay(worker, conn) == ERROR)
+            server_close_later(worker, conn);
+        if(i < worker->num_replays && worker->replays[i] == conn) /* otherwise the client finished and was replaced */ {
+            if(!conn->closing && !conn->replay_blocked && !conn->hello_wait)
+                worker->replay_ready = 1;
+            i++;
+        }
+    }
+}
+
+// forward the frame to the client if it joined before the frame was sent,
+// the pieces of a relayed message only to the clients that received its start
+static void server_forward_to(worker_t* worker, conn_t* client, frame_t* frame) {
+    bool_t wanted = frame->flags & (FRAME_PART | FRAME_CANCEL) ? server_has_relay(client, frame->relay) : client->joined_seq < frame->seq;
+    if(!client->closing && wanted && server_send(worker, client, frame) == ERROR)
+        server_close_later(worker, client);
+}
+
+// forward the frame to the clients in the list
+static void server_forward_list(worker_t* worker, conn_t** clients, len_t num_clients, frame_t* frame) {
+    for(len_t i = 0; i < num_clients; i++)
+        server_forward_to(worker, clients[i], frame);
+}
+
+// forward the frame to the members of its group and to the clients that want every message,
+// frames tagged for the federation only go to the peers, the pieces of a relayed message go to everyone
+// that received its start, which includes the peers and clients that left the group in the meantime
+static void server_forward(worker_t* worker, frame_t* frame) {
+    if(frame->flags & (FRAME_PART | FRAME_CANCEL)) {
+        recipient_list_t* list = server_find_recipients(worker, frame->relay);
+        if(list != NULL) {
+            server_forward_list(worker, list->conns, list->count, frame);
+            if(frame->flags & (FRAME_LAST | FRAME_CANCEL))
+                server_end_recipients(worker, list);
+        }
+    } else if(frame->flags & FRAME_PEER) {
+        server_forward_list(worker, worker->peers.conns, worker->peers.count, frame);
+    } else if(frame->group == GROUP_ALL) {
+        for(len_t i = 0; i < worker->slots.used; i++) {
+            conn_t* conn = (conn_t*)worker->slots.slots[i].ptr;
+            if(conn != NULL && conn->kind == CONN_CLIENT && !conn->peer)
+                server_forward_to(worker, conn, frame);
+        }
+    } else {
+        if(frame->group < worker->num_members)
+            server_forward_list(worker, worker->members[frame->group].conns, worker->members[frame->group].count, frame);
+        server_forward_list(worker, worker->wildcard.conns, worker->wildcard.count, frame);
+    }
+}
+
+// add a reference to the frame to the inbox of the worker
+static void server_post(worker_t* worker, frame_t* frame) {
+    pthread_mutex_lock(&worker->inbox_lock);
+    if(worker->inbox_len == worker->inbox_cap) {
+        worker->inbox_cap = worker->inbox_cap == 0 ? 16 : 2*worker->inbox_cap;
+        worker->inbox = (frame_t**)realloc(worker->inbox, sizeof(frame_t*)*worker->inbox_cap);
+    }
+    worker->inbox[worker->inbox_len++] = frame_ref(frame);
+    bool_t was_empty = worker->inbox_len == 1;
+    pthread_mutex_unlock(&worker->inbox_lock);
+    if(was_empty) /* otherwise the worker has already been woken */ {
+        uint64_t one = 1;
+        write(worker->evfd, &one, sizeof(one));
+    }
+}
+
+// create a control message, the text includes its terminating zero
+static frame_t* server_ctrl_frame(const char* text, len_t len) {
+    frame_t* frame = frame_alloc(sizeof(id_t)+sizeof(len_t)+len, 0);
+    server_write_int(frame->data, CTRL_ID, sizeof(id_t));
+    server_write_int(frame->data+sizeof(id_t), len, sizeof(len_t));
+    memcpy(frame->data+sizeof(id_t)+sizeof(len_t), text, len);
+    frame_seal(frame);
+    return frame;
+}
+
+// send a control message like any other message, after the history if the client is still receiving it
+static void server_send_ctrl(worker_t* worker, conn_t* conn, const char* text, len_t len) {
+    frame_t* frame = server_ctrl_frame(text, len);
+    if(server_send(worker, conn, frame) == ERROR)
+        server_close_later(worker, conn);
+    server_unref(worker, frame);
+}
+
+// from now on the connection receives heartbeats, it is expected to answer them
+static void server_start_heartbeat(worker_t* worker, conn_t* conn) {
+    if(!conn->heartbeat) {
+        conn->heartbeat = 1;
+        conn->keepalive.data = (uintptr_t)conn | TIMER_KEEPALIVE;
+        server_keepalive(worker, conn);
+    }
+}
+
+// only servers we were told about with --peer that know the peer secret may turn their connection into a link,
+// otherwise any client could inject messages with the origin of another server
+static bool_t server_is_peer(const server_t* server, int sock, const char* secret, len_t secret_len) {
+    const char* own = server->conf.peer_secret;
+    if(own == NULL || strlen(own) != secret_len)
+        return 0;
+    // every byte is compared, so the time taken does not tell how much of the secret was right
+    uint8_t diff = 0;
+    for(len_t i = 0; i < secret_len; i++)
+        diff |= own[i]^secret[i];
+    if(diff != 0)
+        return 0;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getpeername(sock, (struct sockaddr*)&addr, &addr_len) == -1 || addr.sin_family != AF_INET)
+        return 0;
+    for(len_t i = 0; i < server->num_links; i++)
+        if(server->links[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr)
+            return 1;
+    return 0;
+}
+
+// turn the connection into a link to another server, it only receives the messages of our own clients
+// and those passed on from other peers, the history is not sent to it, the servers send each other heartbeats
+static void server_make_peer(worker_t* worker, conn_t* conn) {
+    conn->peer = 1;
+    conn->max_frame = (len_t)~0;
+    conn->replay_seq = conn->joined_seq+1;
+    server_list_add(&worker->peers, conn);
+    server_start_heartbeat(worker, conn);
+}
+
+// from now on the client receives the sequence number of every message, a client that was connected before
+// only receives the messages it missed, or the whole history if some of them were evicted or the server restarted
+// the WELCOME message tells the client where the resumed stream starts, a resuming client ignores everything before it
+static void server_handle_resume(worker_t* worker, conn_t* conn, uint64_t epoch, uint64_t seq) {
+    server_t* server = worker->server;
+    if(conn->out.stamped) /* only the first request counts */
+        return;
+    uint64_t from = 0;
+    pthread_mutex_lock(&server->history_lock);
+    // only messages of the histories the client receives matter
+    uint64_t evicted = 0;
+    history_t* hist;
+    for(len_t i = 0; (hist = server_client_partition(server, conn, i)) != NULL; i++)
+        if(hist->evicted > evicted)
+            evicted = hist->evicted;
+    if(epoch == server->origin && seq <= server->seq && seq >= evicted)
+        from = seq+1;
+    uint64_t now_seq = server->seq;
+    if(epoch != 0 && !conn->replaying)
+        conn->joined_seq = now_seq;
+    pthread_mutex_unlock(&server->history_lock);
+    queue_t* queue = &conn->replay;
+    if(epoch == 0) /* a new client, everything it received until now stays valid */ {
+        from = 0;
+        if(!conn->replaying)
+            queue = &conn->out;
+    } else {
+        if(!conn->replaying) /* what is still queued is written first, it is part of the history that is sent again */ {
+            queue_t tmp = conn->replay;
+            conn->replay = conn->out;
+            conn->out = tmp;
+            if(conn->sending == &conn->out)
+                conn->sending = &conn->replay;
+            conn->replay_blocked = 0;
+            server_start_replay(worker, conn);
+        }
+        conn->replay_seq = from;
+    }
+    if(conn->replaying) /* nothing of the outbound queue was written yet */
+        queue_stamp_all(&conn->out);
+    else
+        conn->out.stamped = 1;
+    char welcome[START_BUFFER_LEN];
+    len_t len = snprintf(welcome, START_BUFFER_LEN, "WELCOME\nepoch=%lu\nresume=%lu\n", server->origin, from == 0 ? 0 : from-1)+1;
+    queue_push(queue, server_ctrl_frame(welcome, len), worker->now);
+    if(queue == &conn->out && !conn->pending)
+        server_write_later(worker, conn);
+}
+
+// from now on the client receives envelopes, the control message telling it so is the last one it receives without
+// and it is queued like WELCOME, the client answers with the same message once it sends envelopes as well
+static void server_start_envelope(worker_t* worker, conn_t* conn) {
+    if(conn->out.enveloped) /* only the first request counts */
+        return;
+    static const char proto[] = "PROTO\nversion=2\n";
+    queue_t* queue = conn->replaying ? &conn->replay : &conn->out;
+    queue_push(queue, server_ctrl_frame(proto, sizeof(proto)), worker->now);
+    conn->replay.enveloped = 1;
+    if(conn->replaying) /* nothing of the outbound queue was written yet */
+        queue_envelope_all(&conn->out);
+    else
+        conn->out.enveloped = 1;
+    if(queue == &conn->out && !conn->pending)
+        server_write_later(worker, conn);
+}
+
+// the client declared its group, sent something else first or did not do so in time, the history can be sent now
+static void server_end_hello_wait(worker_t* worker, conn_t* conn) {
+    if(conn->hello_wait) {
+        conn->hello_wait = 0;
+        wheel_cancel(&worker->timers, &conn->hello_timer);
+        if(conn->replaying && !conn->replay_blocked)
+            worker->replay_ready = 1;
+    }
+}
+
+// handle a control message of the client, it is not forwarded to anyone
+// the message is "HELLO\n" followed by "key=value\n" lines and terminated by a zero,
+// the heartbeat "PING\n" that is answered with "PONG\n", or "PROTO\n" once the client sends envelopes
+static void server_handle_ctrl(worker_t* worker, conn_t* conn, const char* data, len_t len) {
+    server_t* server = worker->server;
+    len_t line_len = 0;
+    while(line_len < len && data[line_len] != '\n' && data[line_len] != 0)
+        line_len++;
+    if(line_len == 4 && strncmp(data, "PING", 4) == 0) {
+        static const char pong[] = "PONG\n";
+        server_send_ctrl(worker, conn, pong, sizeof(pong));
+        return;
+    }
+    if(line_len == 5 && strncmp(data, "PROTO", 5) == 0) {
+        if(conn->out.enveloped) /* the client may only switch after the server did */
+            conn->envelope_in = 1;
+        return;
+    }
+    if(line_len != 5 || strncmp(data, "HELLO", 5) != 0)
+        return;
+    server_end_hello_wait(worker, conn);
+    len_t pos = line_len+1;
+    while(pos < len && data[pos] != 0) {
+        const char* line = data+pos;
+        line_len = 0;
+        while(pos+line_len < len && line[line_len] != '\n' && line[line_len] != 0)
+            line_len++;
+        pos += line_len+1;
+        if(line_len > 6 && strncmp(line, "group=", 6) == 0) /* the client only wants messages of this group */ {
+            uint32_t group = server_find_group(server, line+6, line_len-6);
+            if(group == GROUP_NONE) {
+                conn->close_reason = CLOSE_GROUPS;
+                server_close_later(worker, conn);
+                return;
+            }
+            server_leave_group(worker, conn);
+            server_join_group(worker, conn, group);
+        } else if(line_len > 10 && strncmp(line, "max_frame=", 10) == 0) /* the client does not accept larger messages */ {
+            len_t max_frame = 0;
+            for(len_t i = 10; i < line_len && line[i] >= '0' && line[i] <= '9' && max_frame <= server->conf.max_frame; i++)
+                max_frame = 10*max_frame+(line[i]-'0');
+            if(max_frame != 0 && max_frame < conn->max_frame)
+                conn->max_frame = max_frame;
+        } else if(line_len > 7 && strncmp(line, "resume=", 7) == 0 && !conn->peer) /* "resume=<epoch>:<seq>" of the last message the client received */ {
+            uint64_t epoch = 0;
+            uint64_t seq = 0;
+            len_t i = 7;
+            for(; i < line_len && line[i] >= '0' && line[i] <= '9'; i++)
+                epoch = 10*epoch+(line[i]-'0');
+            for(i++; i < line_len && line[i] >= '0' && line[i] <= '9'; i++)
+                seq = 10*seq+(line[i]-'0');
+            server_handle_resume(worker, conn, epoch, seq);
+        } else if(line_len == 7 && strncmp(line, "proto=2", 7) == 0 && !conn->peer) /* the client understands envelopes */ {
+            server_start_envelope(worker, conn);
+        } else if(line_len == 11 && strncmp(line, "heartbeat=1", 11) == 0) /* the client answers heartbeats */ {
+            server_start_heartbeat(worker, conn);
+        } else if(line_len > 5 && strncmp(line, "peer=", 5) == 0 && !conn->peer && server_is_peer(server, conn->fd, line+5, line_len-5)) /* another server of the federation, "peer=<secret>" */ {
+            server_leave_group(worker, conn);
+            atomic_fetch_sub(&server->num_clients, 1);
+            server_make_peer(worker, conn);
+        }
+    }
+}
+
+// typing info is never stored and can be dropped for slow clients, clients mark it with EPHEMERAL_ID
+// older clients do not, then the server can only see it if the message is not encrypted
+static bool_t server_is_ephemeral(const char* msg, len_t len, id_t msg_id) {
+    if(msg_id == EPHEMERAL_ID)
+        return 1;
+    const char* data = msg+sizeof(id_t)+sizeof(len_t);
+    len_t data_len = len-sizeof(id_t)-sizeof(len_t);
+    if(data_len == 0 || data[0] == '~')
+        return 0;
+    len_t head_len = 0;
+    while(head_len < data_len && data[head_len] != 0)
+        head_len++;
+    return head_len < data_len && head_len >= 4 && strncmp(data+head_len-4, "|TYP", 4) == 0;
+}
+
+// forward the frame to our clients and post it to the other workers, they forward it to their own clients
+// all of them share the same frame, it is freed after the last client has written it
+static void server_broadcast(worker_t* worker, frame_t* frame) {
+    server_t* server = worker->server;
+    server_forward(worker, frame);
+    for(len_t i = 0; i < server->num_workers; i++)
+        if(i != worker->index)
+            server_post(&server->workers[i], frame);
+    server_unref(worker, frame);
+}
+
+// wrap a message of one of our clients for the peers, the tag holds our origin, the peer sequence number,
+// the flags and the name of the group, the group id is only valid on this server
+// msg_len is the length of the whole message, only the first len bytes of a relayed message are known
+static frame_t* server_tag(server_t* server, const char* msg, len_t len, len_t msg_len, uint32_t group, uint8_t flags, uint64_t seq, uint64_t peer_seq) {
+    pthread_mutex_lock(&server->group_lock);
+    const char* name = group == GROUP_ALL ? "" : server->groups.groups[group]->name;
+    len_t name_len = strlen(name);
+    if(name_len > MAX_GROUP_NAME)
+        name_len = MAX_GROUP_NAME;
+    len_t body_len = PEER_HEAD_LEN+name_len+msg_len;
+    frame_t* frame = frame_alloc(sizeof(id_t)+sizeof(len_t)+PEER_HEAD_LEN+name_len+len, seq);
+    char* data = frame->data;
+    server_write_int(data, PEER_ID, sizeof(id_t));
+    server_write_int(data+sizeof(id_t), body_len, sizeof(len_t));
+    data += sizeof(id_t)+sizeof(len_t);
+    server_write_int(data, server->origin, sizeof(uint64_t));
+    server_write_int(data+8, peer_seq, sizeof(uint64_t));
+    data[16] = flags;
+    server_write_int(data+17, name_len, 2);
+    memcpy(data+PEER_HEAD_LEN, name, name_len);
+    pthread_mutex_unlock(&server->group_lock);
+    memcpy(data+PEER_HEAD_LEN+name_len, msg, len);
+    frame->flags = FRAME_PEER;
+    return frame;
+}
+
+// save the message of the sender id in the history and forward it to every client of the group, messages
+// of our own clients (local) are also sent to the peers, the body is the same for both versions of the protocol
+// returns the sequence number the message got
+static uint64_t server_publish(worker_t* worker, id_t id, const char* body, len_t body_len, uint32_t group, bool_t ephemeral, bool_t local, uint64_t time) {
+    server_t* server = worker->server;
+    bool_t federated = local && server->conf.num_peers != 0;
+    frame_t* frame = frame_alloc(sizeof(id_t)+sizeof(len_t)+body_len, 0);
+    server_write_int(frame->data, id, sizeof(id_t));
+    server_write_int(frame->data+sizeof(id_t), body_len, sizeof(len_t));
+    memcpy(frame->data+sizeof(id_t)+sizeof(len_t), body, body_len);
+    const char* msg = frame->data;
+    len_t len = frame->len;
+    pthread_mutex_lock(&server->history_lock);
+    uint64_t seq = ++server->seq;
+    uint64_t peer_seq = federated ? ++server->peer_seq : 0;
+    // add data to the history of the group, its old messages are removed if needed
+    if(MAX_HISTORY_SAVE >= len && !ephemeral) {
+        atomic_fetch_add(&server->num_messg, 1);
+        server_history_add(server, group, msg, len, seq);
+        if(server->use_store) {
+            pthread_mutex_lock(&server->group_lock);
+            const char* name = group == GROUP_ALL ? "" : server->groups.groups[group]->name;
+            len_t name_len = strlen(name);
+            store_append(&server->store, msg, len, seq, name, name_len > MAX_GROUP_NAME ? MAX_GROUP_NAME : name_len);
+            pthread_mutex_unlock(&server->group_lock);
+            if(store_checkpoint_due(&server->store))
+                pthread_cond_signal(&server->store_cond);
+        }
+    }
+    pthread_mutex_unlock(&server->history_lock);
+    frame->seq = seq;
+    frame_stamp(frame->stamp, seq);
+    frame->group = group;
+    frame->time = time;
+    if(ephemeral)
+        frame->flags |= FRAME_EPHEMERAL;
+    frame_seal(frame);
+    // the tag copies the message, so it is created before the frame might be freed
+    if(federated) /* the peers may be connected to any worker */
+        server_broadcast(worker, server_tag(server, msg, len, len, group, ephemeral ? FRAME_EPHEMERAL : 0, seq, peer_seq));
+    server_broadcast(worker, frame);
+    return seq;
+}
+
+// a peer forwarded a message of one of its clients, it is handled like a message of our own clients
+// unless it already arrived over another link, it is passed on to the other peers so the servers
+// do not have to be linked with every other one
+static void server_handle_peer(worker_t* worker, const char* data, len_t len, uint64_t time) {
+    server_t* server = worker->server;
+    if(len < PEER_HEAD_LEN)
+        return;
+    uint64_t origin = server_read_int(data, sizeof(uint64_t));
+    uint64_t peer_seq = server_read_int(data+8, sizeof(uint64_t));
+    uint8_t flags = data[16];
+    len_t name_len = server_read_int(data+17, 2);
+    if(len < PEER_HEAD_LEN+name_len+sizeof(id_t)+sizeof(len_t) || origin == server->origin)
+        return;
+    const char* msg = data+PEER_HEAD_LEN+name_len;
+    len_t msg_len = len-PEER_HEAD_LEN-name_len;
+    len_t body_len = msg_len-sizeof(id_t)-sizeof(len_t);
+    if(server_read_len(msg) != body_len)
+        return;
+    if(!dedup_check(&server->seen, origin, peer_seq)) {
+        metrics_add(&worker->metrics.frames_duplicate, 1);
+        return;
+    }
+    uint32_t group = GROUP_ALL;
+    if(name_len != 0)
+        group = server_find_group(server, data+PEER_HEAD_LEN, name_len);
+    if(group == GROUP_NONE) /* we already have as many groups as allowed */
+        return;
+    id_t id = server_read_int(msg, sizeof(id_t));
+    uint64_t seq = server_publish(worker, id, msg+sizeof(id_t)+sizeof(len_t), body_len, group, flags & FRAME_EPHEMERAL, 0, time);
+    // the tag is kept as it is, the dedup check of every server stops it from going around in circles
+    frame_t* tag = frame_alloc(sizeof(id_t)+sizeof(len_t)+len, seq);
+    server_write_int(tag->data, PEER_ID, sizeof(id_t));
+    server_write_int(tag->data+sizeof(id_t), len, sizeof(len_t));
+    memcpy(tag->data+sizeof(id_t)+sizeof(len_t), data, len);
+    tag->flags = FRAME_PEER;
+    server_broadcast(worker, tag);
+}
+
+// a complete message was received from the client, forward it to everyone and save it in the history
+static void server_handle_msg(worker_t* worker, conn_t* conn, const char* msg, len_t len) {
+    metrics_add(&worker->metrics.frames_in, 1);
+    server_end_hello_wait(worker, conn); // a client that starts with anything else does not send a HELLO
+    id_t msg_id = 0;
+    for(uint32_t j = 0; j < sizeof(id_t); j++)
+        msg_id |= (id_t)(uint8_t)msg[j] << (8*j);
+    if(msg_id == CTRL_ID) {
+        server_handle_ctrl(worker, conn, msg+sizeof(id_t)+sizeof(len_t), len-sizeof(id_t)-sizeof(len_t));
+        return;
+    }
+    if(conn->peer) /* before it knows about the link the peer sends its history like to any client, only tagged messages count */ {
+        if(msg_id == PEER_ID && worker->index == 0)
+            server_handle_peer(worker, msg+sizeof(id_t)+sizeof(len_t), len-sizeof(id_t)-sizeof(len_t), worker->recv_ns);
+        else if(msg_id == PEER_ID) {
+            frame_t* frame = frame_create(msg, len, 0);
+            frame->flags = FRAME_FROM_PEER;
+            frame->time = worker->recv_ns;
+            server_post(&worker->server->workers[0], frame);
+            frame_unref(frame);
+        }
+        return;
+    }
+    bool_t ephemeral = server_is_ephemeral(msg, len, msg_id);
+    // the message is sent with the id of the client
+    server_publish(worker, conn->id, msg+sizeof(id_t)+sizeof(len_t), len-sizeof(id_t)-sizeof(len_t), conn->group, ephemeral, 1, worker->recv_ns);
+}
+
+// a complete envelope was received from a client using version 2 of the protocol, the flags tell
+// whether the message is ephemeral, so unlike server_handle_msg nothing has to be read from the payload
+static void server_handle_envelope(worker_t* worker, conn_t* conn, const char* data, len_t len) {
+    metrics_add(&worker->metrics.frames_in, 1);
+    envelope_t env;
+    if(envelope_parse(data, len, &env) == ERROR)
+        return;
+    if(env.type == ENVELOPE_CTRL)
+        server_handle_ctrl(worker, conn, env.payload, env.payload_len);
+    else if(env.type == ENVELOPE_MSG)
+        server_publish(worker, conn->id, env.payload, env.payload_len, conn->group, (env.flags & ENVELOPE_EPHEMERAL) != 0, 1, worker->recv_ns);
+}
+
+// forward all frames that other workers posted to our inbox
+static void server_drain_inbox(worker_t* worker) {
+    uint64_t count;
+    read(worker->evfd, &count, sizeof(count));
+    // swap the buffers so the lock is only held for a moment
+    pthread_mutex_lock(&worker->inbox_lock);
+    frame_t** frames = worker->inbox;
+    len_t num_frames = worker->inbox_len;
+    len_t frames_cap = worker->inbox_cap;
+    worker->inbox = worker->drain;
+    worker->inbox_cap = worker->drain_cap;
+    worker->inbox_len = 0;
+    worker->drain = frames;
+    worker->drain_cap = frames_cap;
+    pthread_mutex_unlock(&worker->inbox_lock);
+    for(len_t i = 0; i < num_frames; i++) {
+        if(frames[i]->flags & FRAME_FROM_PEER)
+            server_handle_peer(worker, frames[i]->data+sizeof(id_t)+sizeof(len_t), frames[i]->len-sizeof(id_t)-sizeof(len_t), frames[i]->time);
+        else
+            server_forward(worker, frames[i]);
+        server_unref(worker, frames[i]);
+    }
+}
+
+// add the new client and queue its id and the history, the history is written by server_replay_all
+static void server_add_client(worker_t* worker, int sock) {
+    server_t* server = worker->server;
+    conn_t* client = (conn_t*)calloc(1, sizeof(conn_t));
+    client->kind = CONN_CLIENT;
+    client->fd = sock;
+    client->id = atomic_fetch_add(&server->cid, 1);
+    client->join_ns = metrics_time_ns();
+    client->max_frame = server->conf.max_frame;
+    bucket_init(&client->rate_frames, server->conf.rate_frames, worker->now);
+    bucket_init(&client->rate_bytes, server->conf.rate_bytes, worker->now);
+    bucket_init(&client->rate_large, server->conf.rate_large, worker->now);
+    client->throttle_timer.data = (uintptr_t)client | TIMER_THROTTLE;
+    client->last_recv = worker->now;
+    // frames are already gathered into as few writes as possible, waiting for more data only adds latency
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if(server_watch(worker, client, EPOLLIN | EPOLLOUT | EPOLLET) == ERROR) {
+        close(sock);
+        free(client);
+        return;
+    }
+    server_join_group(worker, client, GROUP_ALL);
+    // with epoll the history waits for the first EPOLLOUT event, and with both it waits a moment for the HELLO
+    // of the client, so a client that declares a group only receives the history of its group
+    client->replay_blocked = worker->ring == NULL;
+    client->hello_wait = 1;
+    client->hello_timer.data = (uintptr_t)client | TIMER_HELLO;
+    wheel_schedule(&worker->timers, &client->hello_timer, worker->now+HELLO_WAIT);
+    atomic_fetch_add(&server->num_clients, 1);
+    metrics_add(&worker->metrics.accepts, 1);
+    // the id is sent first, followed by every message of the history up to now
+    char id[sizeof(id_t)];
+    for(uint32_t i = 0; i < sizeof(id_t); i++)
+        id[i] = (client->id >> (8*i)) & 0xff;
+    queue_push(&client->replay, frame_create(id, sizeof(id_t), 0), worker->now);
+    pthread_mutex_lock(&server->history_lock);
+    client->joined_seq = server->seq;
+    pthread_mutex_unlock(&server->history_lock);
+    server_start_replay(worker, client);
+}
+
+// accept all new clients
+static void server_accept(worker_t* worker) {
+    int new_client;
+    while((new_client = accept4(worker->sock, NULL, NULL, SOCK_NONBLOCK)) != -1)
+        server_add_client(worker, new_client);
+}
+
+// start connecting to the peer, server_connected completes the connection
+// if anything fails the dial timer tries again after a moment
+static void server_dial(worker_t* worker, peer_link_t* link) {
+    link->next_dial = worker->now+SERVER_CLOCK;
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(sock != -1 && (connect(sock, (struct sockaddr*)&link->addr, sizeof(link->addr)) == 0 || errno == EINPROGRESS)) {
+        // epoll reports the socket as writable once the connection is established or failed
+        conn_t* conn = (conn_t*)calloc(1, sizeof(conn_t));
+        conn->kind = CONN_CONNECTING;
+        conn->fd = sock;
+        conn->link = link;
+        if(server_watch(worker, conn, EPOLLOUT | EPOLLET) == OK) {
+            link->conn = conn;
+            return;
+        }
+        free(conn);
+    }
+    if(sock != -1)
+        close(sock);
+    wheel_schedule(&worker->timers, &link->dial_timer, link->next_dial);
+}
+
+// the connection to a peer was established or failed, the peer is told about the link with a control message
+static void server_connected(worker_t* worker, conn_t* conn) {
+    server_t* server = worker->server;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+        error = errno;
+    // it is registered again as a client, with io_uring it is no longer handled by epoll
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    slot_remove(&worker->slots, conn->handle);
+    conn->kind = CONN_CLIENT;
+    conn->max_frame = server->conf.max_frame;
+    conn->skip = sizeof(id_t); // the peer sends us an id like to any client
+    int enable = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if(error != 0 || server_watch(worker, conn, EPOLLIN | EPOLLOUT | EPOLLET) == ERROR) {
+        conn->link->conn = NULL;
+        wheel_schedule(&worker->timers, &conn->link->dial_timer, conn->link->next_dial);
+        close(conn->fd);
+        free(conn);
+        return;
+    }
+    pthread_mutex_lock(&server->history_lock);
+    conn->joined_seq = server->seq;
+    pthread_mutex_unlock(&server->history_lock);
+    conn->last_recv = worker->now;
+    conn->throttle_timer.data = (uintptr_t)conn | TIMER_THROTTLE;
+    server_make_peer(worker, conn);
+    // the secret proves to the other server that this is one of its peers
+    len_t secret_len = strlen(server->conf.peer_secret);
+    len_t hello_len = 11+secret_len+2;
+    char* hello = (char*)malloc(hello_len);
+    memcpy(hello, "HELLO\npeer=", 11);
+    memcpy(hello+11, server->conf.peer_secret, secret_len);
+    memcpy(hello+11+secret_len, "\n", 2);
+    queue_push(&conn->out, server_ctrl_frame(hello, hello_len), worker->now);
+    free(hello);
+    server_write_later(worker, conn);
+}
+
+// make room for need bytes in the inbound buffer
+static void server_reserve(conn_t* conn, len_t need) {
+    if(need > conn->in_cap) {
+        while(need > conn->in_cap)
+            conn->in_cap = conn->in_cap == 0 ? START_BUFFER_LEN : 2*conn->in_cap;
+        conn->in = (char*)realloc(conn->in, conn->in_cap);
+    }
+}
+
+// hand a piece of the relayed message to every worker, it goes through the inbox even for our own clients,
+// so every worker sees all pieces of one message before the first piece of the next one
+static void server_post_piece(worker_t* worker, frame_t* frame) {
+    server_t* server = worker->server;
+    for(len_t i = 0; i < server->num_workers; i++)
+        server_post(&server->workers[i], frame);
+    server_unref(worker, frame);
+}
+
+// relay the next len bytes of the message the client is sending
+static void server_relay(worker_t* worker, conn_t* conn, const char* data, len_t len) {
+    conn->relay_left -= len;
+    if(conn->relay_drop) {
+        conn->relay_drop = conn->relay_left != 0;
+        return;
+    }
+    frame_t* frame = frame_create(data, len, 0);
+    frame->group = conn->group;
+    frame->relay = conn->relay_seq;
+    frame->flags = FRAME_PART | (conn->relay_left == 0 ? FRAME_LAST : 0);
+    server_post_piece(worker, frame);
+}
+
+// the client is gone or too slow in the middle of a relayed message, the recipients drop what they did not
+// yet write of it, those that already received a part of it are disconnected, they could not tell where it ends
+static void server_abort_relay(worker_t* worker, conn_t* conn) {
+    if(server_is_relaying(conn)) {
+        frame_t* frame = frame_alloc(0, 0);
+        frame->relay = conn->relay_seq;
+        frame->flags = FRAME_CANCEL;
+        server_post_piece(worker, frame);
+        metrics_add(&worker->metrics.frames_cancelled, 1);
+    }
+    conn->relay_left = 0;
+}
+
+// start relaying the large message of the client whose first len bytes were received, the header and those bytes
+// are sent right away and the rest as it arrives, so the server never holds the whole message, the peers receive it
+// the same way, only with the tag in front, messages of peers and control or ephemeral messages are always received
+// completely, returns 0 if the message has to be received completely
+static bool_t server_start_relay(worker_t* worker, conn_t* conn, const char* msg, len_t len, len_t len_msg) {
+    server_t* server = worker->server;
+    if(conn->peer)
+        return 0;
+    len_t head_len = sizeof(id_t)+sizeof(len_t);
+    len_t body_len = len_msg-head_len;
+    if(conn->envelope_in) {
+        envelope_t env;
+        if(envelope_parse_head(msg, len, &env) == ERROR || env.type != ENVELOPE_MSG || (env.flags & ENVELOPE_EPHEMERAL))
+            return 0;
+        head_len = env.payload-msg;
+        body_len = env.payload_len;
+    } else {
+        id_t msg_id = server_read_int(msg, sizeof(id_t));
+        if(msg_id == CTRL_ID || msg_id == PEER_ID || msg_id == EPHEMERAL_ID)
+            return 0;
+    }
+    conn->relay_left = len_msg-len;
+    if(!server_admit(worker, conn, len_msg)) {
+        if(conn->throttled) /* the message is handled once the client may continue */ {
+            conn->relay_left = 0;
+            return 0;
+        }
+        metrics_add(&worker->metrics.frames_rejected, 1);
+        conn->relay_drop = 1;
+        return 1;
+    }
+    metrics_add(&worker->metrics.frames_in, 1);
+    metrics_add(&worker->metrics.frames_relayed, 1);
+    bool_t federated = server->conf.num_peers != 0;
+    pthread_mutex_lock(&server->history_lock);
+    uint64_t seq = ++server->seq;
+    uint64_t peer_seq = federated ? ++server->peer_seq : 0;
+    pthread_mutex_unlock(&server->history_lock);
+    conn->relay_seq = seq;
+    conn->relay_len = len_msg;
+    conn->relay_start = worker->now;
+    conn->keepalive.data = (uintptr_t)conn | TIMER_KEEPALIVE;
+    server_keepalive(worker, conn);
+    // the start is sent like any other message, only that it is shorter than its header says
+    frame_t* frame = frame_alloc(sizeof(id_t)+sizeof(len_t)+len-head_len, seq);
+    server_write_int(frame->data, conn->id, sizeof(id_t));
+    server_write_int(frame->data+sizeof(id_t), body_len, sizeof(len_t));
+    memcpy(frame->data+sizeof(id_t)+sizeof(len_t), msg+head_len, len-head_len);
+    frame->group = conn->group;
+    frame->time = worker->recv_ns;
+    frame->relay = seq;
+    frame->flags = FRAME_FIRST;
+    frame_seal(frame);
+    if(federated) {
+        frame_t* tag = server_tag(server, frame->data, frame->len, sizeof(id_t)+sizeof(len_t)+body_len, conn->group, 0, seq, peer_seq);
+        tag->relay = seq;
+        tag->flags |= FRAME_FIRST;
+        server_post_piece(worker, tag);
+    }
+    server_post_piece(worker, frame);
+    return 1;
+}
+
+// length of the message at the start of data including its header, zero if the header is not yet complete
+// the format of the client can change after every message, so it is checked again for each of them
+static len_t server_msg_len(const conn_t* conn, const char* data, len_t len) {
+    if(conn->envelope_in)
+        return envelope_size(data, len);
+    if(len < sizeof(id_t)+sizeof(len_t))
+        return 0;
+    len_t len_body = server_read_len(data);
+    return len_body > ~(len_t)0-sizeof(id_t)-sizeof(len_t) ? ~(len_t)0 : sizeof(id_t)+sizeof(len_t)+len_body;
+}
+
+// handle every message in the inbound buffer that is complete, only the incomplete message is kept
+// the length is checked as soon as the header is complete, so a larger message is never buffered
+// returns ERROR if the client announced a message that is too large and is disconnected
+static error_t server_parse(worker_t* worker, conn_t* conn) {
+    len_t pos = 0;
+    if(conn->skip != 0) {
+        pos = conn->skip < conn->in_len ? conn->skip : conn->in_len;
+        conn->skip -= pos;
+    }
+    // the messages of a peer also hold the tag
+    len_t max_body = worker->server->conf.max_frame+(conn->peer ? PEER_HEAD_LEN+MAX_GROUP_NAME+sizeof(id_t)+sizeof(len_t) : 0);
+    len_t len_msg;
+    while(conn->relay_left != 0 || (!conn->throttled && (len_msg = server_msg_len(conn, conn->in+pos, conn->in_len-pos)) != 0)) {
+        if(conn->relay_left != 0) /* the next piece of the relayed message, unless it is too small yet */ {
+            len_t len_piece = conn->in_len-pos < conn->relay_left ? conn->in_len-pos : conn->relay_left;
+            if(len_piece < RELAY_PIECE && len_piece < conn->relay_left)
+                break;
+            server_relay(worker, conn, conn->in+pos, len_piece);
+            pos += len_piece;
+            continue;
+        }
+        const char* msg = conn->in+pos;
+        if(len_msg > max_body+(conn->envelope_in ? ENVELOPE_MAX_HEAD : sizeof(id_t)+sizeof(len_t))) {
+            conn->close_reason = CLOSE_OVERSIZE;
+            server_close_later(worker, conn);
+            return ERROR;
+        }
+        if(conn->in_len-pos < len_msg && len_msg > RELAY_MIN && server_start_relay(worker, conn, msg, conn->in_len-pos, len_msg)) {
+            pos = conn->in_len;
+            conn->head_ns = 0;
+            continue;
+        }
+        if(conn->in_len-pos < len_msg)
+            break;
+        if(!server_admit(worker, conn, len_msg)) {
+            if(conn->throttled) /* the message is handled once the client may continue */
+                break;
+            metrics_add(&worker->metrics.frames_rejected, 1);
+            pos += len_msg;
+            conn->head_ns = 0;
+            continue;
+        }
+        pos += len_msg;
+        // a message that arrived with a single receive is counted as zero
+        metrics_record(&worker->latency[LATENCY_BODY], conn->head_ns == 0 ? 0 : worker->recv_ns-conn->head_ns);
+        conn->head_ns = 0;
+        if(conn->envelope_in)
+            server_handle_envelope(worker, conn, msg, len_msg);
+        else
+            server_handle_msg(worker, conn, msg, len_msg);
+    }
+    if(conn->head_ns == 0 && conn->relay_left == 0 && server_msg_len(conn, conn->in+pos, conn->in_len-pos) != 0)
+        conn->head_ns = worker->recv_ns;
+    if(pos != 0) {
+        conn->in_len -= pos;
+        memmove(conn->in, conn->in+pos, conn->in_len);
+        if(conn->in_cap > MAX_IDLE_BUFFER_LEN && conn->in_len <= START_BUFFER_LEN) /* the big message is done */ {
+            conn->in_cap = START_BUFFER_LEN;
+            conn->in = (char*)realloc(conn->in, conn->in_cap);
+        }
+    }
+    return OK;
+}
+
+// read everything the client sent, partial messages stay in the inbound buffer until the rest arrives
+static void server_recv(worker_t* worker, conn_t* conn) {
+    bool_t closed = 0;
+    while(!closed && !conn->throttled) {
+        len_t need = conn->in_len+START_BUFFER_LEN;
+        // make room for the whole message, server_parse already rejected it if it is too large,
+        // a message that might be relayed only needs room for the next piece
+        len_t len_msg = conn->relay_left != 0 ? RELAY_PIECE : server_msg_len(conn, conn->in, conn->in_len);
+        if(len_msg > need && len_msg <= RELAY_MIN)
+            need = len_msg;
+        server_reserve(conn, need);
+        int len = recv(conn->fd, conn->in+conn->in_len, conn->in_cap-conn->in_len, MSG_DONTWAIT);
+        if(len >= 1) {
+            worker->recv_ns = metrics_time_ns();
+            metrics_add(&worker->metrics.bytes_in, len);
+            conn->last_recv = worker->now;
+            conn->in_len += len;
+            if(server_parse(worker, conn) == ERROR)
+                return;
+        } else if(len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn->close_reason = len == 0 ? CLOSE_PEER : CLOSE_ERROR;
+            closed = 1;
+        }
+        else /* EAGAIN || EWOULDBLOCK, nothing left to read */
+            break;
+    }
+    if(closed) // disconnect client
+        server_close_later(worker, conn);
+}
+
+// data was received into one of the provided buffers of io_uring
+static void server_recv_done(worker_t* worker, conn_t* conn, const uring_event_t* event) {
+    if(event->buffer >= 0) {
+        if(event->res > 0 && !conn->closing) {
+            worker->recv_ns = metrics_time_ns();
+            metrics_add(&worker->metrics.bytes_in, event->res);
+            conn->last_recv = worker->now;
+            server_reserve(conn, conn->in_len+event->res);
+            memcpy(conn->in+conn->in_len, uring_buffer(worker->ring, event->buffer), event->res);
+            conn->in_len += event->res;
+            if(!worker->quiescing) /* otherwise the successor handles the messages */
+                server_parse(worker, conn);
+        }
+        uring_release(worker->ring, event->buffer);
+    }
+    if(!event->more)
+        conn->receiving = 0;
+    if(event->res == 0 || (event->res < 0 && event->res != -ENOBUFS && event->res != -ECANCELED)) {
+        if(event->res == 0)
+            conn->close_reason = CLOSE_PEER;
+        server_close_later(worker, conn);
+    }
+    else if(!event->more && !conn->closing && !conn->throttled && !worker->quiescing) /* all buffers were in use, or the client was throttled for a moment */
+        server_start_recv(worker, conn);
+}
+
+// write the outbound queues that received frames in this loop iteration
+static void server_write_pending(worker_t* worker) {
+    for(len_t i = 0; i < worker->num_pending; i++) {
+        conn_t* conn = worker->pending[i];
+        conn->pending = 0;
+        if(!conn->closing && !conn->replaying && server_write(worker, conn, &conn->out) == ERROR)
+            server_close_later(worker, conn);
+    }
+    worker->num_pending = 0;
+}
+
+// continue with the messages of the client, its buckets allow it again
+static void server_resume(worker_t* worker, conn_t* conn) {
+    conn->throttled = 0;
+    if(!conn->closing && server_parse(worker, conn) == OK && !conn->throttled) /* read what arrived in the meantime */ {
+        if(worker->ring == NULL)
+            server_recv(worker, conn);
+        else if(!conn->receiving)
+            server_start_recv(worker, conn);
+    }
+}
+
+// the keepalive timer of the connection expired, send a heartbeat if nothing was received for a while
+// and close it if nothing was received for the idle timeout, it is probably only open on our side
+static void server_check_alive(worker_t* worker, conn_t* conn) {
+    const config_t* conf = &worker->server->conf;
+    if(conn->closing)
+        return;
+    if((conn->heartbeat && conf->idle_timeout != 0 && worker->now-conn->last_recv >= conf->idle_timeout)
+        || (server_is_relaying(conn) && worker->now >= server_relay_deadline(conn))) {
+        conn->close_reason = CLOSE_IDLE;
+        server_close_later(worker, conn);
+        return;
+    }
+    uint64_t quiet = conn->last_ping > conn->last_recv ? conn->last_ping : conn->last_recv;
+    if(conn->heartbeat && conf->heartbeat != 0 && worker->now-quiet >= conf->heartbeat) {
+        static const char ping[] = "PING\n";
+        server_send_ctrl(worker, conn, ping, sizeof(ping));
+        conn->last_ping = worker->now;
+    }
+    server_keepalive(worker, conn);
+}
+
+// a write submitted by server_submit_send completed, continue with the rest of the queue
+static void server_send_done(worker_t* worker, conn_t* conn, int32_t res) {
+    queue_t* queue = conn->sending;
+    conn->sending = NULL;
+    if(res < 0) {
+        queue->pinned = 0;
+        if(worker->quiescing && (res == -ECANCELED || res == -EAGAIN)) /* nothing was written, the successor writes it */
+            return;
+        if(res == -EAGAIN && !conn->closing) /* try again once the socket is writable */
+            server_submit_send(worker, conn, queue, 1);
+        else
+            server_close_later(worker, conn);
+        return;
+    }
+    len_t count = queue->count;
+    queue_consume(queue, res, server_frame_written, worker);
+    metrics_add(&worker->metrics.bytes_out, res);
+    metrics_add(&worker->metrics.frames_out, count-queue->count);
+    if(conn->closing || worker->quiescing)
+        return;
+    if(queue->count != 0)
+        server_submit_send(worker, conn, queue, 0);
+    else if(queue == &conn->replay)
+        conn->replay_blocked = 0;
+    if(queue == &conn->out && conn->slow && conn->out.bytes <= worker->server->conf.queue_low)
+        conn->slow = 0;
+}
+
+// description of a metric every worker has, printed with one line per worker
+typedef struct {
+    const char* name;
+    const char* type;
+    const char* help;
+    len_t offset;   // offset of the metric inside metrics_t
+    bool_t nanoseconds; // the value is printed in seconds
+} metric_desc_t;
+
+static const metric_desc_t server_worker_metrics[] = {
+    { "chat_received_bytes_total", "counter", "Bytes received from clients.", offsetof(metrics_t, bytes_in), 0 },
+    { "chat_sent_bytes_total", "counter", "Bytes written to clients.", offsetof(metrics_t, bytes_out), 0 },
+    { "chat_received_frames_total", "counter", "Messages received from clients.", offsetof(metrics_t, frames_in), 0 },
+    { "chat_sent_frames_total", "counter", "Messages completely written to clients.", offsetof(metrics_t, frames_out), 0 },
+    { "chat_coalesced_frames_total", "counter", "Ephemeral messages replaced by a newer one of the same sender.", offsetof(metrics_t, frames_coalesced), 0 },
+    { "chat_write_calls_total", "counter", "Writes to clients, every write can hold multiple messages.", offsetof(metrics_t, writes), 0 },
+    { "chat_oversize_frames_total", "counter", "Messages not sent because they are larger than the client accepts.", offsetof(metrics_t, frames_oversize), 0 },
+    { "chat_delayed_frames_total", "counter", "Messages that waited for the rate limit of their sender.", offsetof(metrics_t, frames_delayed), 0 },
+    { "chat_rejected_frames_total", "counter", "Messages dropped because of the rate limit of their sender.", offsetof(metrics_t, frames_rejected), 0 },
+    { "chat_duplicate_frames_total", "counter", "Messages of peers dropped because they already arrived over another link.", offsetof(metrics_t, frames_duplicate), 0 },
+    { "chat_relayed_frames_total", "counter", "Large messages relayed while they were received.", offsetof(metrics_t, frames_relayed), 0 },
+    { "chat_cancelled_frames_total", "counter", "Relayed messages whose sender left or sent too slowly.", offsetof(metrics_t, frames_cancelled), 0 },
+    { "chat_accepted_total", "counter", "Accepted connections.", offsetof(metrics_t, accepts), 0 },
+    { "chat_loop_iterations_total", "counter", "Iterations of the event loop.", offsetof(metrics_t, loops), 0 },
+    { "chat_loop_wait_seconds_total", "counter", "Time spent waiting for events.", offsetof(metrics_t, wait_ns), 1 },
+    { "chat_loop_events_seconds_total", "counter", "Time spent handling events.", offsetof(metrics_t, events_ns), 1 },
+    { "chat_loop_replay_seconds_total", "counter", "Time spent sending the history to joining clients.", offsetof(metrics_t, replay_ns), 1 },
+    { "chat_loop_close_seconds_total", "counter", "Time spent closing connections.", offsetof(metrics_t, close_ns), 1 },
+    { "chat_clients", "gauge", "Connected clients.", offsetof(metrics_t, clients), 0 },
+    { "chat_peers", "gauge", "Connected servers of the federation.", offsetof(metrics_t, peers), 0 },
+    { "chat_queued_bytes", "gauge", "Bytes waiting in the outbound queues.", offsetof(metrics_t, queued_bytes), 0 },
+    { "chat_queued_frames", "gauge", "Messages waiting in the outbound queues.", offsetof(metrics_t, queued_frames), 0 },
+};
+
+static const char* server_close_reasons[NUM_CLOSE] = { "error", "peer", "slow", "oversize", "idle", "relay", "groups" };
+
+static const char* server_latency_paths[NUM_LATENCY] = { "body", "first_send", "last_flush", "replay" };
+
+static const double server_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// merge the latency histograms of all workers, without the values recorded before the last reset
+static void server_latency_snapshot(server_t* server, len_t path, histogram_snapshot_t* snap) {
+    memset(snap, 0, sizeof(histogram_snapshot_t));
+    for(len_t w = 0; w < server->num_workers; w++)
+        metrics_merge(snap, &server->workers[w].latency[path]);
+}
+
+// forget all latencies recorded until now
+static void server_reset_latency(server_t* server) {
+    for(len_t p = 0; p < NUM_LATENCY; p++)
+        server_latency_snapshot(server, p, &server->latency_base[p]);
+}
+
+static void server_signal_reset(int sig) {
+    atomic_store(&server_reset_requested, 1);
+}
+
+// write all metrics in the prometheus text format, the metrics of the workers are read without any lock
+static void server_write_metrics(server_t* server, FILE* out) {
+    for(len_t i = 0; i < sizeof(server_worker_metrics)/sizeof(server_worker_metrics[0]); i++) {
+        const metric_desc_t* desc = &server_worker_metrics[i];
+        metrics_header(out, desc->name, desc->type, desc->help);
+        for(len_t w = 0; w < server->num_workers; w++) {
+            uint64_t value = metrics_get((const metric_t*)((const char*)&server->workers[w].metrics+desc->offset));
+            if(desc->nanoseconds)
+                fprintf(out, "%s{worker=\"%lu\"} %.9f\n", desc->name, w, value/1e9);
+            else
+                fprintf(out, "%s{worker=\"%lu\"} %lu\n", desc->name, w, value);
+        }
+    }
+    metrics_header(out, "chat_disconnects_total", "counter", "Disconnected clients by reason.");
+    for(len_t w = 0; w < server->num_workers; w++)
+        for(len_t r = 0; r < NUM_CLOSE; r++)
+            fprintf(out, "chat_disconnects_total{worker=\"%lu\",reason=\"%s\"} %lu\n", w, server_close_reasons[r], metrics_get(&server->workers[w].metrics.disconnects[r]));
+    pthread_mutex_lock(&server->history_lock);
+    len_t history_bytes = server->history.len;
+    len_t history_entries = server->history.count;
+    for(len_t i = 0; i < server->num_partitions; i++) {
+        history_bytes += server->partitions[i].len;
+        history_entries += server->partitions[i].count;
+    }
+    pthread_mutex_unlock(&server->history_lock);
+    metrics_header(out, "chat_history_bytes", "gauge", "Bytes stored in the history.");
+    fprintf(out, "chat_history_bytes %lu\n", history_bytes);
+    metrics_header(out, "chat_history_messages", "gauge", "Messages stored in the history.");
+    fprintf(out, "chat_history_messages %lu\n", history_entries);
+    metrics_header(out, "chat_saved_messages_total", "counter", "Messages added to the history.");
+    fprintf(out, "chat_saved_messages_total %lu\n", atomic_load(&server->num_messg));
+    metrics_header(out, "chat_slow_clients_total", "counter", "Times a client passed the high watermark.");
+    fprintf(out, "chat_slow_clients_total %lu\n", atomic_load(&server->slow_trips));
+    metrics_header(out, "chat_slow_dropped_frames_total", "counter", "Messages dropped for slow clients.");
+    fprintf(out, "chat_slow_dropped_frames_total %lu\n", atomic_load(&server->slow_dropped));
+    metrics_header(out, "chat_latency_seconds", "summary", "Latencies of the relay path since the last reset.");
+    histogram_snapshot_t* snap = (histogram_snapshot_t*)malloc(sizeof(histogram_snapshot_t));
+    for(len_t p = 0; p < NUM_LATENCY; p++) {
+        server_latency_snapshot(server, p, snap);
+        metrics_subtract(snap, &server->latency_base[p]);
+        for(len_t q = 0; q < sizeof(server_quantiles)/sizeof(server_quantiles[0]); q++)
+            fprintf(out, "chat_latency_seconds{path=\"%s\",quantile=\"%g\"} %.9f\n", server_latency_paths[p], server_quantiles[q], metrics_quantile(snap, server_quantiles[q])/1e9);
+        fprintf(out, "chat_latency_seconds_sum{path=\"%s\"} %.9f\n", server_latency_paths[p], snap->sum/1e9);
+        fprintf(out, "chat_latency_seconds_count{path=\"%s\"} %lu\n", server_latency_paths[p], snap->count);
+    }
+    free(snap);
+}
+
+// format the metrics into a newly allocated buffer
+static char* server_format_metrics(server_t* server, len_t* len) {
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    server_write_metrics(server, out);
+    fclose(out);
+    *len = size;
+    return text;
+}
+
+// write as much of the metrics as the socket accepts, the connection is closed once all of it was written
+static void server_send_metrics(worker_t* worker, conn_t* conn) {
+    len_t calls = 0;
+    if(queue_flush(&conn->out, conn->fd, NULL, NULL, &calls) == ERROR || conn->out.count == 0) {
+        slot_remove(&worker->slots, conn->handle);
+        close(conn->fd);
+        queue_free(&conn->out);
+        free(conn);
+    }
+}
+
+// answer every connection to the metrics socket with the current metrics, they are written
+// once the socket is writable and the rest whenever it is writable again, then it is closed
+static void server_serve_metrics(worker_t* worker, conn_t* conn) {
+    int sock;
+    while((sock = accept4(conn->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        len_t len;
+        char* text = server_format_metrics(worker->server, &len);
+        conn_t* reader = (conn_t*)calloc(1, sizeof(conn_t));
+        reader->kind = CONN_METRICS_OUT;
+        reader->fd = sock;
+        queue_push(&reader->out, frame_create(text, len, 0), worker->now);
+        free(text);
+        if(server_watch(worker, reader, EPOLLOUT | EPOLLET) == ERROR) {
+            close(sock);
+            queue_free(&reader->out);
+            free(reader);
+        }
+    }
+}
+
+// a successor connected for a hot restart, the event loops stop and everything is handed to it
+static void server_accept_handoff(worker_t* worker, conn_t* conn) {
+    server_t* server = worker->server;
+    int sock;
+    while((sock = accept4(conn->fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        if(server->handoff_fd != -1) /* only the first one takes over */ {
+            close(sock);
+            continue;
+        }
+        server->handoff_fd = sock;
+        atomic_store(&server->end, 1);
+    }
+}
+
+// setup the epoll instance of the worker, only file descriptors that are ready are reported
+// the worker listens on sock, if it is -1 a new listening socket is created
+static error_t server_init_worker(server_t* server, worker_t* worker, len_t index, int sock) {
+    memset(worker, 0, sizeof(worker_t));
+    worker->server = server;
+    worker->index = index;
+    worker->sock = sock != -1 ? sock : server_listen(&server->conf, server->num_workers > 1);
+    if(worker->sock == -1)
+        return ERROR;
+    worker->epfd = epoll_create1(0);
+    if(worker->epfd == -1) {
+        perror("couldn't create epoll instance");
+        close(worker->sock);
+        return ERROR;
+    }
+    worker->evfd = eventfd(0, EFD_NONBLOCK);
+    if(worker->evfd == -1) {
+        perror("couldn't create eventfd");
+        close(worker->epfd);
+        close(worker->sock);
+        return ERROR;
+    }
+    slot_init(&worker->slots, START_SLOTS);
+    worker->now = server_time();
+    wheel_init(&worker->timers, worker->now);
+    worker->flush_timer.data = TIMER_FLUSH;
+    worker->sample_timer.data = TIMER_SAMPLE;
+    if(server->conf.metrics_socket != NULL || server->conf.metrics_file != NULL)
+        wheel_schedule(&worker->timers, &worker->sample_timer, worker->now);
+    if(server->conf.flag & FLAG_CONF_IO_URING) {
+        worker->ring = uring_create(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+        if(worker->ring == NULL && index == 0)
+            fprintf(stderr, "io_uring is not supported, using epoll instead\n");
+    }
+    if(worker->ring != NULL) /* everything that is still handled by epoll is reported through the ring */ {
+        worker->epoll_conn.kind = CONN_EPOLL;
+        worker->epoll_conn.fd = worker->epfd;
+        uring_poll(worker->ring, worker->epfd, (uintptr_t)&worker->epoll_conn | OP_EVENT);
+    }
+    worker->listen_conn.kind = CONN_LISTEN;
+    worker->listen_conn.fd = worker->sock;
+    worker->wake_conn.kind = CONN_WAKE;
+    worker->wake_conn.fd = worker->evfd;
+    if(server_watch(worker, &worker->listen_conn, EPOLLIN | EPOLLET) == ERROR || server_watch(worker, &worker->wake_conn, EPOLLIN | EPOLLET) == ERROR) {
+        perror("couldn't add socket to epoll");
+        if(worker->ring != NULL)
+            uring_destroy(worker->ring);
+        slot_free(&worker->slots);
+        close(worker->evfd);
+        close(worker->epfd);
+        close(worker->sock);
+        return ERROR;
+    }
+    pthread_mutex_init(&worker->inbox_lock, NULL);
+    return OK;
+}
+
+static void server_free_worker(worker_t* worker) {
+    if(worker->ring != NULL) /* cancels everything that still uses the clients */ {
+        // the ring is torn down asynchronously, stop listening now so the port can be bound again right away
+        // unless a successor took over the socket and keeps listening on it
+        if(worker->server->handoff_fd == -1)
+            shutdown(worker->sock, SHUT_RDWR);
+        uring_destroy(worker->ring);
+    }
+    for(len_t i = 0; i < worker->slots.used; i++) {
+        conn_t* conn = (conn_t*)worker->slots.slots[i].ptr;
+        if(conn != NULL && (conn->kind == CONN_CLIENT || conn->kind == CONN_CONNECTING || conn->kind == CONN_METRICS_OUT)) {
+            close(conn->fd);
+            free(conn->in);
+            free(conn->iov);
+            queue_free(&conn->out);
+            queue_free(&conn->replay);
+            queue_free(&conn->held);
+            free(conn->relays);
+            free(conn);
+        }
+    }
+    slot_free(&worker->slots);
+    for(len_t i = 0; i < worker->num_members; i++)
+        free(worker->members[i].conns);
+    free(worker->members);
+    free(worker->wildcard.conns);
+    free(worker->peers.conns);
+    for(len_t i = 0; i < worker->num_relays; i++)
+        free(worker->relays[i].conns);
+    free(worker->relays);
+    free(worker->replays);
+    free(worker->pending);
+    free(worker->dead);
+    for(len_t i = 0; i < worker->inbox_len; i++)
+        frame_unref(worker->inbox[i]);
+    free(worker->inbox);
+    free(worker->drain);
+    pthread_mutex_destroy(&worker->inbox_lock);
+    close(worker->evfd);
+    close(worker->epfd);
+    close(worker->sock);
+}
+
+// handle the events of a single epoll_wait call
+static void server_poll_epoll(worker_t* worker, int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t wait_start = metrics_time_ns();
+    int num_events = epoll_wait(worker->epfd, events, MAX_EVENTS, timeout);
+    metrics_add(&worker->metrics.wait_ns, metrics_time_ns()-wait_start);
+    worker->now = server_time();
+
+    for(int e = 0; e < num_events; e++) {
+        conn_t* conn = (conn_t*)slot_get(&worker->slots, events[e].data.u64);
+        if(conn == NULL) /* the connection was closed in the meantime */
+            continue;
+
+        if(conn->kind == CONN_LISTEN) {
+            server_accept(worker);
+        } else if(conn->kind == CONN_WAKE) {
+            server_drain_inbox(worker);
+        } else if(conn->kind == CONN_METRICS) {
+            server_serve_metrics(worker, conn);
+        } else if(conn->kind == CONN_METRICS_OUT) {
+            server_send_metrics(worker, conn);
+        } else if(conn->kind == CONN_CONNECTING) {
+            server_connected(worker, conn);
+        } else if(conn->kind == CONN_HANDOFF) {
+            server_accept_handoff(worker, conn);
+        } else if(conn->kind == CONN_CLIENT && !conn->closing) {
+            // continue writing the outbound queue, or the history if the client is still receiving it
+            if((events[e].events & EPOLLOUT) && conn->replaying)
+                conn->replay_blocked = 0;
+            else if((events[e].events & EPOLLOUT) && server_flush(worker, conn) == ERROR) {
+                server_close_later(worker, conn);
+                continue;
+            }
+            // see if the client wants to send anything
+            if(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                server_recv(worker, conn);
+        } else if(conn->kind == CONN_STDIN) {
+            // read stdin
+            char buffer[START_BUFFER_LEN];
+            int len = read(STDIN_FILENO, buffer, START_BUFFER_LEN);
+            for(int i = 0; i < len; i++) {
+                if(buffer[i] == 'q' || buffer[i] == 'Q' || buffer[i] == 3 /* <C-c> */) /* exit */ {
+                    atomic_store(&worker->server->end, 1);
+                    break;
+                } else if(buffer[i] == 'r' || buffer[i] == 'R') /* forget the recorded latencies */
+                    server_reset_latency(worker->server);
+            }
+        } else if(conn->kind == CONN_UDP) {
+            // accept discovery messages, edge-triggered so read until there is nothing left
+            for(;;) {
+                char buffer[START_BUFFER_LEN];
+                struct sockaddr_storage addr;
+                unsigned int addr_len = sizeof(addr);
+                int len = recvfrom(conn->fd, buffer, START_BUFFER_LEN, MSG_DONTWAIT, (struct sockaddr*)&addr, &addr_len);
+                if(len == -1)
+                    break;
+                if(len == 2 && buffer[0] == 'H' && buffer[1] == 'I') /* if we get a discovery package we return ok */ {
+                    buffer[0] = 'O';
+                    buffer[1] = 'K';
+                    sendto(conn->fd, buffer, 2, 0, (struct sockaddr*)&addr, addr_len);
+                }
+            }
+        }
+    }
+}
+
+// submit everything prepared in the last loop iteration and handle the completions
+static void server_poll_uring(worker_t* worker, int timeout) {
+    uint64_t wait_start = metrics_time_ns();
+    uring_wait(worker->ring, timeout);
+    metrics_add(&worker->metrics.wait_ns, metrics_time_ns()-wait_start);
+    worker->now = server_time();
+    uring_event_t event;
+    while(uring_next(worker->ring, &event)) {
+        if(event.data == 0) /* nothing to do for cancel operations */
+            continue;
+        conn_t* conn = (conn_t*)(uintptr_t)(event.data & ~(uint64_t)OP_MASK);
+        if(conn->kind == CONN_CLIENT) {
+            if((event.data & OP_MASK) == OP_SEND || !event.more)
+                conn->inflight--;
+            if(conn->detached) {
+                if(event.buffer >= 0)
+                    uring_release(worker->ring, event.buffer);
+                if(conn->inflight == 0)
+                    server_free_client(worker, conn);
+            } else if((event.data & OP_MASK) == OP_SEND)
+                server_send_done(worker, conn, event.res);
+            else
+                server_recv_done(worker, conn, &event);
+        } else if(conn->kind == CONN_LISTEN) {
+            if(event.res >= 0)
+                server_add_client(worker, event.res);
+            if(worker->quiescing) /* the client is handed over with the others */ {
+                if(event.res >= 0)
+                    uring_cancel(worker->ring, event.res);
+                if(!event.more)
+                    worker->quiesce_wait--;
+            } else if(event.res == -EMFILE || event.res == -ENFILE || event.res == -ENOBUFS || event.res == -ENOMEM)
+                worker->accept_paused = 1;
+            else if(!event.more)
+                uring_accept(worker->ring, conn->fd, event.data);
+        } else if(conn->kind == CONN_EPOLL) {
+            if(worker->quiescing) /* the events are left to the successor */ {
+                if(!event.more)
+                    worker->quiesce_wait--;
+            } else {
+                server_poll_epoll(worker, 0);
+                if(!event.more)
+                    uring_poll(worker->ring, conn->fd, event.data);
+            }
+        }
+    }
+}
+
+// update the gauges of the worker, they are only sampled once per SERVER_CLOCK and only if they are exported
+static void server_sample(worker_t* worker) {
+    uint64_t clients = 0;
+    uint64_t queued_bytes = 0;
+    uint64_t queued_frames = 0;
+    for(len_t i = 0; i < worker->slots.used; i++) {
+        conn_t* conn = (conn_t*)worker->slots.slots[i].ptr;
+        if(conn != NULL && conn->kind == CONN_CLIENT && !conn->detached) {
+            if(!conn->peer)
+                clients++;
+            queued_bytes += conn->out.bytes+conn->replay.bytes+conn->held.bytes;
+            queued_frames += conn->out.count+conn->replay.count+conn->held.count;
+        }
+    }
+    metrics_set(&worker->metrics.clients, clients);
+    metrics_set(&worker->metrics.peers, worker->peers.count);
+    metrics_set(&worker->metrics.queued_bytes, queued_bytes);
+    metrics_set(&worker->metrics.queued_frames, queued_frames);
+    wheel_schedule(&worker->timers, &worker->sample_timer, worker->now+SERVER_CLOCK);
+}
+
+// a timer of the worker expired
+static void server_timer_expired(void* arg, wheel_timer_t* timer) {
+    worker_t* worker = (worker_t*)arg;
+    void* ptr = (void*)(uintptr_t)(timer->data & ~(uint64_t)TIMER_MASK);
+    switch(timer->data & TIMER_MASK) {
+    case TIMER_KEEPALIVE:
+        server_check_alive(worker, (conn_t*)ptr);
+        break;
+    case TIMER_THROTTLE:
+        server_resume(worker, (conn_t*)ptr);
+        break;
+    case TIMER_DIAL:
+        server_dial(worker, (peer_link_t*)ptr);
+        break;
+    case TIMER_FLUSH:
+        server_write_pending(worker);
+        break;
+    case TIMER_SAMPLE:
+        server_sample(worker);
+        break;
+    case TIMER_HELLO:
+        server_end_hello_wait(worker, (conn_t*)ptr);
+        break;
+    }
+}
+
+// run a single iteration of the event loop, a negative timeout waits until the next event or timer
+static void server_poll(worker_t* worker, int timeout) {
+    metrics_t* metrics = &worker->metrics;
+    uint64_t next = wheel_next(&worker->timers);
+    if(worker->replay_ready) /* do not wait, some clients are still receiving the history */
+        timeout = 0;
+    else if(worker->num_pending != 0 && worker->server->conf.flush_delay == 0) /* frames were queued outside of the loop */
+        timeout = 0;
+    else if(next != UINT64_MAX) /* wake up for the first timer */ {
+        uint64_t now = server_time();
+        if(next <= now)
+            timeout = 0;
+        else if(timeout < 0 || next-now < (uint64_t)timeout)
+            timeout = next-now;
+    }
+    uint64_t start = metrics_time_ns();
+    uint64_t waited = metrics_get(&metrics->wait_ns);
+    if(worker->ring != NULL)
+        server_poll_uring(worker, timeout);
+    else
+        server_poll_epoll(worker, timeout);
+    wheel_advance(&worker->timers, worker->now, server_timer_expired, worker);
+    if(worker->server->conf.flush_delay == 0)
+        server_write_pending(worker);
+    uint64_t events_end = metrics_time_ns();
+    metrics_add(&metrics->events_ns, events_end-start-(metrics_get(&metrics->wait_ns)-waited));
+
+    server_replay_all(worker);
+    uint64_t replay_end = metrics_time_ns();
+    metrics_add(&metrics->replay_ns, replay_end-events_end);
+
+    // disconnect the clients only after all events are handled, they might still be referenced
+    for(len_t i = 0; i < worker->num_dead; i++) {
+        server_abort_relay(worker, worker->dead[i]);
+        server_disconnect(worker, worker->dead[i]);
+    }
+    worker->num_dead = 0;
+    metrics_add(&metrics->close_ns, metrics_time_ns()-replay_end);
+    metrics_add(&metrics->loops, 1);
+}
+
+// resolve the peers given as "host:port", they are resolved once at the start
+static error_t server_resolve_peers(server_t* server) {
+    const config_t* conf = &server->conf;
+    server->links = (peer_link_t*)calloc(conf->num_peers, sizeof(peer_link_t));
+    server->num_links = conf->num_peers;
+    for(len_t i = 0; i < conf->num_peers; i++) {
+        const char* colon = strrchr(conf->peers[i], ':');
+        char host[256];
+        len_t host_len = colon-conf->peers[i];
+        if(host_len >= sizeof(host)) {
+            fprintf(stderr, "peer host name is too long\n");
+            return ERROR;
+        }
+        memcpy(host, conf->peers[i], host_len);
+        host[host_len] = 0;
+        struct hostent* hoste = gethostbyname(host);
+        if(hoste == NULL || hoste->h_addr_list[0] == NULL) {
+            fprintf(stderr, "couldn't find the peer %s\n", conf->peers[i]);
+            return ERROR;
+        }
+        server->links[i].addr.sin_family = AF_INET;
+        server->links[i].addr.sin_addr = *(((struct in_addr**)hoste->h_addr_list)[0]);
+        server->links[i].addr.sin_port = htons(atoi(colon+1));
+    }
+    return OK;
+}
+
+// with io_uring wait until the kernel no longer uses any connection, so that the queues and inbound buffers
+// hold everything that was written and received, with epoll nothing happens outside of the loop
+static void server_quiesce(worker_t* worker) {
+    if(worker->ring == NULL)
+        return;
+    worker->quiescing = 1;
+    worker->quiesce_wait = worker->accept_paused ? 1 : 2;
+    uring_cancel(worker->ring, worker->sock);
+    uring_cancel(worker->ring, worker->epfd);
+    for(len_t i = 0; i < worker->slots.used; i++) {
+        conn_t* conn = (conn_t*)worker->slots.slots[i].ptr;
+        if(conn != NULL && conn->kind == CONN_CLIENT && conn->inflight != 0 && !conn->detached)
+            uring_cancel(worker->ring, conn->fd);
+    }
+    for(;;) {
+        bool_t busy = worker->quiesce_wait != 0;
+        for(len_t i = 0; !busy && i < worker->slots.used; i++) {
+            conn_t* conn = (conn_t*)worker->slots.slots[i].ptr;
+            busy = conn != NULL && conn->kind == CONN_CLIENT && conn->inflight != 0;
+        }
+        if(!busy)
+            break;
+        server_poll_uring(worker, -1);
+    }
+}
+
+// write the state of the connection, its file descriptor is sent in the same order
+static void server_save_conn(server_t* server, conn_t* conn, handoff_buf_t* state) {
+    uint16_t flags = (conn->peer ? HANDOFF_PEER : 0) | (conn->heartbeat ? HANDOFF_HEARTBEAT : 0)
+        | (conn->out.stamped ? HANDOFF_STAMPED : 0) | (conn->replaying ? HANDOFF_REPLAYING : 0) | (conn->link != NULL ? HANDOFF_LINK : 0)
+        | (conn->envelope_in ? HANDOFF_ENVELOPE_IN : 0) | (conn->out.enveloped ? HANDOFF_ENVELOPE_OUT : 0)
+        | (conn->relay_drop ? HANDOFF_RELAY_DROP : 0);
+    handoff_put_int(state, conn->id, sizeof(uint64_t));
+    handoff_put_int(state, flags, 2);
+    const char* name = conn->peer || conn->group == GROUP_ALL ? "" : server->groups.groups[conn->group]->name;
+    handoff_put_data(state, name, strlen(name));
+    handoff_put_int(state, conn->max_frame, sizeof(uint64_t));
+    handoff_put_int(state, conn->joined_seq, sizeof(uint64_t));
+    handoff_put_int(state, conn->replay_seq, sizeof(uint64_t));
+    handoff_put_int(state, conn->skip, sizeof(uint64_t));
+    handoff_put_int(state, conn->relay_left, sizeof(uint64_t));
+    handoff_put_int(state, conn->relay_seq, sizeof(uint64_t));
+    handoff_put_int(state, conn->relay_len, sizeof(uint64_t));
+    handoff_put_int(state, conn->relay_start, sizeof(uint64_t));
+    handoff_put_int(state, conn->streaming, sizeof(uint64_t));
+    handoff_put_int(state, conn->num_relays, sizeof(uint64_t));
+    for(len_t i = 0; i < conn->num_relays; i++)
+        handoff_put_int(state, conn->relays[i], sizeof(uint64_t));
+    if(conn->link != NULL) {
+        handoff_put_int(state, conn->link->addr.sin_addr.s_addr, sizeof(uint32_t));
+        handoff_put_int(state, conn->link->addr.sin_port, sizeof(uint16_t));
+    }
+    handoff_put_data(state, conn->in, conn->in_len);
+    // the queued frames are sent as they are, a partially written frame continues where it stopped
+    queue_copy(&conn->out, handoff_put_data(state, NULL, conn->out.bytes));
+    queue_copy(&conn->replay, handoff_put_data(state, NULL, conn->replay.bytes));
+    // the held frames are sent one by one, they may belong to relayed messages whose pieces are still to come
+    handoff_put_int(state, conn->held.count, sizeof(uint64_t));
+    for(len_t i = 0; i < conn->held.count; i++) {
+        const frame_t* frame = conn->held.entries[(conn->held.first+i) % conn->held.cap].frame;
+        handoff_put_int(state, frame->seq, sizeof(uint64_t));
+        handoff_put_int(state, frame->relay, sizeof(uint64_t));
+        handoff_put_int(state, frame->flags, 1);
+        handoff_put_data(state, frame->head, frame->head_len);
+        handoff_put_data(state, frame->data, frame->len);
+    }
+}
+
+// a connection that is handed over, it is still open and neither closing nor waiting for io_uring
+static bool_t server_handed_over(const conn_t* conn) {
+    return conn != NULL && conn->kind == CONN_CLIENT && !conn->closing && !conn->detached;
+}
+
+// write the messages of the history and the sequence number of the last evicted one into the state
+static void server_save_history(handoff_buf_t* state, const history_t* hist) {
+    handoff_put_int(state, hist->evicted, sizeof(uint64_t));
+    handoff_put_int(state, hist->count, sizeof(uint64_t));
+    for(len_t i = 0; i < hist->count; i++) {
+        const history_entry_t* entry = &hist->entries[(hist->first+i) % hist->cap];
+        uint64_t next_seq;
+        handoff_put_int(state, entry->seq, sizeof(uint64_t));
+        history_read(hist, entry->seq, entry->seq, handoff_put_data(state, NULL, entry->len), entry->len, &next_seq, HISTORY_RAW, 0);
+    }
+}
+
+// hand the history, the sequence numbers, the listening sockets and every connection to the successor,
+// the event loops of all workers have stopped, connections to peers that are not yet established are dialed again
+static error_t server_handoff(server_t* server) {
+    // the messages dead clients were sending are cancelled and frames posted after a worker stopped are still
+    // forwarded, the first worker may post the messages of peers, a cancelled message may close more clients
+    len_t num_dead;
+    len_t last_dead = 0;
+    do {
+        num_dead = last_dead;
+        for(len_t i = 0; i < server->num_workers; i++) {
+            for(len_t j = 0; j < server->workers[i].num_dead; j++)
+                server_abort_relay(&server->workers[i], server->workers[i].dead[j]);
+        }
+        for(len_t i = 0; i < server->num_workers; i++)
+            server_drain_inbox(&server->workers[i]);
+        last_dead = 0;
+        for(len_t i = 0; i < server->num_workers; i++)
+            last_dead += server->workers[i].num_dead;
+    } while(last_dead != num_dead);
+    for(len_t i = 0; i < server->num_workers; i++) {
+        worker_t* worker = &server->workers[i];
+        for(len_t j = 0; j < worker->num_dead; j++)
+            server_disconnect(worker, worker->dead[j]);
+        worker->num_dead = 0;
+    }
+    if(server->use_store) /* the successor opens the log again */ {
+        server_close_store(server);
+        server->use_store = 0;
+    }
+    handoff_buf_t state;
+    handoff_init(&state);
+    handoff_put_int(&state, server->origin, sizeof(uint64_t));
+    handoff_put_int(&state, atomic_load(&server->cid), sizeof(uint64_t));
+    handoff_put_int(&state, server->seq, sizeof(uint64_t));
+    handoff_put_int(&state, server->peer_seq, sizeof(uint64_t));
+    handoff_put_int(&state, atomic_load(&server->num_messg), sizeof(uint64_t));
+    server_save_history(&state, &server->history);
+    // the partitions are created in advance, only those of existing groups are handed over
+    len_t num_partitions = server->num_partitions < server->groups.count ? server->num_partitions : server->groups.count;
+    handoff_put_int(&state, num_partitions, sizeof(uint64_t));
+    for(len_t i = 0; i < num_partitions; i++) {
+        const char* name = server->groups.groups[i]->name;
+        handoff_put_data(&state, name, strlen(name));
+        server_save_history(&state, &server->partitions[i]);
+    }
+    handoff_put_int(&state, server->seen.count, sizeof(uint64_t));
+    for(len_t i = 0; i < server->seen.count; i++) {
+        const dedup_origin_t* origin = &server->seen.origins[i];
+        handoff_put_int(&state, origin->origin, sizeof(uint64_t));
+        handoff_put_int(&state, origin->last, sizeof(uint64_t));
+        for(len_t j = 0; j < DEDUP_WINDOW/64; j++)
+            handoff_put_int(&state, origin->window[j], sizeof(uint64_t));
+    }
+    // the listening sockets come first, followed by the connections
+    len_t num_fds = server->num_workers;
+    for(len_t i = 0; i < server->num_workers; i++)
+        for(len_t j = 0; j < server->workers[i].slots.used; j++)
+            if(server_handed_over((conn_t*)server->workers[i].slots.slots[j].ptr))
+                num_fds++;
+    int* fds = (int*)malloc(sizeof(int)*num_fds);
+    handoff_put_int(&state, server->num_workers, sizeof(uint64_t));
+    handoff_put_int(&state, num_fds-server->num_workers, sizeof(uint64_t));
+    len_t pos = 0;
+    for(len_t i = 0; i < server->num_workers; i++)
+        fds[pos++] = server->workers[i].sock;
+    for(len_t i = 0; i < server->num_workers; i++)
+        for(len_t j = 0; j < server->workers[i].slots.used; j++) {
+            conn_t* conn = (conn_t*)server->workers[i].slots.slots[j].ptr;
+            if(server_handed_over(conn)) {
+                server_save_conn(server, conn, &state);
+                fds[pos++] = conn->fd;
+            }
+        }
+    error_t ret = handoff_send(server->handoff_fd, &state, fds, num_fds);
+    free(fds);
+    handoff_free(&state);
+    return ret;
+}
+
+// connect to the server that listens on the hot restart path and receive its state, returns ERROR
+// if there is no such server or it failed to hand everything over, then the server starts on its own
+static error_t server_takeover(const char* path, handoff_buf_t* state, int** fds, len_t* num_fds) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return ERROR;
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+        return ERROR;
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) /* no server is running */ {
+        close(sock);
+        return ERROR;
+    }
+    error_t ret = handoff_recv(sock, state, fds, num_fds);
+    close(sock);
+    if(ret == ERROR)
+        fprintf(stderr, "couldn't take over from the running server\n");
+    return ret;
+}
+
+// read what server_save_history wrote into the history of the group, with a log
+// the messages were already restored from it
+static void server_load_history(server_t* server, handoff_buf_t* state, uint32_t group) {
+    uint64_t evicted = handoff_get_int(state, sizeof(uint64_t));
+    len_t count = handoff_get_int(state, sizeof(uint64_t));
+    for(len_t i = 0; i < count && !state->failed; i++) {
+        uint64_t msg_seq = handoff_get_int(state, sizeof(uint64_t));
+        len_t len;
+        const char* msg = handoff_get_data(state, &len);
+        if(!server->use_store && msg != NULL)
+            server_history_add(server, group, msg, len, msg_seq);
+    }
+    history_t* hist = server_partition(server, group);
+    if(!server->use_store && evicted > hist->evicted)
+        hist->evicted = evicted;
+}
+
+// restore what the predecessor handed over, the history is taken from the log if there is one,
+// it holds the same messages, returns the number of listening sockets
+static len_t server_restore(server_t* server, handoff_buf_t* state) {
+    server->origin = handoff_get_int(state, sizeof(uint64_t));
+    uint64_t cid = handoff_get_int(state, sizeof(uint64_t));
+    if(cid > atomic_load(&server->cid))
+        atomic_store(&server->cid, cid);
+    uint64_t seq = handoff_get_int(state, sizeof(uint64_t));
+    if(seq > server->seq)
+        server->seq = seq;
+    server->peer_seq = handoff_get_int(state, sizeof(uint64_t));
+    atomic_store(&server->num_messg, handoff_get_int(state, sizeof(uint64_t)));
+    server_load_history(server, state, GROUP_ALL);
+    len_t count = handoff_get_int(state, sizeof(uint64_t));
+    for(len_t i = 0; i < count && !state->failed; i++) {
+        len_t name_len;
+        const char* name = handoff_get_data(state, &name_len);
+        pthread_mutex_lock(&server->group_lock);
+        uint32_t group = group_intern(&server->groups, name == NULL ? "" : name, name_len);
+        pthread_mutex_unlock(&server->group_lock);
+        server_load_history(server, state, group);
+    }
+    count = handoff_get_int(state, sizeof(uint64_t));
+    for(len_t i = 0; i < count && !state->failed; i++) {
+        if(server->seen.count == server->seen.cap) {
+            server->seen.cap = server->seen.cap == 0 ? 8 : 2*server->seen.cap;
+            server->seen.origins = (dedup_origin_t*)realloc(server->seen.origins, sizeof(dedup_origin_t)*server->seen.cap);
+        }
+        dedup_origin_t* origin = &server->seen.origins[server->seen.count++];
+        origin->origin = handoff_get_int(state, sizeof(uint64_t));
+        origin->last = handoff_get_int(state, sizeof(uint64_t));
+        for(len_t j = 0; j < DEDUP_WINDOW/64; j++)
+            origin->window[j] = handoff_get_int(state, sizeof(uint64_t));
+    }
+    return handoff_get_int(state, sizeof(uint64_t));
+}
+
+// take over a connection of the predecessor, it continues exactly where it stopped
+// the inbound buffer is only parsed once every connection was taken over, returns NULL if it failed
+static conn_t* server_adopt(worker_t* worker, int sock, handoff_buf_t* state) {
+    server_t* server = worker->server;
+    conn_t* conn = (conn_t*)calloc(1, sizeof(conn_t));
+    conn->kind = CONN_CLIENT;
+    conn->fd = sock;
+    conn->id = handoff_get_int(state, sizeof(uint64_t));
+    uint16_t flags = handoff_get_int(state, 2);
+    len_t name_len;
+    const char* name = handoff_get_data(state, &name_len);
+    conn->max_frame = handoff_get_int(state, sizeof(uint64_t));
+    conn->joined_seq = handoff_get_int(state, sizeof(uint64_t));
+    uint64_t replay_seq = handoff_get_int(state, sizeof(uint64_t));
+    conn->skip = handoff_get_int(state, sizeof(uint64_t));
+    conn->relay_left = handoff_get_int(state, sizeof(uint64_t));
+    conn->relay_seq = handoff_get_int(state, sizeof(uint64_t));
+    conn->relay_len = handoff_get_int(state, sizeof(uint64_t));
+    conn->relay_start = handoff_get_int(state, sizeof(uint64_t));
+    conn->streaming = handoff_get_int(state, sizeof(uint64_t));
+    len_t num_relays = handoff_get_int(state, sizeof(uint64_t));
+    for(len_t i = 0; i < num_relays && !state->failed; i++)
+        server_add_relay(conn, handoff_get_int(state, sizeof(uint64_t)));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    if(flags & HANDOFF_LINK) {
+        addr.sin_addr.s_addr = handoff_get_int(state, sizeof(uint32_t));
+        addr.sin_port = handoff_get_int(state, sizeof(uint16_t));
+    }
+    len_t in_len;
+    const char* in = handoff_get_data(state, &in_len);
+    len_t out_len;
+    const char* out = handoff_get_data(state, &out_len);
+    len_t replay_len;
+    const char* replay = handoff_get_data(state, &replay_len);
+    len_t num_held = handoff_get_int(state, sizeof(uint64_t));
+    for(len_t i = 0; i < num_held && !state->failed; i++) {
+        uint64_t seq = handoff_get_int(state, sizeof(uint64_t));
+        uint64_t relay = handoff_get_int(state, sizeof(uint64_t));
+        uint8_t flags = handoff_get_int(state, 1);
+        len_t head_len;
+        const char* head = handoff_get_data(state, &head_len);
+        len_t data_len;
+        const char* data = handoff_get_data(state, &data_len);
+        if(state->failed || head_len > ENVELOPE_MAX_HEAD)
+            break;
+        frame_t* frame = frame_create(data, data_len, seq);
+        frame->relay = relay;
+        frame->flags = flags;
+        frame->head_len = head_len;
+        memcpy(frame->head, head, head_len);
+        queue_push(&conn->held, frame, worker->now);
+    }
+    if(state->failed || server_watch(worker, conn, EPOLLIN | EPOLLOUT | EPOLLET) == ERROR) {
+        close(sock);
+        queue_free(&conn->held);
+        free(conn->relays);
+        free(conn);
+        return NULL;
+    }
+    for(len_t i = 0; i < conn->num_relays; i++)
+        server_add_recipient(worker, conn, conn->relays[i]);
+    conn->join_ns = metrics_time_ns();
+    bucket_init(&conn->rate_frames, server->conf.rate_frames, worker->now);
+    bucket_init(&conn->rate_bytes, server->conf.rate_bytes, worker->now);
+    bucket_init(&conn->rate_large, server->conf.rate_large, worker->now);
+    conn->throttle_timer.data = (uintptr_t)conn | TIMER_THROTTLE;
+    conn->last_recv = worker->now;
+    if(flags & HANDOFF_PEER) {
+        for(len_t i = 0; i < server->num_links && (flags & HANDOFF_LINK); i++)
+            if(server->links[i].conn == NULL && server->links[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr && server->links[i].addr.sin_port == addr.sin_port) {
+                conn->link = &server->links[i];
+                conn->link->conn = conn;
+                break;
+            }
+        server_make_peer(worker, conn);
+    } else {
+        uint32_t group = GROUP_ALL;
+        if(name_len != 0) {
+            pthread_mutex_lock(&server->group_lock);
+            group = group_intern(&server->groups, name, name_len);
+            pthread_mutex_unlock(&server->group_lock);
+        }
+        server_join_group(worker, conn, group);
+        atomic_fetch_add(&server->num_clients, 1);
+        if(flags & HANDOFF_HEARTBEAT)
+            server_start_heartbeat(worker, conn);
+    }
+    conn->replay_seq = replay_seq;
+    if(out_len != 0)
+        queue_push(&conn->out, frame_create(out, out_len, 0), worker->now);
+    conn->out.stamped = (flags & HANDOFF_STAMPED) != 0;
+    conn->out.enveloped = (flags & HANDOFF_ENVELOPE_OUT) != 0;
+    conn->replay.enveloped = conn->out.enveloped;
+    conn->envelope_in = (flags & HANDOFF_ENVELOPE_IN) != 0;
+    conn->relay_drop = (flags & HANDOFF_RELAY_DROP) != 0;
+    if(server_is_relaying(conn)) /* the client is in the middle of a relayed message */ {
+        conn->keepalive.data = (uintptr_t)conn | TIMER_KEEPALIVE;
+        server_keepalive(worker, conn);
+    }
+    if(flags & HANDOFF_REPLAYING) {
+        if(replay_len != 0)
+            queue_push(&conn->replay, frame_create(replay, replay_len, 0), worker->now);
+        server_start_replay(worker, conn);
+        worker->replay_ready = 1;
+    } else if(out_len != 0)
+        server_write_later(worker, conn);
+    server_reserve(conn, in_len);
+    memcpy(conn->in, in, in_len);
+    conn->in_len = in_len;
+    return conn;
+}
+
+// take over the connections of the predecessor, they are distributed evenly over the workers
+static void server_adopt_all(server_t* server, handoff_buf_t* state, const int* fds, len_t num_fds) {
+    len_t count = handoff_get_int(state, sizeof(uint64_t));
+    conn_t** conns = (conn_t**)calloc(num_fds == 0 ? 1 : num_fds, sizeof(conn_t*));
+    for(len_t i = 0; i < num_fds; i++) {
+        if(i < count && !state->failed)
+            conns[i] = server_adopt(&server->workers[i % server->num_workers], fds[i], state);
+        else
+            close(fds[i]);
+    }
+    // messages that were received completely before the handoff are handled now that everyone is back
+    for(len_t i = 0; i < num_fds; i++)
+        if(conns[i] != NULL && conns[i]->in_len != 0) {
+            worker_t* worker = &server->workers[i % server->num_workers];
+            worker->recv_ns = metrics_time_ns();
+            server_parse(worker, conns[i]);
+        }
+    free(conns);
+}
+
+// event loop of the additional workers
+static void* server_worker_main(void* arg) {
+    worker_t* worker = (worker_t*)arg;
+    while(!atomic_load(&worker->server->end))
+        server_poll(worker, -1);
+    if(worker->server->handoff_fd != -1)
+        server_quiesce(worker);
+    return NULL;
+}
+
+// save a checkpoint of the log whenever one is due, the history is only locked while it is taken
+static void* server_store_main(void* arg) {
+    server_t* server = (server_t*)arg;
+    pthread_mutex_lock(&server->history_lock);
+    while(!server->store_end) {
+        if(!store_checkpoint_due(&server->store)) {
+            pthread_cond_wait(&server->store_cond, &server->history_lock);
+            continue;
+        }
+        store_checkpoint_t checkpoint;
+        server_take_checkpoint(server, &checkpoint);
+        pthread_mutex_unlock(&server->history_lock);
+        store_checkpoint_save(&server->store, &checkpoint);
+        pthread_mutex_lock(&server->history_lock);
+    }
+    pthread_mutex_unlock(&server->history_lock);
+    return NULL;
+}
+
+static void server_stop_store(server_t* server) {
+    pthread_mutex_lock(&server->history_lock);
+    server->store_end = 1;
+    pthread_cond_signal(&server->store_cond);
+    pthread_mutex_unlock(&server->history_lock);
+    pthread_join(server->store_thread, NULL);
+}
+
+// overwrite the stats shown on the terminal, uptime is in seconds and loops counts the wakeups of the first worker
+static void server_print_stats(server_t* server, int uptime, uint64_t loops) {
+    int sec = uptime;
+    int min = sec/60;
+    int hou = min/60;
+    int day = hou/24;
+    sec %= 60;
+    min %= 60;
+    hou %= 24;
+    pthread_mutex_lock(&server->history_lock);
+    uint64_t num_messg_hist = server->history.count;
+    for(len_t i = 0; i < server->num_partitions; i++)
+        num_messg_hist += server->partitions[i].count;
+    pthread_mutex_unlock(&server->history_lock);
+    uint64_t frames_out = 0;
+    uint64_t writes = 0;
+    for(len_t i = 0; i < server->num_workers; i++) {
+        frames_out += metrics_get(&server->workers[i].metrics.frames_out);
+        writes += metrics_get(&server->workers[i].metrics.writes);
+    }
+    fprintf(stderr, "\x1b[5M"); // clear previous output
+    fprintf(stderr, "uptime: %i days %i hours %i min. %i sec. (%lu)\n", day, hou, min, sec, loops);
+    fprintf(stderr, "number of messages: %lu (%lu)\n", atomic_load(&server->num_messg), num_messg_hist);
+    fprintf(stderr, "number of clients: %lu (%lu)\n", atomic_load(&server->num_clients), atomic_load(&server->cid));
+    fprintf(stderr, "slow clients: %lu (%lu dropped, %lu disconnected)\n", atomic_load(&server->slow_trips), atomic_load(&server->slow_dropped), atomic_load(&server->slow_disconnects));
+    fprintf(stderr, "messages per write: %.2f (%lu writes)\n", writes == 0 ? 0.0 : (double)frames_out/writes, writes);
+    fprintf(stderr, "\x1b[5A"); // go up 5 lines
+}
 
 error_t server_main(config_t conf) {
     bool_t use_dis = conf.flag & FLAG_CONF_AUTO_DIS;
@@ -59,242 +2980,213 @@ error_t server_main(config_t conf) {
         }
     }
 
-    // create  socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock == -1) {
-        perror("socket couldn't be created");
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.conf = conf;
+    server.num_workers = conf.threads == 0 ? 1 : conf.threads;
+    atomic_init(&server.end, 0);
+    atomic_init(&server.cid, ((uint64_t)conf.node << 24)+1); // the clients of every server of a federation get different ids
+    atomic_init(&server.num_clients, 0);
+    atomic_init(&server.num_messg, 0);
+    atomic_init(&server.slow_trips, 0);
+    atomic_init(&server.slow_dropped, 0);
+    atomic_init(&server.slow_disconnects, 0);
+    pthread_mutex_init(&server.history_lock, NULL);
+    pthread_mutex_init(&server.group_lock, NULL);
+    pthread_cond_init(&server.store_cond, NULL);
+    group_init(&server.groups);
+    dedup_init(&server.seen);
+    server.handoff_fd = -1;
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+    server.origin = ((uint64_t)conf.node << 56) | ((uint64_t)started.tv_sec*1000+started.tv_nsec/1000000);
+    if(server_resolve_peers(&server) == ERROR) {
+        free(server.links);
+        dedup_free(&server.seen);
+        group_free(&server.groups);
         return ERROR;
     }
-    // set timeout
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = 0;
-    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) == -1) {
-        perror("setsockopt error");
-        return ERROR;
+    // with a hot restart the running server hands everything to us before it stops
+    handoff_buf_t state;
+    handoff_init(&state);
+    int* handoff_fds = NULL;
+    len_t num_handoff_fds = 0;
+    bool_t taking_over = conf.hot_restart != NULL && server_takeover(conf.hot_restart, &state, &handoff_fds, &num_handoff_fds) == OK;
+    history_init(&server.history, conf.history_bytes, conf.history_entries);
+    if(conf.history_log != NULL) /* restore the history from the log */ {
+        id_t max_id = 0;
+        if(store_open(&server.store, conf.history_log, server_load_message, &server, &server.seq, &max_id) == ERROR) {
+            free(server.links);
+            dedup_free(&server.seen);
+            group_free(&server.groups);
+            server_free_history(&server);
+            return ERROR;
+        }
+        server.use_store = 1;
+        if((max_id >> 24) == conf.node) /* ids in the history should not be reused, ids of other servers are not ours to continue */
+            atomic_store(&server.cid, (uint64_t)max_id+1);
     }
-    int enable = 1;
-    if (setsockopt(sock ,SOL_SOCKET, SO_REUSEADDR, &enable ,sizeof(enable)) == -1) {
-        perror("setsockopt error");
-        return ERROR;
+
+    len_t num_listen = 0;
+    if(taking_over) {
+        num_listen = server_restore(&server, &state);
+        if(num_listen > num_handoff_fds)
+            num_listen = num_handoff_fds;
+        for(len_t i = server.num_workers; i < num_listen; i++) /* there are less workers now */
+            close(handoff_fds[i]);
     }
-    // bind socket
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    if(def_host)
-        addr.sin_addr.s_addr = INADDR_ANY;
-    else
-        addr.sin_addr.s_addr = inet_addr(conf.host);
-    addr.sin_port = htons(conf.port);
-    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("couldn't bind socket");
-        return ERROR;
+
+    // every worker listens on its own socket, the kernel distributes the connections
+    // the sockets of the predecessor are kept, additional workers share them
+    server.workers = (worker_t*)malloc(sizeof(worker_t)*server.num_workers);
+    for(len_t i = 0; i < server.num_workers; i++)
+        if(server_init_worker(&server, &server.workers[i], i, num_listen == 0 ? -1 : i < num_listen ? handoff_fds[i] : dup(handoff_fds[i % num_listen])) == ERROR) {
+            while(i > 0)
+                server_free_worker(&server.workers[--i]);
+            free(server.workers);
+            free(server.links);
+            dedup_free(&server.seen);
+            group_free(&server.groups);
+            if(server.use_store)
+                server_close_store(&server);
+            server_free_history(&server);
+            return ERROR;
+        }
+    if(taking_over) {
+        server_adopt_all(&server, &state, handoff_fds+num_listen, num_handoff_fds-num_listen);
+        handoff_free(&state);
+        free(handoff_fds);
     }
-    // configure sockert to listen
-    if(listen(sock, 64) == -1) {
-        perror("couldn't bind socket");
+
+    // the first worker runs in this thread, it also handles stdin and discovery
+    worker_t* main_worker = &server.workers[0];
+    conn_t stdin_conn = { .kind = CONN_STDIN, .fd = STDIN_FILENO };
+    conn_t udp_conn = { .kind = CONN_UDP, .fd = udp_sock };
+    if(use_udp && server_watch(main_worker, &udp_conn, EPOLLIN | EPOLLET) == ERROR) {
+        perror("couldn't add udp socket to epoll");
         return ERROR;
     }
-    // configure socket to be nonblocking
-    int flags = fcntl(sock, F_GETFL);
-    if(flags == -1) {
-        perror("couldn't get fd flags");
-        return ERROR;
+    // stdin may be blocking so it is level-triggered and read once per wakeup
+    server_watch(main_worker, &stdin_conn, EPOLLIN); // fails if stdin is a regular file, then there is no way to quit from stdin
+    conn_t metrics_conn = { .kind = CONN_METRICS, .fd = -1 };
+    if(conf.metrics_socket != NULL) {
+        metrics_conn.fd = server_listen_unix(conf.metrics_socket);
+        if(metrics_conn.fd == -1 || server_watch(main_worker, &metrics_conn, EPOLLIN | EPOLLET) == ERROR) {
+            perror("couldn't add metrics socket to epoll");
+            return ERROR;
+        }
     }
-    flags |= O_NONBLOCK;
-    if(fcntl(sock, F_SETFL, flags) == -1) {
-        perror("couldn't set fd flags");
-        return ERROR;
+    conn_t handoff_conn = { .kind = CONN_HANDOFF, .fd = -1 };
+    if(conf.hot_restart != NULL) /* the next server takes over from us */ {
+        handoff_conn.fd = server_listen_unix(conf.hot_restart);
+        if(handoff_conn.fd == -1 || server_watch(main_worker, &handoff_conn, EPOLLIN | EPOLLET) == ERROR) {
+            perror("couldn't add hot restart socket to epoll");
+            return ERROR;
+        }
     }
 
-    // setup list to store all clients
-    struct pollfd* listenfd = (struct pollfd*)malloc(sizeof(struct pollfd)*3);
-    listenfd[0].fd = STDIN_FILENO;
-    listenfd[0].events = POLLIN;
-    listenfd[1].fd = sock;
-    listenfd[1].events = POLLIN;
-    if(use_dis) {
-        listenfd[2].fd = udp_sock;
-        listenfd[2].events = POLLIN;
-    } else {
-        listenfd[2].fd = 0;
-        listenfd[2].events = 0;
+    // SIGUSR1 has to interrupt the wait of the first worker, so the other workers block it
+    sigset_t reset_mask;
+    sigset_t old_mask;
+    sigemptyset(&reset_mask);
+    sigaddset(&reset_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &reset_mask, &old_mask);
+    for(len_t i = 1; i < server.num_workers; i++)
+        pthread_create(&server.workers[i].thread, NULL, server_worker_main, &server.workers[i]);
+    if(server.use_store)
+        pthread_create(&server.store_thread, NULL, server_store_main, &server);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    for(len_t i = 0; i < server.num_links; i++) {
+        server.links[i].dial_timer.data = (uintptr_t)&server.links[i] | TIMER_DIAL;
+        if(server.links[i].conn == NULL) /* otherwise it was taken over */
+            server_dial(main_worker, &server.links[i]);
     }
-    id_t* cids = NULL;
-    len_t cid = 1;
-    len_t num_clients_con = 0;
-
-    bool_t end = 0;
-    char* buffer = (char*)malloc(START_BUFFER_LEN);
-    len_t buffer_len = START_BUFFER_LEN;
-    int len;
 
     // variables to keep track of some stats
-    uint64_t num_messg = 0;
-    uint64_t num_messg_hist = 0;
     time_t start_time = time(NULL);
     uint64_t loops = 0;
+    uint64_t next_dump = 0;
+    // the stats are only kept up to date on a terminal, otherwise the first worker sleeps until something happens
+    bool_t show_stats = isatty(STDERR_FILENO);
+    uint64_t next_stats = 0;
+    atomic_store(&server_reset_requested, 0);
+    struct sigaction reset_action;
+    memset(&reset_action, 0, sizeof(reset_action));
+    reset_action.sa_handler = server_signal_reset;
+    reset_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &reset_action, NULL);
 
-    char* history = (char*)malloc(MAX_HISTORY_SIZE);
-    len_t history_len = 0;
-
-    fprintf(stderr, "\x1b[?25l"); // hide cursor
-    while(!end) {
+    if(show_stats)
+        fprintf(stderr, "\x1b[?25l"); // hide cursor
+    while(!atomic_load(&server.end)) {
         loops++;
-        int sec = time(NULL)-start_time;
-        int min = sec/60;
-        int hou = min/60;
-        int day = hou/24;
-        sec %= 60;
-        min %= 60;
-        hou %= 24;
-        fprintf(stderr, "\x1b[3M"); // clear previous output
-        fprintf(stderr, "uptime: %i days %i hours %i min. %i sec. (%lu)\n", day, hou, min, sec, loops);
-        fprintf(stderr, "number of messages: %lu (%lu)\n", num_messg, num_messg_hist);
-        fprintf(stderr, "number of clients: %lu (%lu)\n", num_clients_con, cid);
-        fprintf(stderr, "\x1b[3A"); // go up 3 lines
-
-        poll(listenfd, 3+num_clients_con, SERVER_CLOCK);
-
-        // accept discovery messages
-        if(use_udp && (listenfd[2].revents & POLLIN)) {
-            struct sockaddr_storage addr;
-            unsigned int addr_len = sizeof(addr);
-            len = recvfrom(udp_sock, buffer, buffer_len, MSG_DONTWAIT, (struct sockaddr*)&addr, &addr_len);
-            if(use_dis && len == 2 && buffer[0] == 'H' && buffer[1] == 'I') /* if we get a discovery package we return ok */ {
-                buffer[0] = 'O';
-                buffer[1] = 'K';
-                sendto(udp_sock, buffer, 2, 0, (struct sockaddr*)&addr, addr_len);
-            }
-        }
-
-        if(listenfd[1].revents & POLLIN) {
-            // accept new client if there is one
-            int new_client = accept(sock, NULL, NULL);
-            if(new_client != -1) {
-                id_t id = cid;
-                // send id to the client
-                for(uint32_t i = 0; i < sizeof(id_t); i++)
-                    buffer[i] = (id >> (8*i)) & 0xff;
-                len = 0;
-                while(len < sizeof(id_t)) {
-                    int tmp_len = send(new_client, buffer+len, sizeof(id_t)-len, 0);
-                    if(tmp_len == -1)
-                        break;
-                    else
-                        len += tmp_len;
-                }
-                // send history to the client
-                len = 0;
-                while(len < history_len) {
-                    uint64_t tmp_len = send(new_client, history+len, history_len-len, 0);
-                    if(tmp_len == -1)
-                        break;
-                    else
-                        len += tmp_len;
-                }
-                num_clients_con++;
-                cids = realloc(cids, sizeof(id_t)*num_clients_con);
-                listenfd = realloc(listenfd, sizeof(struct pollfd)*(3+num_clients_con));
-                cids[num_clients_con-1] = id;
-                cid++;
-                listenfd[3+num_clients_con-1].fd = new_client;
-                listenfd[3+num_clients_con-1].events = POLLIN;
-                listenfd[3+num_clients_con-1].revents = 0;
-            }
+        if(show_stats && main_worker->now >= next_stats) {
+            next_stats = main_worker->now+SERVER_CLOCK;
+            server_print_stats(&server, time(NULL)-start_time, loops);
         }
 
-        // see if anyone wants to send anything
-        for(int i = 0; i < num_clients_con; i++) {
-            if(listenfd[3+i].revents & POLLIN) {
-                len = recv(listenfd[3+i].fd, buffer, sizeof(id_t)+sizeof(len_t), MSG_DONTWAIT);
-                if(len >= 1) {
-                    len += recv(listenfd[3+i].fd, buffer+len, sizeof(id_t)+sizeof(len_t)-len, MSG_WAITALL);
-                    if(len == sizeof(id_t)+sizeof(len_t)) {
-                        len_t len_read = 0;
-                        for(uint32_t j = 0; j < sizeof(len_t); j++)
-                            len_read |= (len_t)(uint8_t)buffer[sizeof(id_t)+j] << (8*j);
-                        while(len_read+len > buffer_len) {
-                            buffer = realloc(buffer, 2*buffer_len);
-                            buffer_len *= 2;
-                        }
-                        len += recv(listenfd[3+i].fd, buffer+len, len_read, MSG_WAITALL);
-                        if(len == sizeof(id_t)+sizeof(len_t)+len_read) {
-                            // add the id to the message
-                            for(uint32_t j = 0; j < sizeof(id_t); j++)
-                                buffer[j] = (cids[i] >> (8*j)) & 0xff;
-                            // forward data to anyone
-                            for(int j = 0; j < num_clients_con; j++) {
-                                int len_send = 0;
-                                while(len_send != len) {
-                                    int tmp_len = send(listenfd[3+j].fd, buffer+len_send, len, 0);
-                                    if(tmp_len == -1) /* error */
-                                        break; // if the connection is closed it is removed at the next recv
-                                    else
-                                        len_send += tmp_len;
-                                }
-                            }
-                            // remove messages from history if needed
-                            if(MAX_HISTORY_SAVE >= len) {
-                                while(history_len+len > MAX_HISTORY_SIZE) {
-                                    len_t len_first = 0;
-                                    for(uint32_t j = 0; j < sizeof(len_t); j++)
-                                        len_first |= (len_t)(uint8_t)history[sizeof(id_t)+j] << (8*j);
-                                    history_len -= sizeof(id_t)+sizeof(len_t)+len_first;
-                                    memmove(history, history+sizeof(id_t)+sizeof(len_t)+len_first, history_len);
-                                    num_messg_hist--;
-                                }
-                                num_messg++;
-                                num_messg_hist++;
-                                // add data to history
-                                memcpy(history+history_len, buffer, len);
-                                history_len += len;
-                            }
-                        } else {
-                            // disconnect client
-                            num_clients_con--;
-                            close(listenfd[3+i].fd);
-                            memmove(listenfd+3+i, listenfd+3+i+1, sizeof(struct pollfd)*(num_clients_con-i));
-                            memmove(cids+i, cids+i+1, sizeof(id_t)*(num_clients_con-i));
-                        }
-                    } else {
-                        // disconnect client
-                        num_clients_con--;
-                        close(listenfd[3+i].fd);
-                        memmove(listenfd+3+i, listenfd+3+i+1, sizeof(struct pollfd)*(num_clients_con-i));
-                        memmove(cids+i, cids+i+1, sizeof(id_t)*(num_clients_con-i));
-                    }
-                } else if(len == 0) {
-                    // disconnect client
-                    num_clients_con--;
-                    close(listenfd[3+i].fd);
-                    memmove(listenfd+3+i, listenfd+3+i+1, sizeof(struct pollfd)*(num_clients_con-i));
-                    memmove(cids+i, cids+i+1, sizeof(id_t)*(num_clients_con-i));
-                } /* else error (EAGAIN || EWOULDBLOCK) */
-            }
+        if(atomic_exchange(&server_reset_requested, 0))
+            server_reset_latency(&server);
+        if(conf.metrics_file != NULL && main_worker->now >= next_dump) {
+            len_t len;
+            char* text = server_format_metrics(&server, &len);
+            metrics_dump(conf.metrics_file, text, len);
+            free(text);
+            next_dump = main_worker->now+SERVER_CLOCK;
         }
+        // wait until the stats or the metrics file have to be updated again
+        uint64_t next = show_stats ? next_stats : UINT64_MAX;
+        if(conf.metrics_file != NULL && next_dump < next)
+            next = next_dump;
+        int timeout = -1;
+        if(next != UINT64_MAX)
+            timeout = next > main_worker->now ? next-main_worker->now : 0;
+        server_poll(main_worker, timeout);
+    }
+    if(show_stats)
+        fprintf(stderr, "\x1b[?25h\x1b[5M"); // show cursor and delete stat output
 
-        if(listenfd[0].revents & POLLIN) {
-            // read stdin
-            len = read(STDIN_FILENO, buffer, buffer_len);
-            if(len >= 1)
-                for(int i = 0; i < len; i++)
-                    if(buffer[i] == 'q' || buffer[i] == 'Q' || buffer[i] == 3 /* <C-c> */) /* exit */ {
-                        end = 1;
-                        break;
-                    }
-        }
-    }
-    fprintf(stderr, "\x1b[?25h\x1b[3M"); // show cursor and delete stat output
-    for(int i = 0; i < num_clients_con; i++)
-        close(listenfd[3+i].fd);
-    free(listenfd);
-    free(cids);
+    bool_t handing_off = server.handoff_fd != -1;
+    if(handing_off)
+        server_quiesce(main_worker);
+    // wake the other workers so they notice the end
+    for(len_t i = 1; i < server.num_workers; i++) {
+        uint64_t one = 1;
+        write(server.workers[i].evfd, &one, sizeof(one));
+    }
+    for(len_t i = 1; i < server.num_workers; i++)
+        pthread_join(server.workers[i].thread, NULL);
+    if(server.use_store) /* the last checkpoint is saved when the log is closed */
+        server_stop_store(&server);
+    if(handing_off && server_handoff(&server) == ERROR)
+        fprintf(stderr, "couldn't hand the connections to the new server\n");
+    for(len_t i = 0; i < server.num_workers; i++)
+        server_free_worker(&server.workers[i]);
+    free(server.workers);
     if(use_udp)
         close(udp_sock);
-    close(sock);
-    free(history);
-    free(buffer);
+    // after a hot restart the paths belong to the successor
+    if(metrics_conn.fd != -1) {
+        close(metrics_conn.fd);
+        if(!handing_off)
+            unlink(conf.metrics_socket);
+    }
+    if(handoff_conn.fd != -1) {
+        close(handoff_conn.fd);
+        if(!handing_off)
+            unlink(conf.hot_restart);
+    }
+    if(handing_off)
+        close(server.handoff_fd);
+    pthread_mutex_destroy(&server.history_lock);
+    pthread_mutex_destroy(&server.group_lock);
+    pthread_cond_destroy(&server.store_cond);
+    free(server.links);
+    dedup_free(&server.seen);
+    group_free(&server.groups);
+    if(server.use_store)
+        server_close_store(&server);
+    server_free_history(&server);
 
     return OK;
 }
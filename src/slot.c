@@ -0,0 +1,59 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "slot.h"
+
+#define SLOT_END ((uint32_t)~0)
+
+// the capacity is allocated up front, so the table only grows if it is exceeded
+void slot_init(slot_table_t* table, len_t cap) {
+    memset(table, 0, sizeof(slot_table_t));
+    table->slots = (slot_t*)malloc(sizeof(slot_t)*cap);
+    table->cap = cap;
+    table->free = SLOT_END;
+}
+
+void slot_free(slot_table_t* table) {
+    free(table->slots);
+    memset(table, 0, sizeof(slot_table_t));
+}
+
+// add the entry to the table, previously freed slots are reused first
+slot_handle_t slot_insert(slot_table_t* table, void* ptr) {
+    uint32_t index;
+    if(table->free != SLOT_END) {
+        index = table->free;
+        table->free = table->slots[index].next;
+    } else {
+        if(table->used == table->cap) /* handles stay valid, they do not point into the table */ {
+            table->cap = table->cap == 0 ? 16 : 2*table->cap;
+            table->slots = (slot_t*)realloc(table->slots, sizeof(slot_t)*table->cap);
+        }
+        index = table->used++;
+        table->slots[index].gen = 1;
+    }
+    table->slots[index].ptr = ptr;
+    table->count++;
+    return ((slot_handle_t)table->slots[index].gen << 32) | index;
+}
+
+// free the slot of the entry, the handle must be valid
+void slot_remove(slot_table_t* table, slot_handle_t handle) {
+    uint32_t index = handle & 0xffffffff;
+    slot_t* slot = &table->slots[index];
+    slot->ptr = NULL;
+    slot->gen = slot->gen == 0xffffffff ? 1 : slot->gen+1;
+    slot->next = table->free;
+    table->free = index;
+    table->count--;
+}
+
+// return the entry of the handle, or NULL if the entry has been removed
+void* slot_get(const slot_table_t* table, slot_handle_t handle) {
+    uint32_t index = handle & 0xffffffff;
+    if(index >= table->used || table->slots[index].gen != handle >> 32)
+        return NULL;
+    return table->slots[index].ptr;
+}
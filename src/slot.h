@@ -0,0 +1,39 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __SLOT_H__
+#define __SLOT_H__
+
+#include "types.h"
+
+// index of the slot in the low 32 bits and its generation in the high 32 bits,
+// the generation changes every time the slot is freed so old handles become invalid
+typedef uint64_t slot_handle_t;
+
+// never returned for a valid entry, the generation starts at one
+#define SLOT_NONE ((slot_handle_t)0)
+
+typedef struct {
+    void* ptr;  // NULL if the slot is free
+    uint32_t gen;
+    uint32_t next;  // next slot in the free list
+} slot_t;
+
+// table of entries that can be added and removed in constant time without moving any other entry
+typedef struct {
+    slot_t* slots;
+    len_t cap;
+    len_t used;     // slots after this have never been used
+    len_t count;    // number of entries in the table
+    uint32_t free;  // first slot of the free list
+} slot_table_t;
+
+void slot_init(slot_table_t* table, len_t cap);
+
+void slot_free(slot_table_t* table);
+
+slot_handle_t slot_insert(slot_table_t* table, void* ptr);
+
+void slot_remove(slot_table_t* table, slot_handle_t handle);
+
+void* slot_get(const slot_table_t* table, slot_handle_t handle);
+
+#endif
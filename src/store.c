@@ -0,0 +1,485 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "store.h"
+#include "hash.h"
+#include "crc_table.h"
+
+// every record is <len:8><seq:8><crc:4><data>, the crc covers the sequence number and the data
+// if the highest bit of the length is set the data starts with <group_len:2><group>, followed by the message
+#define RECORD_HEAD_LEN 20
+#define RECORD_GROUP ((uint64_t)1 << 63)
+#define RECORD_GROUP_LEN 2
+#define SEGMENT_SIZE 67108864
+#define CHECKPOINT_INTERVAL 1048576
+// a checkpoint falls at most this far plus twice the size of the history in memory behind the end of the log,
+// the older messages that are still in memory are saved in a snapshot instead
+#define SNAPSHOT_LAG (4*CHECKPOINT_INTERVAL)
+#define PATH_LEN 4096
+#define CHECKPOINT_FILE "checkpoint"
+#define CHECKPOINT_TMP_FILE "checkpoint.tmp"
+#define SNAPSHOT_TMP_FILE "snapshot.tmp"
+
+static void store_write_u64(uint8_t* buf, uint64_t val) {
+    for(uint32_t i = 0; i < sizeof(uint64_t); i++)
+        buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static uint64_t store_read_u64(const uint8_t* buf) {
+    uint64_t val = 0;
+    for(uint32_t i = 0; i < sizeof(uint64_t); i++)
+        val |= (uint64_t)buf[i] << (8*i);
+    return val;
+}
+
+// continue the crc with more data, the crc of the concatenation is computed by continuing with the inverted result
+static hash32_t store_crc_add(hash32_t crc, const uint8_t* data, len_t len) {
+    hash32_t crc_data = ~crc;
+    for(len_t i = 0; i < len; i++)
+        crc_data = (crc_data >> 8) ^ crc32_table_0x04C11DB7[(crc_data ^ data[i]) & 0xFF];
+    return ~crc_data;
+}
+
+static hash32_t store_crc(const uint8_t* seq, const uint8_t* data, len_t len) {
+    return store_crc_add(hash_crc32(seq, sizeof(uint64_t), crc32_table_0x04C11DB7), data, len);
+}
+
+static void store_segment_path(const store_t* store, len_t base, char* path) {
+    snprintf(path, PATH_LEN, "%s/%016lx.log", store->dir, base);
+}
+
+static void store_snapshot_path(const store_t* store, uint64_t seq, char* path) {
+    snprintf(path, PATH_LEN, "%s/snapshot-%016lx", store->dir, seq);
+}
+
+// write the head of a record, the crc is filled in by store_record_crc, returns the length of the head
+static len_t store_record_head(uint8_t* head, len_t len, uint64_t seq, len_t group_len) {
+    len_t head_len = RECORD_HEAD_LEN;
+    len_t data_len = len;
+    if(group_len != 0) {
+        head[RECORD_HEAD_LEN] = group_len & 0xff;
+        head[RECORD_HEAD_LEN+1] = (group_len >> 8) & 0xff;
+        head_len += RECORD_GROUP_LEN;
+        data_len += RECORD_GROUP_LEN+group_len;
+    }
+    store_write_u64(head, data_len | (group_len != 0 ? RECORD_GROUP : 0));
+    store_write_u64(head+sizeof(uint64_t), seq);
+    return head_len;
+}
+
+static void store_record_crc(uint8_t* head, len_t head_len, const char* group, len_t group_len, const char* msg, len_t len) {
+    hash32_t crc = store_crc(head+sizeof(uint64_t), head+RECORD_HEAD_LEN, head_len-RECORD_HEAD_LEN);
+    crc = store_crc_add(crc, (const uint8_t*)group, group_len);
+    crc = store_crc_add(crc, (const uint8_t*)msg, len);
+    for(uint32_t i = 0; i < sizeof(hash32_t); i++)
+        head[2*sizeof(uint64_t)+i] = (crc >> (8*i)) & 0xff;
+}
+
+// read the offset saved by the last checkpoint and the snapshot it needs, both are 0 if there is none
+// checkpoints written before snapshots existed only hold the offset
+static len_t store_read_checkpoint(const store_t* store, uint64_t* snapshot_seq) {
+    char path[PATH_LEN];
+    snprintf(path, PATH_LEN, "%s/%s", store->dir, CHECKPOINT_FILE);
+    *snapshot_seq = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return 0;
+    uint8_t buf[2*sizeof(uint64_t)+sizeof(hash32_t)];
+    len_t offset = 0;
+    len_t len = read(fd, buf, sizeof(buf));
+    if(len == sizeof(buf) || len == sizeof(uint64_t)+sizeof(hash32_t)) {
+        len_t data_len = len-sizeof(hash32_t);
+        hash32_t crc = 0;
+        for(uint32_t i = 0; i < sizeof(hash32_t); i++)
+            crc |= (hash32_t)buf[data_len+i] << (8*i);
+        if(crc == hash_crc32(buf, data_len, crc32_table_0x04C11DB7)) {
+            offset = store_read_u64(buf);
+            if(data_len == 2*sizeof(uint64_t))
+                *snapshot_seq = store_read_u64(buf+sizeof(uint64_t));
+        }
+    }
+    close(fd);
+    return offset;
+}
+
+// collect the base offsets of all segments in ascending order
+static len_t store_list_segments(const store_t* store, len_t** bases) {
+    len_t num = 0;
+    len_t cap = 0;
+    *bases = NULL;
+    DIR* dir = opendir(store->dir);
+    if(dir == NULL)
+        return 0;
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL) {
+        len_t base;
+        char tail;
+        if(strlen(ent->d_name) == 20 && sscanf(ent->d_name, "%16lx.lo%c", &base, &tail) == 2 && tail == 'g') {
+            if(num == cap) {
+                cap = cap == 0 ? 16 : 2*cap;
+                *bases = (len_t*)realloc(*bases, sizeof(len_t)*cap);
+            }
+            len_t i = num++;
+            while(i > 0 && (*bases)[i-1] > base) {
+                (*bases)[i] = (*bases)[i-1];
+                i--;
+            }
+            (*bases)[i] = base;
+        }
+    }
+    closedir(dir);
+    return num;
+}
+
+// remember the disk offset of the record, needed to find the oldest record still in memory
+static void store_push_pos(store_t* store, uint64_t seq, len_t offset) {
+    if(store->pos_count == store->pos_cap) {
+        len_t new_cap = store->pos_cap == 0 ? 64 : 2*store->pos_cap;
+        store_pos_t* pos = (store_pos_t*)malloc(sizeof(store_pos_t)*new_cap);
+        for(len_t i = 0; i < store->pos_count; i++)
+            pos[i] = store->pos[(store->pos_first+i) % store->pos_cap];
+        free(store->pos);
+        store->pos = pos;
+        store->pos_first = 0;
+        store->pos_cap = new_cap;
+    }
+    store_pos_t* pos = &store->pos[(store->pos_first+store->pos_count) % store->pos_cap];
+    pos->seq = seq;
+    pos->offset = offset;
+    store->pos_count++;
+}
+
+// replay all valid records of the segment starting at the given offset, the records of a snapshot are not indexed
+// returns the offset after the last valid record
+static len_t store_replay_segment(store_t* store, int fd, len_t base, len_t from, bool_t index, store_replay_t replay, void* arg, uint64_t* seq, id_t* max_id) {
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size == 0)
+        return from;
+    len_t size = st.st_size;
+    uint8_t* data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+        return from;
+    len_t pos = from-base;
+    while(pos+RECORD_HEAD_LEN <= size) {
+        uint64_t head = store_read_u64(data+pos);
+        len_t len = head & ~RECORD_GROUP;
+        if(len > size-pos-RECORD_HEAD_LEN || len < sizeof(id_t)+sizeof(len_t))
+            break;
+        const uint8_t* rec_seq = data+pos+sizeof(uint64_t);
+        hash32_t crc = 0;
+        for(uint32_t i = 0; i < sizeof(hash32_t); i++)
+            crc |= (hash32_t)data[pos+2*sizeof(uint64_t)+i] << (8*i);
+        const uint8_t* msg = data+pos+RECORD_HEAD_LEN;
+        if(crc != store_crc(rec_seq, msg, len))
+            break;
+        uint64_t msg_seq = store_read_u64(rec_seq);
+        const uint8_t* group = msg;
+        len_t group_len = 0;
+        if(head & RECORD_GROUP) {
+            group_len = msg[0] | ((len_t)msg[1] << 8);
+            if(RECORD_GROUP_LEN+group_len+sizeof(id_t)+sizeof(len_t) > len)
+                break;
+            group = msg+RECORD_GROUP_LEN;
+            msg += RECORD_GROUP_LEN+group_len;
+        }
+        len_t msg_len = len-(msg-(data+pos+RECORD_HEAD_LEN));
+        id_t id = 0;
+        for(uint32_t i = 0; i < sizeof(id_t); i++)
+            id |= (id_t)msg[i] << (8*i);
+        replay(arg, (const char*)msg, msg_len, msg_seq, (const char*)group, group_len);
+        if(index)
+            store_push_pos(store, msg_seq, base+pos);
+        if(msg_seq > *seq)
+            *seq = msg_seq;
+        if(id > *max_id)
+            *max_id = id;
+        pos += RECORD_HEAD_LEN+len;
+    }
+    munmap(data, size);
+    return base+pos;
+}
+
+// open the log in the directory and give every message to replay, only the records after the
+// last checkpoint have to be read, so the time needed does not depend on the size of the log
+error_t store_open(store_t* store, const char* dir, store_replay_t replay, void* arg, uint64_t* seq, id_t* max_id) {
+    memset(store, 0, sizeof(store_t));
+    store->fd = -1;
+    store->sync_fd = -1;
+    store->dir = strdup(dir);
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("couldn't create history log directory");
+        free(store->dir);
+        return ERROR;
+    }
+    len_t checkpoint = store_read_checkpoint(store, &store->snapshot_seq);
+    char path[PATH_LEN];
+    // the messages of quiet groups that are older than the checkpoint come first
+    if(store->snapshot_seq != 0) {
+        store_snapshot_path(store, store->snapshot_seq, path);
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+            perror("couldn't open history snapshot");
+        else {
+            store_replay_segment(store, fd, 0, 0, 0, replay, arg, seq, max_id);
+            close(fd);
+        }
+    }
+    len_t* bases;
+    len_t num_bases = store_list_segments(store, &bases);
+    len_t end = 0;
+    for(len_t i = 0; i < num_bases; i++) {
+        if(i+1 < num_bases && bases[i+1] <= checkpoint) /* the checkpoint is in a later segment */
+            continue;
+        store_segment_path(store, bases[i], path);
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+            continue;
+        len_t from = bases[i];
+        if(checkpoint > bases[i] && (i+1 == num_bases || checkpoint < bases[i+1]))
+            from = checkpoint;
+        end = store_replay_segment(store, fd, bases[i], from, 1, replay, arg, seq, max_id);
+        close(fd);
+        store->seg_base = bases[i];
+        if(i+1 < num_bases && end != bases[i+1]) /* a torn record, everything after it is lost */ {
+            for(len_t j = i+1; j < num_bases; j++) {
+                store_segment_path(store, bases[j], path);
+                unlink(path);
+            }
+            break;
+        }
+    }
+    free(bases);
+    if(end < store->seg_base)
+        end = store->seg_base;
+    // continue appending at the end of the last valid record
+    store_segment_path(store, store->seg_base, path);
+    store->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if(store->fd == -1 || ftruncate(store->fd, end-store->seg_base) == -1 || lseek(store->fd, 0, SEEK_END) == -1) {
+        perror("couldn't open history log");
+        if(store->fd != -1)
+            close(store->fd);
+        free(store->dir);
+        free(store->pos);
+        return ERROR;
+    }
+    store->end = end;
+    store->last_checkpoint = end;
+    return OK;
+}
+
+// append the message of the group to the log, a new segment is started if the current one is full
+// group names are at most 65535 bytes long, messages without a group are written without one
+error_t store_append(store_t* store, const char* msg, len_t len, uint64_t seq, const char* group, len_t group_len) {
+    if(store->end-store->seg_base >= SEGMENT_SIZE) {
+        char path[PATH_LEN];
+        store_segment_path(store, store->end, path);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1)
+            return ERROR;
+        // the records of the full segment are synced by the next checkpoint
+        if(store->sync_fd != -1) /* only if a whole segment was written since the last one */ {
+            fdatasync(store->sync_fd);
+            close(store->sync_fd);
+        }
+        store->sync_fd = store->fd;
+        store->fd = fd;
+        store->seg_base = store->end;
+    }
+    uint8_t head[RECORD_HEAD_LEN+RECORD_GROUP_LEN];
+    len_t head_len = store_record_head(head, len, seq, group_len);
+    len_t data_len = head_len-RECORD_HEAD_LEN+group_len+len;
+    store_record_crc(head, head_len, group, group_len, msg, len);
+    struct iovec iov[3];
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (void*)group;
+    iov[1].iov_len = group_len;
+    iov[2].iov_base = (void*)msg;
+    iov[2].iov_len = len;
+    if(writev(store->fd, iov, 3) != RECORD_HEAD_LEN+data_len) {
+        // drop the partial record, it would hide all later ones
+        ftruncate(store->fd, store->end-store->seg_base);
+        lseek(store->fd, 0, SEEK_END);
+        return ERROR;
+    }
+    store_push_pos(store, seq, store->end);
+    store->end += RECORD_HEAD_LEN+data_len;
+    return OK;
+}
+
+// enough was appended since the last checkpoint that the next one should be saved
+bool_t store_checkpoint_due(const store_t* store) {
+    return store->end-store->last_checkpoint >= CHECKPOINT_INTERVAL;
+}
+
+// find the offset of the record of oldest, the oldest message since the snapshot that is still kept in memory,
+// recovery starts there, live_bytes is the size of the history in memory
+// if that is too far behind the end of the log, the checkpoint starts at the end and needs a new snapshot holding every
+// message still in memory, the caller adds them with store_snapshot_add while the history is still locked
+// this only needs the store for a moment, the slow part is done by store_checkpoint_save
+void store_checkpoint_take(store_t* store, uint64_t oldest, len_t live_bytes, store_checkpoint_t* checkpoint) {
+    while(store->pos_count > 0 && store->pos[store->pos_first].seq < oldest) {
+        store->pos_first = (store->pos_first+1) % store->pos_cap;
+        store->pos_count--;
+    }
+    checkpoint->offset = store->pos_count == 0 ? store->end : store->pos[store->pos_first].offset;
+    checkpoint->snapshot_seq = store->snapshot_seq;
+    checkpoint->new_snapshot = 0;
+    checkpoint->snapshot = NULL;
+    checkpoint->snapshot_len = 0;
+    checkpoint->snapshot_cap = 0;
+    if(store->end-checkpoint->offset > SNAPSHOT_LAG+2*live_bytes) /* a quiet group holds the checkpoint back */ {
+        // the positions are only dropped once the snapshot was saved, the next checkpoint needs them if it fails
+        checkpoint->snapshot_seq = store->pos[(store->pos_first+store->pos_count-1) % store->pos_cap].seq+1;
+        checkpoint->new_snapshot = 1;
+        checkpoint->offset = store->end;
+    }
+    // the segment might be replaced by store_append while the checkpoint is saved
+    checkpoint->fd = dup(store->fd);
+    checkpoint->sync_fd = store->sync_fd;
+    store->sync_fd = -1;
+    store->last_checkpoint = store->end;
+}
+
+// add a message that is still in memory to the new snapshot of the checkpoint, the messages of a group have to be
+// added in order, returns where the len bytes of the message have to be written
+// the crc of the record is only computed by store_checkpoint_save
+char* store_snapshot_add(store_checkpoint_t* checkpoint, len_t len, uint64_t seq, const char* group, len_t group_len) {
+    len_t need = checkpoint->snapshot_len+RECORD_HEAD_LEN+RECORD_GROUP_LEN+group_len+len;
+    if(need > checkpoint->snapshot_cap) {
+        checkpoint->snapshot_cap = checkpoint->snapshot_cap == 0 ? 65536 : 2*checkpoint->snapshot_cap;
+        if(checkpoint->snapshot_cap < need)
+            checkpoint->snapshot_cap = need;
+        checkpoint->snapshot = (char*)realloc(checkpoint->snapshot, checkpoint->snapshot_cap);
+    }
+    char* record = checkpoint->snapshot+checkpoint->snapshot_len;
+    len_t head_len = store_record_head((uint8_t*)record, len, seq, group_len);
+    memcpy(record+head_len, group, group_len);
+    checkpoint->snapshot_len += head_len+group_len+len;
+    return record+head_len+group_len;
+}
+
+// the segments before the one holding the checkpoint are never read again, neither are other snapshots
+static void store_remove_old(const store_t* store, len_t offset, uint64_t snapshot_seq) {
+    len_t* bases;
+    len_t num_bases = store_list_segments(store, &bases);
+    char path[PATH_LEN];
+    for(len_t i = 0; i+1 < num_bases && bases[i+1] <= offset; i++) {
+        store_segment_path(store, bases[i], path);
+        unlink(path);
+    }
+    free(bases);
+    DIR* dir = opendir(store->dir);
+    if(dir == NULL)
+        return;
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL) {
+        uint64_t seq;
+        if(strlen(ent->d_name) == 25 && sscanf(ent->d_name, "snapshot-%16lx", &seq) == 1 && seq != snapshot_seq) {
+            snprintf(path, PATH_LEN, "%s/%s", store->dir, ent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// write the records of the new snapshot to a file that only becomes visible once it is complete
+static error_t store_save_snapshot(const store_t* store, store_checkpoint_t* checkpoint) {
+    for(len_t pos = 0; pos < checkpoint->snapshot_len;) {
+        uint8_t* head = (uint8_t*)checkpoint->snapshot+pos;
+        uint64_t data_len = store_read_u64(head);
+        len_t group_len = 0;
+        len_t head_len = RECORD_HEAD_LEN;
+        if(data_len & RECORD_GROUP) {
+            group_len = head[RECORD_HEAD_LEN] | ((len_t)head[RECORD_HEAD_LEN+1] << 8);
+            head_len += RECORD_GROUP_LEN;
+        }
+        data_len &= ~RECORD_GROUP;
+        len_t len = RECORD_HEAD_LEN+data_len-head_len-group_len;
+        store_record_crc(head, head_len, (const char*)head+head_len, group_len, (const char*)head+head_len+group_len, len);
+        pos += RECORD_HEAD_LEN+data_len;
+    }
+    char path[PATH_LEN];
+    char tmp_path[PATH_LEN];
+    store_snapshot_path(store, checkpoint->snapshot_seq, path);
+    snprintf(tmp_path, PATH_LEN, "%s/%s", store->dir, SNAPSHOT_TMP_FILE);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+        return ERROR;
+    if(write(fd, checkpoint->snapshot, checkpoint->snapshot_len) != checkpoint->snapshot_len || fsync(fd) == -1) {
+        close(fd);
+        return ERROR;
+    }
+    close(fd);
+    if(rename(tmp_path, path) == -1)
+        return ERROR;
+    return OK;
+}
+
+// make the checkpoint durable and remove the segments it no longer needs
+// besides the directory of the store only the snapshot sequence number is used, which only the thread saving
+// the checkpoints changes, it can be called while others append to the store
+error_t store_checkpoint_save(store_t* store, store_checkpoint_t* checkpoint) {
+    // the data is synced before the checkpoint becomes visible
+    if(checkpoint->sync_fd != -1) {
+        fdatasync(checkpoint->sync_fd);
+        close(checkpoint->sync_fd);
+        checkpoint->sync_fd = -1;
+    }
+    error_t ret = OK;
+    if(checkpoint->new_snapshot)
+        ret = store_save_snapshot(store, checkpoint);
+    free(checkpoint->snapshot);
+    checkpoint->snapshot = NULL;
+    if(checkpoint->fd == -1 || ret == ERROR) {
+        if(checkpoint->fd != -1)
+            close(checkpoint->fd);
+        checkpoint->fd = -1;
+        return ERROR;
+    }
+    fdatasync(checkpoint->fd);
+    close(checkpoint->fd);
+    checkpoint->fd = -1;
+    uint8_t buf[2*sizeof(uint64_t)+sizeof(hash32_t)];
+    store_write_u64(buf, checkpoint->offset);
+    store_write_u64(buf+sizeof(uint64_t), checkpoint->snapshot_seq);
+    hash32_t crc = hash_crc32(buf, 2*sizeof(uint64_t), crc32_table_0x04C11DB7);
+    for(uint32_t i = 0; i < sizeof(hash32_t); i++)
+        buf[2*sizeof(uint64_t)+i] = (crc >> (8*i)) & 0xff;
+    char path[PATH_LEN];
+    char tmp_path[PATH_LEN];
+    snprintf(path, PATH_LEN, "%s/%s", store->dir, CHECKPOINT_FILE);
+    snprintf(tmp_path, PATH_LEN, "%s/%s", store->dir, CHECKPOINT_TMP_FILE);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+        return ERROR;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) == -1) {
+        close(fd);
+        return ERROR;
+    }
+    close(fd);
+    if(rename(tmp_path, path) == -1)
+        return ERROR;
+    store->snapshot_seq = checkpoint->snapshot_seq;
+    store_remove_old(store, checkpoint->offset, checkpoint->snapshot_seq);
+    return OK;
+}
+
+// the last checkpoint has to be saved before
+void store_close(store_t* store) {
+    close(store->fd);
+    free(store->dir);
+    free(store->pos);
+    memset(store, 0, sizeof(store_t));
+    store->fd = -1;
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include "types.h"
+
+// disk offset of a record that is still part of the history in memory
+typedef struct {
+    uint64_t seq;
+    len_t offset;
+} store_pos_t;
+
+// append-only log of all messages added to the history, split into segment files
+typedef struct {
+    char* dir;
+    int fd;             // segment that is appended to
+    int sync_fd;        // previous segment, synced and closed by the next checkpoint, -1 if none
+    len_t seg_base;     // offset of the first byte of the current segment
+    len_t end;          // offset at which the next record is written
+    len_t last_checkpoint;
+    // the messages before it that were still in memory are in the snapshot of the last checkpoint, 0 if there is none
+    uint64_t snapshot_seq;
+    // offsets of the records that might still be in memory, used to find the checkpoint
+    store_pos_t* pos;
+    len_t pos_first;
+    len_t pos_count;
+    len_t pos_cap;
+} store_t;
+
+// a checkpoint taken while the history is locked, written to disk afterwards without the lock
+typedef struct {
+    len_t offset;       // recovery starts here
+    uint64_t snapshot_seq;  // the older messages are replayed from the snapshot first, 0 if there is none
+    bool_t new_snapshot;    // the snapshot is saved with the checkpoint, otherwise the last one is kept
+    char* snapshot;     // records of the new snapshot
+    len_t snapshot_len;
+    len_t snapshot_cap;
+    int fd;             // copy of the segment descriptor, synced before the checkpoint is saved
+    int sync_fd;        // previous segment that has to be synced too, -1 if none
+} store_checkpoint_t;
+
+// called for every message replayed from the log, the group is empty for messages without a group
+typedef void (*store_replay_t)(void* arg, const char* msg, len_t len, uint64_t seq, const char* group, len_t group_len);
+
+error_t store_open(store_t* store, const char* dir, store_replay_t replay, void* arg, uint64_t* seq, id_t* max_id);
+
+error_t store_append(store_t* store, const char* msg, len_t len, uint64_t seq, const char* group, len_t group_len);
+
+bool_t store_checkpoint_due(const store_t* store);
+
+void store_checkpoint_take(store_t* store, uint64_t oldest, len_t live_bytes, store_checkpoint_t* checkpoint);
+
+char* store_snapshot_add(store_checkpoint_t* checkpoint, len_t len, uint64_t seq, const char* group, len_t group_len);
+
+error_t store_checkpoint_save(store_t* store, store_checkpoint_t* checkpoint);
+
+void store_close(store_t* store);
+
+#endif
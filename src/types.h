@@ -9,6 +9,8 @@
 #define NO_DATA 4
 #define CONNECTION_CLOSED 2
 #define ENC_DATA 3
+#define TOO_LARGE 5
+#define CTRL_DATA 6 // a control message or sequence number from the server
 
 typedef int32_t error_t;
 typedef uint16_t bool_t;
@@ -20,6 +22,18 @@ typedef uint8_t hash512_t[64];
 typedef uint8_t data256_t[32];
 typedef uint8_t data512_t[64];
 
+// id used by clients for control messages, they are handled by the server and never forwarded
+#define CTRL_ID ((id_t)~0)
+// id used by clients for ephemeral messages (e.g. typing info), the server forwards them with the id of the client
+// like any other message, but never stores them and only keeps the latest one of every sender in a queue
+#define EPHEMERAL_ID ((id_t)~1)
+// id used between federated servers, the message carries the origin and sequence number of a message of another server
+#define PEER_ID ((id_t)~2)
+// id of the message the server sends before every message to clients that asked for sequence numbers,
+// its body is the sequence number of the message that follows
+#define SEQ_ID ((id_t)~3)
+#define SEQ_MSG_LEN (sizeof(id_t)+sizeof(len_t)+sizeof(uint64_t))
+
 #define FLAG_MSG_ENC 1
 #define FLAG_MSG_TYP 2
 #define FLAG_MSG_ENT 4
@@ -33,6 +47,7 @@ typedef struct {
     data512_t key;
     char* name;        // username
     char* group;    // groupname
+    uint64_t seq;   // sequence number of the server, zero if it was not sent with the message
     len_t data_len;
     char* data;
 } msgbuf_t;
@@ -48,6 +63,16 @@ typedef struct {
 #define FLAG_CONF_USE_ENC 128
 #define FLAG_CONF_USE_TYP 256
 #define FLAG_CONF_USE_LOG 512
+#define FLAG_CONF_IO_URING 1024
+
+// what the server does with clients that can not keep up
+#define SLOW_POLICY_DROP 0          // drop ephemeral messages
+#define SLOW_POLICY_SKIP 1          // drop everything but the latest message
+#define SLOW_POLICY_DISCONNECT 2    // disconnect the client
+
+// what the server does with messages of clients that exceed their rate limit
+#define RATE_POLICY_QUEUE 0     // stop reading from the client until it may send again
+#define RATE_POLICY_REJECT 1    // drop the messages
 
 int strfndchr(const char* str, char c);
 
@@ -58,6 +83,36 @@ typedef struct {
     char* host;
     char* passwd;
     uint16_t port;
+    uint16_t threads;   // number of server workers
+    char* history_log;  // directory of the persistent history log
+    // budget of the history of every group, the oldest messages of a group are evicted once it exceeds
+    // either of them, zero messages means there is no limit on the number of messages
+    len_t history_bytes;
+    len_t history_entries;
+    len_t history_total;    // bytes of the histories of all groups together
+    len_t max_groups;   // clients and peers can not create more groups
+    uint8_t slow_policy;
+    len_t queue_high;   // high and low watermark of the outbound queues in bytes
+    len_t queue_low;
+    uint64_t queue_age; // maximum age of the oldest queued message in milliseconds
+    char* metrics_socket;   // unix socket the metrics are served on
+    char* metrics_file;     // file the metrics are written to every second
+    char* hot_restart;      // unix socket a new server connects to to take over the connections
+    len_t max_frame;    // largest message in bytes that is accepted, larger ones are never buffered
+    // limits of every client per second, zero if there is no limit
+    uint64_t rate_frames;
+    uint64_t rate_bytes;
+    uint64_t rate_large;    // bytes of large messages, they are not counted in rate_bytes
+    uint8_t rate_policy;
+    // connections that answer heartbeats get one after this many milliseconds without receiving anything,
+    // and are closed after the idle timeout, zero disables either of them
+    uint64_t heartbeat;
+    uint64_t idle_timeout;
+    uint64_t flush_delay;   // milliseconds the outbound queues wait for more frames before they are written
+    uint8_t node;   // number of the server in a federation, the ids of its clients start at node << 24
+    char** peers;   // "host:port" of the other servers of the federation
+    len_t num_peers;
+    char* peer_secret;  // the servers of a federation prove with it that they are one of the peers
 } config_t;
 
 typedef struct {
@@ -0,0 +1,309 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// the kernel interface is used directly, build with -DNO_IO_URING to leave it out
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+
+#define URING_BUFFER_GROUP 0
+
+// every feature we need is available since linux 6.0, linked files were added in 6.3
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_LINKED_FILE)
+
+struct uring_s {
+    int fd;
+    void* ring_mem;
+    len_t ring_size;
+    // submission queue
+    struct io_uring_sqe* sqes;
+    len_t sqes_size;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail;     // entries after the shared tail are prepared but not yet visible to the kernel
+    uint32_t sq_pending;        // entries that are visible but not yet submitted
+    // completion queue
+    struct io_uring_cqe* cqes;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    // provided buffers used by multishot receives
+    struct io_uring_buf_ring* bufs;
+    len_t bufs_size;
+    char* buf_data;
+    uint32_t num_buffers;
+    uint32_t buffer_size;
+    uint16_t buf_tail;
+};
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void* arg, len_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+// hand the buffer back to the kernel
+static void uring_add_buffer(uring_t* ring, uint32_t id) {
+    struct io_uring_buf* buf = &ring->bufs->bufs[ring->buf_tail & (ring->num_buffers-1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buf_data+(len_t)id*ring->buffer_size);
+    buf->len = ring->buffer_size;
+    buf->bid = id;
+    ring->buf_tail++;
+}
+
+// returns NULL if the kernel does not support io_uring or any of the features we need,
+// num_buffers has to be a power of two
+uring_t* uring_create(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd == -1)
+        return NULL;
+    if((params.features & URING_FEATURES) != URING_FEATURES) {
+        close(fd);
+        return NULL;
+    }
+    uring_t* ring = (uring_t*)calloc(1, sizeof(uring_t));
+    ring->fd = fd;
+    // the submission and completion queue share a single mapping
+    len_t sq_size = params.sq_off.array+params.sq_entries*sizeof(uint32_t);
+    len_t cq_size = params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->bufs_size = num_buffers*sizeof(struct io_uring_buf);
+    ring->bufs = (struct io_uring_buf_ring*)mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED || ring->bufs == MAP_FAILED) {
+        if(ring->ring_mem != MAP_FAILED)
+            munmap(ring->ring_mem, ring->ring_size);
+        if(ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        if(ring->bufs != MAP_FAILED)
+            munmap(ring->bufs, ring->bufs_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    char* mem = (char*)ring->ring_mem;
+    ring->sq_head = (uint32_t*)(mem+params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(mem+params.sq_off.tail);
+    ring->sq_mask = *(uint32_t*)(mem+params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    uint32_t* sq_array = (uint32_t*)(mem+params.sq_off.array);
+    for(uint32_t i = 0; i < params.sq_entries; i++) /* entries are always used in order */
+        sq_array[i] = i;
+    ring->cq_head = (uint32_t*)(mem+params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(mem+params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(mem+params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(mem+params.cq_off.cqes);
+    // register the receive buffers
+    ring->num_buffers = num_buffers;
+    ring->buffer_size = buffer_size;
+    ring->buf_data = (char*)malloc((len_t)num_buffers*buffer_size);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufs;
+    reg.ring_entries = num_buffers;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        uring_destroy(ring);
+        return NULL;
+    }
+    for(uint32_t i = 0; i < num_buffers; i++)
+        uring_add_buffer(ring, i);
+    __atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    return ring;
+}
+
+// closing the ring cancels every operation that is still active
+void uring_destroy(uring_t* ring) {
+    close(ring->fd);
+    munmap(ring->ring_mem, ring->ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->bufs, ring->bufs_size);
+    free(ring->buf_data);
+    free(ring);
+}
+
+// make the prepared entries visible to the kernel and submit them
+static void uring_submit(uring_t* ring, uint32_t min_complete, uint32_t flags, void* arg, len_t arg_size) {
+    ring->sq_pending += ring->sq_local_tail-*ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int ret = uring_enter(ring->fd, ring->sq_pending, min_complete, flags, arg, arg_size);
+    if(ret > 0)
+        ring->sq_pending -= ret;
+}
+
+// reserve count submission entries, the queue is submitted first if there is not enough space
+static struct io_uring_sqe* uring_get_sqes(uring_t* ring, uint32_t count) {
+    while(ring->sq_local_tail+count-__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_entries)
+        uring_submit(ring, 0, 0, NULL, 0);
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    for(uint32_t i = 0; i < count; i++)
+        memset(&ring->sqes[(ring->sq_local_tail+i) & ring->sq_mask], 0, sizeof(struct io_uring_sqe));
+    ring->sq_local_tail += count;
+    return sqe;
+}
+
+// accept connections until the operation is canceled, new sockets are nonblocking
+void uring_accept(uring_t* ring, int sock, uint64_t data) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, 1);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = data;
+}
+
+// complete every time the file becomes readable
+void uring_poll(uring_t* ring, int fd, uint64_t data) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, 1);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = data;
+}
+
+// receive into the provided buffers every time data arrives
+void uring_recv(uring_t* ring, int sock, uint64_t data) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, 1);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = data;
+}
+
+// the message has to stay valid until the next call of uring_wait, the data it points to until the operation completed
+// if wait_writable is set the send is linked to a poll, so it starts only once the socket is writable
+void uring_sendmsg(uring_t* ring, int sock, const struct msghdr* msg, bool_t wait_writable, uint64_t data) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, wait_writable ? 2 : 1);
+    if(wait_writable) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = sock;
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe = &ring->sqes[(ring->sq_local_tail-1) & ring->sq_mask];
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = data;
+}
+
+// cancel every operation on the file, they complete with -ECANCELED
+void uring_cancel(uring_t* ring, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, 1);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = 0;
+}
+
+// cancel the operation that was submitted with the given data, it completes with -ECANCELED
+void uring_cancel_op(uring_t* ring, uint64_t data) {
+    struct io_uring_sqe* sqe = uring_get_sqes(ring, 1);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = 0;
+}
+
+// submit everything that was prepared and wait until an operation completes or timeout milliseconds passed,
+// a negative timeout waits until an operation completes
+void uring_wait(uring_t* ring, int timeout) {
+    if(timeout == 0 || *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        uring_submit(ring, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    } else {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (timeout%1000)*1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG/8;
+        arg.ts = timeout < 0 ? 0 : (uint64_t)(uintptr_t)&ts;
+        uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+}
+
+// take the next completion from the queue, returns false if there is none
+bool_t uring_next(uring_t* ring, uring_event_t* event) {
+    uint32_t head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+    event->data = cqe->user_data;
+    event->res = cqe->res;
+    event->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    event->buffer = (cqe->flags & IORING_CQE_F_BUFFER) ? (int32_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    __atomic_store_n(ring->cq_head, head+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+const char* uring_buffer(const uring_t* ring, int32_t buffer) {
+    return ring->buf_data+(len_t)buffer*ring->buffer_size;
+}
+
+// the data of the buffer was consumed, it can be used for the next receive
+void uring_release(uring_t* ring, int32_t buffer) {
+    uring_add_buffer(ring, buffer);
+    __atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+#else
+
+// without io_uring support creating an instance always fails, so nothing else is ever called
+uring_t* uring_create(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size) {
+    return NULL;
+}
+
+void uring_destroy(uring_t* ring) { }
+
+void uring_accept(uring_t* ring, int sock, uint64_t data) { }
+
+void uring_poll(uring_t* ring, int fd, uint64_t data) { }
+
+void uring_recv(uring_t* ring, int sock, uint64_t data) { }
+
+void uring_sendmsg(uring_t* ring, int sock, const struct msghdr* msg, bool_t wait_writable, uint64_t data) { }
+
+void uring_cancel(uring_t* ring, int fd) { }
+
+void uring_cancel_op(uring_t* ring, uint64_t data) { }
+
+void uring_wait(uring_t* ring, int timeout) { }
+
+bool_t uring_next(uring_t* ring, uring_event_t* event) {
+    return 0;
+}
+
+const char* uring_buffer(const uring_t* ring, int32_t buffer) {
+    return NULL;
+}
+
+void uring_release(uring_t* ring, int32_t buffer) { }
+
+#endif
@@ -0,0 +1,45 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/socket.h>
+
+#include "types.h"
+
+// completion of an operation, data is the value given when the operation was submitted
+typedef struct {
+    uint64_t data;
+    int32_t res;        // result of the operation, a negative errno on failure
+    bool_t more;        // a multishot operation stays active and will complete again
+    int32_t buffer;     // provided buffer holding the received data, -1 if there is none
+} uring_event_t;
+
+// io_uring instance with a ring of provided receive buffers, operations are only
+// submitted to the kernel by uring_wait, so everything prepared in a loop iteration needs a single syscall
+typedef struct uring_s uring_t;
+
+uring_t* uring_create(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size);
+
+void uring_destroy(uring_t* ring);
+
+void uring_accept(uring_t* ring, int sock, uint64_t data);
+
+void uring_poll(uring_t* ring, int fd, uint64_t data);
+
+void uring_recv(uring_t* ring, int sock, uint64_t data);
+
+void uring_sendmsg(uring_t* ring, int sock, const struct msghdr* msg, bool_t wait_writable, uint64_t data);
+
+void uring_cancel(uring_t* ring, int fd);
+
+void uring_cancel_op(uring_t* ring, uint64_t data);
+
+void uring_wait(uring_t* ring, int timeout);
+
+bool_t uring_next(uring_t* ring, uring_event_t* event);
+
+const char* uring_buffer(const uring_t* ring, int32_t buffer);
+
+void uring_release(uring_t* ring, int32_t buffer);
+
+#endif
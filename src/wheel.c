@@ -0,0 +1,134 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <string.h>
+
+#include "wheel.h"
+
+void wheel_init(wheel_t* wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(wheel_t));
+    wheel->tick = now;
+}
+
+// put the timer into the slot its time falls into, the level depends on how far away it is from the next tick
+static void wheel_insert(wheel_t* wheel, wheel_timer_t* timer) {
+    uint64_t expires = timer->expires > wheel->tick ? timer->expires : wheel->tick;
+    uint64_t delta = expires-wheel->tick;
+    len_t level = 0;
+    while(level+1 < WHEEL_LEVELS && delta >= (uint64_t)1 << (WHEEL_BITS*(level+1)))
+        level++;
+    if(delta >= (uint64_t)1 << (WHEEL_BITS*WHEEL_LEVELS)) /* beyond the last level, it is moved down again when its slot comes up */
+        expires = wheel->tick+((uint64_t)1 << (WHEEL_BITS*WHEEL_LEVELS))-1;
+    len_t slot = (expires >> (WHEEL_BITS*level)) & (WHEEL_SLOTS-1);
+    wheel_timer_t** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if(*head != NULL)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = level*WHEEL_SLOTS+slot;
+    wheel->used[level] |= (uint64_t)1 << slot;
+    wheel->count++;
+}
+
+// move the timers of a slot of a coarser level down, they are all closer than the range of that level now
+static void wheel_cascade(wheel_t* wheel, len_t level, len_t slot) {
+    wheel_timer_t* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->used[level] &= ~((uint64_t)1 << slot);
+    while(timer != NULL) {
+        wheel_timer_t* next = timer->next;
+        wheel->count--;
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+// a timer that is already scheduled is moved, a time in the past expires with the next tick
+void wheel_schedule(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires) {
+    wheel_cancel(wheel, timer);
+    timer->expires = expires;
+    wheel_insert(wheel, timer);
+}
+
+// does nothing if the timer is not scheduled
+void wheel_cancel(wheel_t* wheel, wheel_timer_t* timer) {
+    if(timer->pprev == NULL)
+        return;
+    *timer->pprev = timer->next;
+    if(timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+    len_t level = timer->slot/WHEEL_SLOTS;
+    len_t slot = timer->slot%WHEEL_SLOTS;
+    if(wheel->slots[level][slot] == NULL)
+        wheel->used[level] &= ~((uint64_t)1 << slot);
+    wheel->count--;
+}
+
+bool_t wheel_active(const wheel_timer_t* timer) {
+    return timer->pprev != NULL;
+}
+
+// earliest time at which wheel_advance has something to do, UINT64_MAX if no timer is scheduled
+// for the coarser levels this is the time their next slot is moved down, which may be before any timer expires
+uint64_t wheel_next(const wheel_t* wheel) {
+    uint64_t next = UINT64_MAX;
+    if(wheel->count == 0)
+        return next;
+    for(len_t level = 0; level < WHEEL_LEVELS; level++) {
+        if(wheel->used[level] == 0)
+            continue;
+        len_t shift = WHEEL_BITS*level;
+        len_t pos = (wheel->tick >> shift) & (WHEEL_SLOTS-1);
+        len_t start = pos;
+        if((wheel->tick & (((uint64_t)1 << shift)-1)) != 0) /* the current slot of the level only comes up in its next round */
+            start++;
+        uint64_t ahead = start < WHEEL_SLOTS ? wheel->used[level] >> start : 0;
+        len_t slot = ahead != 0 ? start+__builtin_ctzll(ahead) : WHEEL_SLOTS+__builtin_ctzll(wheel->used[level]);
+        uint64_t time = ((wheel->tick >> shift)+slot-pos) << shift;
+        if(time < next)
+            next = time;
+    }
+    return next;
+}
+
+// call expired for every timer that expired up to now, the timer is no longer scheduled when it is called
+// and can be scheduled again, empty slots and rounds are skipped so a long idle period takes only a few steps
+void wheel_advance(wheel_t* wheel, uint64_t now, void (*expired)(void* arg, wheel_timer_t* timer), void* arg) {
+    while(wheel->tick <= now) {
+        len_t index = wheel->tick & (WHEEL_SLOTS-1);
+        if(index == 0) /* the next slot of every coarser level whose round is complete comes up */ {
+            for(len_t level = 1; level < WHEEL_LEVELS; level++) {
+                len_t slot = (wheel->tick >> (WHEEL_BITS*level)) & (WHEEL_SLOTS-1);
+                wheel_cascade(wheel, level, slot);
+                if(slot != 0)
+                    break;
+            }
+        }
+        uint64_t ahead = wheel->used[0] >> index;
+        if(ahead == 0) /* nothing left in this round of the first level */ {
+            uint64_t end = (wheel->tick | (WHEEL_SLOTS-1))+1;
+            if(wheel->used[0] == 0 && wheel_next(wheel) > end) /* skip the rounds until a coarser level has something to move down */
+                end = wheel_next(wheel);
+            wheel->tick = end <= now ? end : now+1;
+            continue;
+        }
+        uint64_t tick = wheel->tick+__builtin_ctzll(ahead);
+        if(tick > now) {
+            wheel->tick = now+1;
+            break;
+        }
+        // take the whole slot first, timers scheduled again by the callback go into later ticks
+        index = tick & (WHEEL_SLOTS-1);
+        wheel_timer_t* list = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        wheel->used[0] &= ~((uint64_t)1 << index);
+        list->pprev = &list;
+        wheel->tick = tick+1;
+        while(list != NULL) {
+            wheel_timer_t* timer = list;
+            wheel_cancel(wheel, timer);
+            expired(arg, timer);
+        }
+    }
+}
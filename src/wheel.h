@@ -0,0 +1,41 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include "types.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)   // slots of every level, a level covers WHEEL_SLOTS times the previous one
+#define WHEEL_LEVELS 4  // with millisecond ticks the last level reaches about 4.6 hours, later timers are clamped
+
+// timer that is part of the struct it belongs to, so scheduling it never allocates
+typedef struct wheel_timer_s {
+    struct wheel_timer_s* next;
+    struct wheel_timer_s** pprev;   // NULL if the timer is not scheduled
+    uint64_t expires;   // time in milliseconds
+    uint16_t slot;      // level*WHEEL_SLOTS+slot the timer is in
+    uint64_t data;      // given to the callback, like the data of io_uring operations
+} wheel_timer_t;
+
+// hierarchical timer wheel, timers far in the future are kept in a coarse level and moved down
+// as their time comes closer, so scheduling and canceling take constant time
+typedef struct {
+    wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t used[WHEEL_LEVELS];    // bit i is set if slot i of the level holds a timer
+    uint64_t tick;  // next millisecond that has not been handled
+    len_t count;
+} wheel_t;
+
+void wheel_init(wheel_t* wheel, uint64_t now);
+
+void wheel_schedule(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires);
+
+void wheel_cancel(wheel_t* wheel, wheel_timer_t* timer);
+
+bool_t wheel_active(const wheel_timer_t* timer);
+
+uint64_t wheel_next(const wheel_t* wheel);
+
+void wheel_advance(wheel_t* wheel, uint64_t now, void (*expired)(void* arg, wheel_timer_t* timer), void* arg);
+
+#endif
@@ -0,0 +1,17 @@
+// Copyright (c) 2019 Roland Bernard
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+// every failed check is reported, the test program fails if any of them did
+static int test_failed = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failed = 1; \
+    } \
+} while(0)
+
+#endif
@@ -0,0 +1,56 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include "test.h"
+#include "../src/dedup.h"
+
+// every sequence number passes once, in any order within the window
+static void test_window() {
+    dedup_table_t table;
+    dedup_init(&table);
+    CHECK(dedup_check(&table, 1, 5));
+    CHECK(!dedup_check(&table, 1, 5));
+    CHECK(dedup_check(&table, 1, 3));
+    CHECK(dedup_check(&table, 1, 4));
+    CHECK(!dedup_check(&table, 1, 3));
+    CHECK(dedup_check(&table, 1, 1));
+    // other origins have their own window
+    CHECK(dedup_check(&table, 2, 5));
+    CHECK(dedup_check(&table, 2, 3));
+    CHECK(!dedup_check(&table, 2, 5));
+    // shifts by whole words and by bits that cross a word
+    for(uint64_t seq = 6; seq < 6+3*DEDUP_WINDOW; seq += 61) {
+        CHECK(dedup_check(&table, 1, seq));
+        CHECK(!dedup_check(&table, 1, seq));
+        if(seq >= 64+6) {
+            CHECK(!dedup_check(&table, 1, seq-61));
+            CHECK(dedup_check(&table, 1, seq-60));
+            CHECK(!dedup_check(&table, 1, seq-60));
+        }
+    }
+    dedup_free(&table);
+}
+
+// sequence numbers older than the window count as seen, a jump past it forgets everything
+static void test_old() {
+    dedup_table_t table;
+    dedup_init(&table);
+    CHECK(dedup_check(&table, 7, DEDUP_WINDOW));
+    CHECK(dedup_check(&table, 7, 1));
+    CHECK(!dedup_check(&table, 7, 1));
+    CHECK(dedup_check(&table, 7, DEDUP_WINDOW+1));
+    CHECK(!dedup_check(&table, 7, 1));
+    CHECK(dedup_check(&table, 7, 2));
+    CHECK(dedup_check(&table, 7, 10*DEDUP_WINDOW));
+    CHECK(!dedup_check(&table, 7, DEDUP_WINDOW+1));
+    CHECK(!dedup_check(&table, 7, 9*DEDUP_WINDOW));
+    CHECK(dedup_check(&table, 7, 9*DEDUP_WINDOW+1));
+    CHECK(dedup_check(&table, 7, 10*DEDUP_WINDOW-1));
+    CHECK(!dedup_check(&table, 7, 10*DEDUP_WINDOW-1));
+    dedup_free(&table);
+}
+
+int main() {
+    test_window();
+    test_old();
+    return test_failed;
+}
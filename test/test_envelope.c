@@ -0,0 +1,102 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <string.h>
+
+#include "test.h"
+#include "../src/envelope.h"
+
+// head and payload of the envelope written into out, returns its size
+static len_t test_envelope(char* out, uint32_t group, uint64_t seq, id_t id, const char* payload, len_t payload_len) {
+    envelope_t env;
+    env.type = ENVELOPE_MSG;
+    env.flags = ENVELOPE_EPHEMERAL;
+    env.group = group;
+    env.seq = seq;
+    env.id = id;
+    env.payload_len = payload_len;
+    len_t head_len = envelope_head(out, &env);
+    CHECK(head_len <= ENVELOPE_MAX_HEAD);
+    memcpy(out+head_len, payload, payload_len);
+    return head_len+payload_len;
+}
+
+// every field comes back, also at the edges of the varint lengths and at their largest values
+static void test_roundtrip() {
+    static const uint64_t values[] = { 0, 1, 127, 128, 16383, 16384, 0xffffffff, 0x100000000ULL, ~0ULL };
+    char data[ENVELOPE_MAX_HEAD+200];
+    char payload[200];
+    memset(payload, 'p', sizeof(payload));
+    for(len_t i = 0; i < sizeof(values)/sizeof(values[0]); i++) {
+        for(len_t j = 0; j < sizeof(values)/sizeof(values[0]); j++) {
+            uint32_t group = values[i] > 0xffffffff ? 0xffffffff : values[i];
+            id_t id = values[j] > (id_t)~0 ? (id_t)~0 : values[j];
+            len_t payload_len = (i*7+j) % 200;
+            len_t len = test_envelope(data, group, values[j], id, payload, payload_len);
+            CHECK(envelope_size(data, len) == len);
+            envelope_t env;
+            CHECK(envelope_parse(data, len, &env) == OK);
+            CHECK(env.type == ENVELOPE_MSG && env.flags == ENVELOPE_EPHEMERAL);
+            CHECK(env.group == group && env.seq == values[j] && env.id == id);
+            CHECK(env.payload_len == payload_len && env.payload+payload_len == data+len);
+        }
+    }
+}
+
+// the size is only known once the length is complete, the head only once all its fields are
+static void test_incomplete() {
+    char data[ENVELOPE_MAX_HEAD+300];
+    char payload[300];
+    memset(payload, 'p', sizeof(payload));
+    len_t len = test_envelope(data, 5, 1ULL << 40, 7, payload, sizeof(payload));
+    // 300 bytes of payload need two bytes for the length
+    CHECK(envelope_size(data, 1) == 0);
+    CHECK(envelope_size(data, 2) == len);
+    envelope_t env;
+    len_t head_len = len-sizeof(payload);
+    for(len_t i = 0; i < head_len; i++)
+        CHECK(envelope_parse_head(data, i, &env) == ERROR);
+    CHECK(envelope_parse_head(data, head_len, &env) == OK);
+    CHECK(env.payload_len == sizeof(payload));
+    // a complete envelope has to end where the data does
+    CHECK(envelope_parse(data, len-1, &env) == ERROR);
+    CHECK(envelope_parse(data, len+1, &env) == ERROR);
+}
+
+// lengths and fields that can not be right are rejected
+static void test_malformed() {
+    char data[32];
+    memset(data, 0x80, sizeof(data));
+    // a length that never ends is too large, a short prefix of it is not yet complete
+    CHECK(envelope_size(data, 9) == 0);
+    CHECK(envelope_size(data, sizeof(data)) == ~(len_t)0);
+    envelope_t env;
+    CHECK(envelope_parse_head(data, sizeof(data), &env) == ERROR);
+    // the group and the id do not fit their fields
+    char big[ENVELOPE_MAX_HEAD];
+    len_t len = 0;
+    big[len++] = 12;
+    big[len++] = ENVELOPE_MSG;
+    big[len++] = 0;
+    memcpy(big+len, "\x80\x80\x80\x80\x10", 5);  // 2^32
+    len += 5;
+    big[len++] = 1;
+    big[len++] = 1;
+    big[len++] = 'x';
+    big[len++] = 'x';
+    big[len++] = 'x';
+    CHECK(envelope_parse(big, len, &env) == ERROR);
+    memcpy(big+3, "\x01\x01\x80\x80\x80\x80\x10", 7);
+    CHECK(envelope_parse(big, len, &env) == ERROR);
+    memcpy(big+3, "\x01\x01\x01\x78\x78\x78\x78", 7);
+    CHECK(envelope_parse(big, len, &env) == OK);
+    // the fields may not go past the length
+    big[0] = 3;
+    CHECK(envelope_parse_head(big, len, &env) == ERROR);
+}
+
+int main() {
+    test_roundtrip();
+    test_incomplete();
+    test_malformed();
+    return test_failed;
+}
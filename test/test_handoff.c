@@ -0,0 +1,117 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "../src/handoff.h"
+
+// more than fit into a single message
+#define NUM_FDS 260
+
+// integers of every size and data come back in the order they were written
+static void test_values() {
+    handoff_buf_t buf;
+    handoff_init(&buf);
+    handoff_put_int(&buf, 0xab, 1);
+    handoff_put_int(&buf, 0x1234, 2);
+    handoff_put_int(&buf, 0xdeadbeef, 4);
+    handoff_put_int(&buf, 0x0123456789abcdefULL, 8);
+    handoff_put_data(&buf, "hello", 5);
+    handoff_put_data(&buf, NULL, 0);
+    memcpy(handoff_put_data(&buf, NULL, 3), "abc", 3);
+    // enough to grow the buffer a few times
+    for(uint64_t i = 0; i < 5000; i++)
+        handoff_put_int(&buf, i, sizeof(uint64_t));
+    CHECK(handoff_get_int(&buf, 1) == 0xab);
+    CHECK(handoff_get_int(&buf, 2) == 0x1234);
+    CHECK(handoff_get_int(&buf, 4) == 0xdeadbeef);
+    CHECK(handoff_get_int(&buf, 8) == 0x0123456789abcdefULL);
+    len_t len;
+    const char* data = handoff_get_data(&buf, &len);
+    CHECK(len == 5 && memcmp(data, "hello", 5) == 0);
+    handoff_get_data(&buf, &len);
+    CHECK(len == 0);
+    data = handoff_get_data(&buf, &len);
+    CHECK(len == 3 && memcmp(data, "abc", 3) == 0);
+    bool_t same = 1;
+    for(uint64_t i = 0; i < 5000; i++)
+        same &= handoff_get_int(&buf, sizeof(uint64_t)) == i;
+    CHECK(same);
+    CHECK(!buf.failed);
+    handoff_free(&buf);
+}
+
+// reading past the end fails, and every read after that returns nothing
+static void test_truncated() {
+    handoff_buf_t buf;
+    handoff_init(&buf);
+    handoff_put_int(&buf, 7, 4);
+    handoff_put_int(&buf, 100, sizeof(uint64_t));
+    handoff_put_int(&buf, 1, 2);
+    CHECK(handoff_get_int(&buf, 4) == 7);
+    len_t len;
+    // the length is larger than what is left
+    CHECK(handoff_get_data(&buf, &len) == NULL);
+    CHECK(len == 0);
+    CHECK(buf.failed);
+    CHECK(handoff_get_int(&buf, 1) == 0);
+    handoff_free(&buf);
+}
+
+static bool_t test_same_file(int fd, int other) {
+    struct stat st;
+    struct stat other_st;
+    return fstat(fd, &st) == 0 && fstat(other, &other_st) == 0 && st.st_dev == other_st.st_dev && st.st_ino == other_st.st_ino;
+}
+
+// the state and the file descriptors arrive complete and in order
+static void test_transfer() {
+    int socks[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+    int pipes[2];
+    CHECK(pipe(pipes) == 0);
+    int fds[NUM_FDS];
+    for(len_t i = 0; i < NUM_FDS; i++)
+        fds[i] = i%2 == 0 ? pipes[0] : pipes[1];
+    handoff_buf_t buf;
+    handoff_init(&buf);
+    for(uint64_t i = 0; i < 1000; i++)
+        handoff_put_int(&buf, i*i, sizeof(uint64_t));
+    CHECK(handoff_send(socks[0], &buf, fds, NUM_FDS) == OK);
+    handoff_free(&buf);
+    int* received;
+    len_t num_received;
+    CHECK(handoff_recv(socks[1], &buf, &received, &num_received) == OK);
+    CHECK(buf.len == 1000*sizeof(uint64_t));
+    bool_t same = 1;
+    for(uint64_t i = 0; i < 1000; i++)
+        same &= handoff_get_int(&buf, sizeof(uint64_t)) == i*i;
+    CHECK(same);
+    CHECK(num_received == NUM_FDS);
+    same = 1;
+    for(len_t i = 0; i < num_received; i++) {
+        same &= test_same_file(received[i], fds[i]);
+        close(received[i]);
+    }
+    CHECK(same);
+    free(received);
+    handoff_free(&buf);
+    // anything that is not a state is refused
+    CHECK(write(socks[0], "CHATCOLD\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 24) == 24);
+    CHECK(handoff_recv(socks[1], &buf, &received, &num_received) == ERROR);
+    close(pipes[0]);
+    close(pipes[1]);
+    close(socks[0]);
+    close(socks[1]);
+}
+
+int main() {
+    test_values();
+    test_truncated();
+    test_transfer();
+    return test_failed;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../src/queue.h"
+
+// frame of the sender with a body of the given length
+static frame_t* test_frame(id_t id, uint32_t group, bool_t ephemeral, uint64_t seq, len_t body_len) {
+    frame_t* frame = frame_alloc(sizeof(id_t)+sizeof(len_t)+body_len, seq);
+    for(uint32_t i = 0; i < sizeof(id_t); i++)
+        frame->data[i] = (id >> (8*i)) & 0xff;
+    for(uint32_t i = 0; i < sizeof(len_t); i++)
+        frame->data[sizeof(id_t)+i] = (body_len >> (8*i)) & 0xff;
+    memset(frame->data+sizeof(id_t)+sizeof(len_t), 'x', body_len);
+    frame->group = group;
+    frame->flags = ephemeral ? FRAME_EPHEMERAL : 0;
+    return frame;
+}
+
+// bytes and ephemeral frames counted by the queue match its entries
+static void test_counters(const queue_t* queue) {
+    len_t bytes = 0;
+    len_t ephemeral = 0;
+    for(len_t i = 0; i < queue->count; i++) {
+        const frame_t* frame = queue->entries[(queue->first+i) % queue->cap].frame;
+        bytes += frame->len;
+        if(frame->flags & FRAME_EPHEMERAL)
+            ephemeral++;
+    }
+    CHECK(queue->bytes == bytes-queue->offset);
+    CHECK(queue->ephemeral == ephemeral);
+}
+
+static frame_t* test_entry(const queue_t* queue, len_t i) {
+    return queue->entries[(queue->first+i) % queue->cap].frame;
+}
+
+// only the latest ephemeral frame of a sender and group stays queued
+static void test_latest() {
+    queue_t queue;
+    queue_init(&queue);
+    CHECK(queue_push_latest(&queue, test_frame(1, 0, 1, 0, 10), 0) == 0);
+    queue_push(&queue, test_frame(1, 0, 0, 1, 20), 0);
+    CHECK(queue_push_latest(&queue, test_frame(2, 0, 1, 0, 10), 0) == 0);
+    CHECK(queue_push_latest(&queue, test_frame(1, 1, 1, 0, 10), 0) == 0);
+    frame_t* latest = test_frame(1, 0, 1, 0, 30);
+    CHECK(queue_push_latest(&queue, latest, 0) == 1);
+    test_counters(&queue);
+    CHECK(queue.count == 4);
+    CHECK(test_entry(&queue, 0)->len == sizeof(id_t)+sizeof(len_t)+20);
+    CHECK(test_entry(&queue, 3) == latest);
+    // the persistent frame of the sender is never replaced
+    CHECK(queue_push_latest(&queue, test_frame(1, 0, 1, 0, 40), 0) == 1);
+    CHECK(queue.count == 4);
+    CHECK(test_entry(&queue, 0)->seq == 1);
+    test_counters(&queue);
+    queue_free(&queue);
+}
+
+// frames that are being written are not dropped, even if a newer one replaces them
+static void test_pinned() {
+    queue_t queue;
+    queue_init(&queue);
+    queue_push_latest(&queue, test_frame(1, 0, 1, 0, 10), 0);
+    queue_push_latest(&queue, test_frame(2, 0, 1, 0, 10), 0);
+    struct iovec iov[QUEUE_MAX_IOV];
+    CHECK(queue_prepare(&queue, iov) == 2);
+    CHECK(queue_push_latest(&queue, test_frame(1, 0, 1, 0, 10), 0) == 0);
+    CHECK(queue.count == 3);
+    // the first frame was written partially, the second one can go now
+    queue_consume(&queue, 5, NULL, NULL);
+    CHECK(queue_push_latest(&queue, test_frame(2, 0, 1, 0, 10), 0) == 1);
+    CHECK(queue_push_latest(&queue, test_frame(1, 0, 1, 0, 10), 0) == 1);
+    CHECK(queue.count == 3);
+    test_counters(&queue);
+    queue_free(&queue);
+}
+
+// dropping ephemeral frames and skipping to the latest frame keep what the client needs
+static void test_drop() {
+    queue_t queue;
+    queue_init(&queue);
+    queue_push(&queue, test_frame(1, 0, 0, 0, 10), 0);
+    queue_push(&queue, test_frame(1, 0, 1, 0, 10), 0);
+    queue_push(&queue, test_frame(2, 0, 0, 5, 10), 0);
+    queue_push(&queue, test_frame(3, 0, 1, 0, 10), 0);
+    queue_push(&queue, test_frame(3, 0, 0, 6, 10), 0);
+    CHECK(queue_drop_ephemeral(&queue) == 2);
+    test_counters(&queue);
+    CHECK(queue.count == 3);
+    CHECK(queue_skip(&queue) == 1);
+    CHECK(queue.count == 2);
+    CHECK(test_entry(&queue, 0)->seq == 0);
+    CHECK(test_entry(&queue, 1)->seq == 6);
+    test_counters(&queue);
+    queue_free(&queue);
+}
+
+int main() {
+    test_latest();
+    test_pinned();
+    test_drop();
+    return test_failed;
+}
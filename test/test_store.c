@@ -0,0 +1,251 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "test.h"
+#include "../src/store.h"
+
+#define MAX_REPLAYED 16384
+
+// messages handed back by store_open
+typedef struct {
+    uint64_t seq[MAX_REPLAYED];
+    id_t id[MAX_REPLAYED];
+    char group[MAX_REPLAYED][8];
+    len_t count;
+} replayed_t;
+
+static void test_replay(void* arg, const char* msg, len_t len, uint64_t seq, const char* group, len_t group_len) {
+    replayed_t* replayed = (replayed_t*)arg;
+    if(replayed->count == MAX_REPLAYED)
+        return;
+    id_t id = 0;
+    for(uint32_t i = 0; i < sizeof(id_t); i++)
+        id |= (id_t)(uint8_t)msg[i] << (8*i);
+    replayed->seq[replayed->count] = seq;
+    replayed->id[replayed->count] = id;
+    memset(replayed->group[replayed->count], 0, 8);
+    memcpy(replayed->group[replayed->count], group, group_len < 7 ? group_len : 7);
+    replayed->count++;
+}
+
+// message <id><len><body> with a body of the given length
+static len_t test_message(char* msg, id_t id, len_t body_len) {
+    for(uint32_t i = 0; i < sizeof(id_t); i++)
+        msg[i] = (id >> (8*i)) & 0xff;
+    for(uint32_t i = 0; i < sizeof(len_t); i++)
+        msg[sizeof(id_t)+i] = (body_len >> (8*i)) & 0xff;
+    memset(msg+sizeof(id_t)+sizeof(len_t), 'a'+id%26, body_len);
+    return sizeof(id_t)+sizeof(len_t)+body_len;
+}
+
+static void test_append(store_t* store, id_t id, len_t body_len, uint64_t seq, const char* group) {
+    char msg[4096];
+    len_t len = test_message(msg, id, body_len);
+    CHECK(store_append(store, msg, len, seq, group, strlen(group)) == OK);
+}
+
+static void test_open(store_t* store, const char* dir, replayed_t* replayed, uint64_t* seq, id_t* max_id) {
+    memset(replayed, 0, sizeof(replayed_t));
+    *seq = 0;
+    *max_id = 0;
+    CHECK(store_open(store, dir, test_replay, replayed, seq, max_id) == OK);
+}
+
+// save a last checkpoint that keeps everything from oldest on and close the store
+static void test_close(store_t* store, uint64_t oldest) {
+    store_checkpoint_t checkpoint;
+    store_checkpoint_take(store, oldest, 0, &checkpoint);
+    CHECK(store_checkpoint_save(store, &checkpoint) == OK);
+    store_close(store);
+}
+
+static void test_remove_dir(const char* path) {
+    DIR* dir = opendir(path);
+    struct dirent* ent;
+    char file[4096];
+    while(dir != NULL && (ent = readdir(dir)) != NULL) {
+        if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+            unlink(file);
+        }
+    }
+    if(dir != NULL)
+        closedir(dir);
+    rmdir(path);
+}
+
+// every record comes back in order with its group, the sequence number and the largest id are recovered
+static void test_reopen(const char* dir) {
+    store_t store;
+    replayed_t replayed;
+    uint64_t seq;
+    id_t max_id;
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 0);
+    for(uint64_t i = 1; i <= 100; i++)
+        test_append(&store, i%7 == 0 ? 1000+i : i, i, i, i%2 == 0 ? "even" : "");
+    test_close(&store, 1);
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 100);
+    for(len_t i = 0; i < replayed.count; i++) {
+        CHECK(replayed.seq[i] == i+1);
+        CHECK(strcmp(replayed.group[i], (i+1)%2 == 0 ? "even" : "") == 0);
+    }
+    CHECK(seq == 100);
+    CHECK(max_id == 1098);
+    store_close(&store);
+}
+
+// only the records from the checkpoint on are replayed
+static void test_checkpoint(const char* dir) {
+    store_t store;
+    replayed_t replayed;
+    uint64_t seq;
+    id_t max_id;
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    test_append(&store, 1, 10, 101, "");
+    test_close(&store, 61);
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 41);
+    CHECK(replayed.count > 0 && replayed.seq[0] == 61);
+    CHECK(seq == 101);
+    store_close(&store);
+}
+
+// a corrupt record ends the log, the records after it are dropped and appending continues in its place
+static void test_corrupt(const char* dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016lx.log", dir, (len_t)0);
+    struct stat st;
+    CHECK(stat(path, &st) == 0);
+    int fd = open(path, O_RDWR);
+    CHECK(fd != -1);
+    // flip a byte in the body of the last but one record
+    char byte;
+    off_t pos = st.st_size-(20+sizeof(id_t)+sizeof(len_t)+10)-5;
+    CHECK(pread(fd, &byte, 1, pos) == 1);
+    byte ^= 0x40;
+    CHECK(pwrite(fd, &byte, 1, pos) == 1);
+    close(fd);
+    store_t store;
+    replayed_t replayed;
+    uint64_t seq;
+    id_t max_id;
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 39);
+    CHECK(seq == 99);
+    test_append(&store, 2, 10, 102, "");
+    store_close(&store);
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 40);
+    CHECK(replayed.count > 0 && replayed.seq[replayed.count-1] == 102);
+    store_close(&store);
+    // a torn record at the end is dropped as well
+    fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(write(fd, "\x05\x00\x00garbage", 10) == 10);
+    close(fd);
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(replayed.count == 40);
+    CHECK(stat(path, &st) == 0 && store.end == st.st_size);
+    store_close(&store);
+}
+
+// number of snapshot files in the directory
+static len_t test_count_snapshots(const char* path) {
+    len_t count = 0;
+    DIR* dir = opendir(path);
+    struct dirent* ent;
+    while(dir != NULL && (ent = readdir(dir)) != NULL)
+        count += strncmp(ent->d_name, "snapshot-", 9) == 0;
+    if(dir != NULL)
+        closedir(dir);
+    return count;
+}
+
+// an idle group with a single message does not hold the checkpoint back while a busy group keeps writing,
+// its message is kept in a snapshot and comes back after a crash
+static void test_snapshot(const char* dir) {
+    store_t store;
+    replayed_t replayed;
+    uint64_t seq;
+    id_t max_id;
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    char msg[4096];
+    len_t msg_len = test_message(msg, 3, 1000);
+    CHECK(store_append(&store, msg, msg_len, 1, "idle", 4) == OK);
+    // the history of the busy group keeps its last 20 messages
+    uint64_t busy_first = 2;
+    len_t max_lag = 0;
+    len_t snapshots = 0;
+    for(uint64_t i = 2; i < 10000; i++) {
+        CHECK(store_append(&store, msg, msg_len, i, "busy", 4) == OK);
+        if(i-busy_first >= 20)
+            busy_first++;
+        if(!store_checkpoint_due(&store))
+            continue;
+        // the server passes the oldest message it has since the last snapshot
+        uint64_t oldest = store.snapshot_seq <= 1 ? 1 : busy_first;
+        if(oldest < store.snapshot_seq)
+            oldest = store.snapshot_seq;
+        store_checkpoint_t checkpoint;
+        store_checkpoint_take(&store, oldest, 21*msg_len, &checkpoint);
+        if(checkpoint.new_snapshot) {
+            snapshots++;
+            if(checkpoint.snapshot_seq > 1)
+                memcpy(store_snapshot_add(&checkpoint, msg_len, 1, "idle", 4), msg, msg_len);
+            for(uint64_t j = busy_first; j <= i && j < checkpoint.snapshot_seq; j++)
+                memcpy(store_snapshot_add(&checkpoint, msg_len, j, "busy", 4), msg, msg_len);
+        }
+        CHECK(store_checkpoint_save(&store, &checkpoint) == OK);
+        if(store.end-checkpoint.offset > max_lag)
+            max_lag = store.end-checkpoint.offset;
+    }
+    // once the idle message is in the snapshot, the busy group alone moves the checkpoint
+    CHECK(snapshots == 1);
+    CHECK(max_lag < 6*1048576);
+    CHECK(test_count_snapshots(dir) == 1);
+    // crash without a last checkpoint
+    store_close(&store);
+    test_open(&store, dir, &replayed, &seq, &max_id);
+    CHECK(seq == 9999);
+    len_t idle = 0;
+    bool_t busy[20] = { 0 };
+    for(len_t i = 0; i < replayed.count; i++) {
+        if(strcmp(replayed.group[i], "idle") == 0)
+            idle++;
+        else if(replayed.seq[i] >= 9980)
+            busy[replayed.seq[i]-9980] = 1;
+    }
+    CHECK(idle == 1);
+    for(len_t i = 0; i < 20; i++)
+        CHECK(busy[i]);
+    // far less than everything is replayed
+    CHECK(replayed.count < 6000);
+    store_close(&store);
+}
+
+int main() {
+    char dir[] = "/tmp/chat-test-XXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        perror("couldn't create test directory");
+        return 1;
+    }
+    test_reopen(dir);
+    test_checkpoint(dir);
+    test_corrupt(dir);
+    test_remove_dir(dir);
+    char snapshot_dir[] = "/tmp/chat-test-XXXXXX";
+    if(mkdtemp(snapshot_dir) == NULL) {
+        perror("couldn't create test directory");
+        return 1;
+    }
+    test_snapshot(snapshot_dir);
+    test_remove_dir(snapshot_dir);
+    return test_failed;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2019 Roland Bernard
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../src/wheel.h"
+
+#define NUM_TIMERS 2000
+
+typedef struct {
+    wheel_t wheel;
+    wheel_timer_t timers[NUM_TIMERS];
+    uint64_t fired[NUM_TIMERS];   // tick the timer expired at, zero if it did not
+    len_t num_fired;
+    uint64_t now;   // time given to the current call of wheel_advance
+} test_state_t;
+
+static uint64_t test_random(uint64_t* state) {
+    *state = *state*6364136223846793005ULL+1442695040888963407ULL;
+    return *state >> 33;
+}
+
+static void test_expired(void* arg, wheel_timer_t* timer) {
+    test_state_t* state = (test_state_t*)arg;
+    CHECK(!wheel_active(timer));
+    CHECK(state->fired[timer->data] == 0);
+    // the tick of the timer was just handled, it is never late nor early
+    state->fired[timer->data] = state->wheel.tick-1;
+    CHECK(timer->expires <= state->now);
+    state->num_fired++;
+}
+
+// timers on every level cascade down and expire exactly at their tick, however the wheel is advanced
+static void test_cascade(uint64_t seed, uint64_t max_step) {
+    test_state_t* state = (test_state_t*)calloc(1, sizeof(test_state_t));
+    uint64_t start = 1000+test_random(&seed);
+    wheel_init(&state->wheel, start);
+    for(len_t i = 0; i < NUM_TIMERS; i++) {
+        // spread the timers over all levels, some beyond the last one
+        uint64_t range = (uint64_t)1 << (test_random(&seed) % (WHEEL_BITS*WHEEL_LEVELS+4));
+        state->timers[i].data = i;
+        wheel_schedule(&state->wheel, &state->timers[i], start+test_random(&seed) % range);
+    }
+    // cancel and move some of them
+    for(len_t i = 0; i < NUM_TIMERS; i += 7)
+        wheel_cancel(&state->wheel, &state->timers[i]);
+    for(len_t i = 3; i < NUM_TIMERS; i += 11)
+        wheel_schedule(&state->wheel, &state->timers[i], start+test_random(&seed) % 100000);
+    len_t active = 0;
+    uint64_t last = start;
+    for(len_t i = 0; i < NUM_TIMERS; i++) {
+        if(wheel_active(&state->timers[i])) {
+            active++;
+            if(state->timers[i].expires > last)
+                last = state->timers[i].expires;
+        }
+    }
+    CHECK(state->wheel.count == active);
+    state->now = start;
+    while(state->num_fired < active && state->now <= last) {
+        uint64_t earliest = UINT64_MAX;
+        for(len_t i = 0; i < NUM_TIMERS; i++) {
+            if(wheel_active(&state->timers[i]) && state->timers[i].expires < earliest)
+                earliest = state->timers[i].expires;
+        }
+        // the wheel never sleeps past a timer
+        CHECK(wheel_next(&state->wheel) <= (earliest > state->wheel.tick ? earliest : state->wheel.tick));
+        // steps of up to max_step around the next timer, quiet periods are crossed with one step
+        state->now += 1+test_random(&seed) % max_step;
+        uint64_t before = test_random(&seed) % max_step;
+        if(earliest != UINT64_MAX && earliest > before && earliest-before > state->now)
+            state->now = earliest-before;
+        wheel_advance(&state->wheel, state->now, test_expired, state);
+    }
+    CHECK(state->num_fired == active);
+    CHECK(state->wheel.count == 0);
+    CHECK(wheel_next(&state->wheel) == UINT64_MAX);
+    for(len_t i = 0; i < NUM_TIMERS; i++) {
+        if(state->fired[i] != 0)
+            CHECK(state->fired[i] == state->timers[i].expires);
+    }
+    free(state);
+}
+
+// a timer scheduled again by its callback expires at its new time
+static void test_reschedule_expired(void* arg, wheel_timer_t* timer) {
+    test_state_t* state = (test_state_t*)arg;
+    state->fired[state->num_fired++] = state->wheel.tick-1;
+    if(state->num_fired < 5)
+        wheel_schedule(&state->wheel, timer, timer->expires+100);
+}
+
+static void test_reschedule() {
+    test_state_t* state = (test_state_t*)calloc(1, sizeof(test_state_t));
+    wheel_init(&state->wheel, 0);
+    wheel_schedule(&state->wheel, &state->timers[0], 50);
+    wheel_advance(&state->wheel, 10000, test_reschedule_expired, state);
+    CHECK(state->num_fired == 5);
+    for(len_t i = 0; i < 5; i++)
+        CHECK(state->fired[i] == 50+100*i);
+    // a time in the past expires with the next tick
+    wheel_schedule(&state->wheel, &state->timers[1], 5);
+    CHECK(wheel_next(&state->wheel) == 10001);
+    wheel_advance(&state->wheel, 10001, test_reschedule_expired, state);
+    CHECK(state->num_fired == 6);
+    free(state);
+}
+
+int main() {
+    test_cascade(1, 3);
+    test_cascade(2, 300);
+    test_cascade(3, 100000);
+    test_reschedule();
+    return test_failed;
+}